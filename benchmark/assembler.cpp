@@ -0,0 +1,87 @@
+#include "benchmark.h"
+
+#include "assembler.h"
+
+using namespace x86;
+
+// Synthetic compiler-like output: functions with a frame, loops over
+// memory operands, calls between them and a little data.
+static std::string generate(uint functions) {
+    static const char *const registers[] = { "%eax", "%ecx", "%edx", "%ebx", "%esi", "%edi" };
+    std::string text;
+    uint seed = 1;
+
+    auto next = [&](uint range) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) % range;
+    };
+
+    text += "\t.data\n";
+
+    for (uint i = 0; i < functions; i++)
+        text += "table" + toString(i, 10, 0) + ":\n\t.long " + toString(next(1000), 10, 0) + ", " + toString(next(1000), 10, 0) + "\n";
+
+    text += "\t.text\n";
+
+    for (uint i = 0; i < functions; i++) {
+        std::string name = "f" + toString(i, 10, 0);
+
+        text += "\t.globl " + name + "\n" + name + ":\n";
+        text += "\tpushl %ebp\n\tmovl %esp, %ebp\n\tpushl %ebx\n\tpushl %esi\n";
+        text += "\tmovl 8(%ebp), %ecx\n\txorl %eax, %eax\n";
+        text += "1:\n";
+
+        for (uint j = 0; j < 12; j++) {
+            const char *a = registers[next(6)], *b = registers[next(6)];
+
+            switch (next(8)) {
+            case 0:
+                text += std::string("\taddl ") + a + ", " + b + "\n";
+                break;
+            case 1:
+                text += std::string("\tmovl ") + toString(next(64) * 4, 10, 0) + "(%esp), " + a + "\n";
+                break;
+            case 2:
+                text += std::string("\tleal 4(") + a + "," + b + ",4), " + a + "\n";
+                break;
+            case 3:
+                text += std::string("\tcmpl $") + toString(next(1000), 10, 0) + ", " + a + "\n";
+                break;
+            case 4:
+                text += std::string("\tandl $0xff, ") + a + "\n";
+                break;
+            case 5:
+                text += "\taddl table" + toString(next(functions), 10, 0) + "+4, %eax\n";
+                break;
+            case 6:
+                text += std::string("\timull ") + a + ", " + b + "\n";
+                break;
+            default:
+                text += std::string("\tshll $") + toString(next(31) + 1, 10, 0) + ", " + a + "\n";
+                break;
+            }
+        }
+
+        if (i > 0)
+            text += "\tcall f" + toString(next(i), 10, 0) + "\n";
+
+        text += "\tsubl $1, %ecx\n\tjne 1b\n";
+        text += "\tpopl %esi\n\tpopl %ebx\n\tleave\n\tret\n";
+    }
+
+    return text;
+}
+
+// Assembler throughput on generated input, in MB of source per second.
+void benchmarkAssembler() {
+    std::string text = generate(20000);
+    uint size = 0;
+
+    double time = measure([&]() {
+        Compiler c;
+        Assembler(c).assemble(text);
+        size = c.getCode().size();
+    });
+
+    report("assembler", toString(text.size() / 1024, 10, 0) + " KB source, " + toString(size / 1024, 10, 0) + " KB code in " + seconds(time) + ", " + toString(static_cast<int>(text.size() / time / 1e6), 10, 0) + " MB/s");
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include "common.h"
+
+// Shortest wall time of runs calls of f, in seconds.
+double measure(const std::function<void()> &f, uint runs = 5);
+
+// Prints a result line of a benchmark.
+void report(const std::string &benchmark, const std::string &result);
+
+std::string seconds(double value);
+std::string percent(double value);
+std::string ratio(double value);
+
+void benchmarkAssembler();
+void benchmarkCounters();
+void benchmarkExpression();
+void benchmarkProfiler();
+void benchmarkRegex();
+void benchmarkStencil();
+void benchmarkTemplateJIT();
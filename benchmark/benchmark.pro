@@ -0,0 +1,25 @@
+TEMPLATE = app
+CONFIG += console c++11 thread
+CONFIG -= app_bundle
+CONFIG -= qt
+
+LIBS += -L../compiler/release -lcompiler
+LIBS += -lrt
+
+PRE_TARGETDEPS += ../compiler/release/libcompiler.a
+
+INCLUDEPATH += \
+    ../compiler
+
+SOURCES += \
+    assembler.cpp \
+    counters.cpp \
+    expression.cpp \
+    main.cpp \
+    profiler.cpp \
+    regex.cpp \
+    stencil.cpp \
+    templatejit.cpp
+
+HEADERS += \
+    benchmark.h
@@ -0,0 +1,118 @@
+#include "benchmark.h"
+
+#include <atomic>
+#include <thread>
+
+#include "compiler.h"
+#include "threadcounters.h"
+
+using namespace x86;
+
+// A loop with labels taken every iteration and every other one.
+static void generate(Compiler &c, Instrumentation mode) {
+    c.setInstrumentation(mode);
+    c.function("f");
+    c.mov(c.ref(4, ESP), ECX);
+    c.mov(0, EAX);
+    c.label("loop");
+    c.add(ECX, EAX);
+    c.test(1, ECX);
+    c.j(E, c.rel("even"));
+    c.label("odd");
+    c.add(1, EAX);
+    c.label("even");
+    c.sub(1, ECX);
+    c.j(NE, c.rel("loop"));
+    c.ret();
+}
+
+// Fails unless every counter of the per-thread module has the value of its
+// lock-prefixed counterpart.
+static void compare(const Function &shared, const Function &perThread, const std::string &when) {
+    for (auto &counter : shared.getCounters())
+        if (perThread.counter(counter.first) != counter.second)
+            throw std::runtime_error("per-thread counter '" + counter.first + "' disagrees with the shared one " + when);
+}
+
+// The same calls made from several threads with lock-prefixed shared
+// counters and with per-thread copies. Their totals must agree while the
+// threads are alive, once some of them exited and once all did.
+void benchmarkCounters() {
+    if (!ThreadCounters::supported()) {
+        report("counters", "per-thread counters are not supported on this platform");
+        return;
+    }
+
+    const uint threadCount = 8, calls = 20000;
+    Compiler locked, threaded;
+
+    generate(locked, LockedCounters);
+    generate(threaded, PerThreadCounters);
+
+    Function shared = locked.compileFunction(), perThread = threaded.compileFunction();
+
+    auto work = [&](Function &f, uint thread) {
+        for (uint i = 0; i < calls; i++)
+            f.invoke(1, 50 + (i * 7 + thread) % 37);
+    };
+
+    auto run = [&](Function &f) {
+        std::vector<std::thread> threads;
+
+        for (uint i = 0; i < threadCount; i++)
+            threads.emplace_back(work, std::ref(f), i);
+
+        for (std::thread &thread : threads)
+            thread.join();
+    };
+
+    double lockedTime = measure([&]() {
+        run(shared);
+    });
+
+    double threadedTime = measure([&]() {
+        run(perThread);
+    });
+
+    compare(shared, perThread, "after the threads exited");
+
+    // Half of the threads exit after one round, the others park after each
+    // round until the totals are checked.
+    std::atomic<uint> arrived(0), round(0);
+    std::vector<std::thread> threads;
+
+    for (uint i = 0; i < threadCount; i++)
+        threads.emplace_back([&, i]() {
+            for (uint r = 0; r < (i < threadCount / 2 ? 2u : 1u); r++) {
+                work(shared, i);
+                work(perThread, i);
+
+                arrived++;
+
+                while (round.load() == r)
+                    std::this_thread::yield();
+            }
+        });
+
+    while (arrived.load() < threadCount)
+        std::this_thread::yield();
+
+    compare(shared, perThread, "with every thread alive");
+    round = 1;
+
+    for (uint i = threadCount / 2; i < threadCount; i++)
+        threads[i].join();
+
+    while (arrived.load() < threadCount + threadCount / 2)
+        std::this_thread::yield();
+
+    compare(shared, perThread, "after half of the threads exited");
+    round = 2;
+
+    for (uint i = 0; i < threadCount / 2; i++)
+        threads[i].join();
+
+    compare(shared, perThread, "after every thread exited");
+
+    report("counters", toString(threadCount, 10, 0) + " threads x " + toString(calls, 10, 0) + " calls: locked " + seconds(lockedTime) + ", per-thread " + seconds(threadedTime) + ", " + ratio(lockedTime / threadedTime) + " faster; totals agree");
+}
@@ -0,0 +1,72 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "benchmark.h"
+
+// Runs the benchmarks named on the command line, or all of them.
+static const struct {
+    const char *name;
+    void (*run)();
+} benchmarks[] = {
+    { "assembler", benchmarkAssembler },
+    { "counters", benchmarkCounters },
+    { "expression", benchmarkExpression },
+    { "profiler", benchmarkProfiler },
+    { "regex", benchmarkRegex },
+    { "stencil", benchmarkStencil },
+    { "templatejit", benchmarkTemplateJIT }
+};
+
+double measure(const std::function<void()> &f, uint runs) {
+    double best = 0;
+
+    for (uint i = 0; i < runs; i++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (i == 0 || time < best)
+            best = time;
+    }
+
+    return best;
+}
+
+void report(const std::string &benchmark, const std::string &result) {
+    std::cout << benchmark << ": " << result << std::endl;
+}
+
+std::string seconds(double value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.4f s", value);
+    return buffer;
+}
+
+std::string percent(double value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.2f%%", value * 100);
+    return buffer;
+}
+
+std::string ratio(double value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.1fx", value);
+    return buffer;
+}
+
+int main(int argc, char **argv) {
+    for (auto &benchmark : benchmarks) {
+        bool selected = argc == 1;
+
+        for (int i = 1; i < argc; i++)
+            if (strcmp(argv[i], benchmark.name) == 0)
+                selected = true;
+
+        if (selected)
+            benchmark.run();
+    }
+
+    return 0;
+}
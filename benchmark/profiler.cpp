@@ -0,0 +1,54 @@
+#include "benchmark.h"
+
+#include "compiler.h"
+#include "profiler.h"
+
+using namespace x86;
+
+// Cost of sampling at 1 kHz: a generated loop timed with and without the
+// profiler running, with its function registered among others so the
+// handler scans a realistically filled range table.
+void benchmarkProfiler() {
+    Compiler c;
+
+    for (uint i = 0; i < 200; i++) {
+        c.function("f" + toString(i, 10, 0));
+        c.mov(c.ref(4, ESP), ECX);
+        c.mov(0, EAX);
+        c.label("loop" + toString(i, 10, 0));
+        c.add(ECX, EAX);
+        c._xor(i, EAX);
+        c.sub(1, ECX);
+        c.j(NE, c.rel("loop" + toString(i, 10, 0)));
+        c.ret();
+    }
+
+    // invoke() enters at f0, the first function of the module.
+    Function f = c.compileFunction();
+    volatile int sink = 0;
+
+    auto run = [&]() {
+        sink = f.invoke(1, 200000000);
+    };
+
+    double plain = measure(run);
+
+    Profiler::registerFunction(f);
+
+    if (!Profiler::start(1000)) {
+        report("profiler", "sampling is not supported on this platform");
+        return;
+    }
+
+    double sampled = measure(run);
+
+    Profiler::stop();
+
+    std::vector<Profiler::Entry> top = Profiler::report(1);
+
+    report("profiler", "plain " + seconds(plain) + ", sampled at 1 kHz " + seconds(sampled) + ", overhead " + percent(sampled / plain - 1));
+
+    // measure() ran the loop five times with the profiler on.
+    if (!top.empty())
+        report("profiler", "top symbol " + top[0].symbol + " with " + toString(top[0].samples, 10, 0) + " samples (" + toString(static_cast<int>(top[0].samples / (5 * sampled)), 10, 0) + " per second), " + toString(Profiler::unattributed(), 10, 0) + " unattributed");
+}
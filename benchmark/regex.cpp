@@ -0,0 +1,67 @@
+#include "benchmark.h"
+
+#include <regex>
+
+#include "regex.h"
+
+using namespace x86;
+
+// Log-like lines searched line by line with Regex and with std::regex;
+// both must agree on which lines match.
+void benchmarkRegex() {
+    static const char *const patterns[] = {
+        "ERROR: disk",
+        "[0-9]+\\.[0-9]+\\.[0-9]+\\.[0-9]+",
+        "(GET|POST|PUT) /api/v[12]/",
+        "\\w+@\\w+\\.com",
+        "[0-9]{3,} ms$"
+    };
+
+    static const char *const words[] = { "GET", "POST", "/api/v1/users", "/api/v3/items", "ERROR:", "disk", "full", "user@example.com", "timeout", "after", "1500", "ms", "10.0.0.1", "ok" };
+
+    std::vector<std::string> lines;
+    uint seed = 1;
+
+    for (uint i = 0; i < 20000; i++) {
+        std::string line = "2024-01-01 12:00:" + toString(i % 60, 10, 0);
+
+        for (uint j = 0; j < 10; j++) {
+            seed = seed * 1103515245 + 12345;
+            line += std::string(" ") + words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+        }
+
+        lines << line;
+    }
+
+    for (const char *pattern : patterns) {
+        Regex regex(pattern);
+        std::regex reference(pattern);
+        uint compiled = 0, library = 0;
+
+        double native = measure([&]() {
+            compiled = 0;
+
+            for (const std::string &line : lines)
+                compiled += regex.match(line);
+        }, 3);
+
+        double standard = measure([&]() {
+            library = 0;
+
+            for (const std::string &line : lines)
+                library += std::regex_search(line, reference);
+        }, 3);
+
+        if (compiled != library)
+            throw std::runtime_error(std::string("Regex and std::regex disagree on '") + pattern + "'");
+
+        report("regex", std::string("'") + pattern + "': " + toString(compiled, 10, 0) + " of " + toString(lines.size(), 10, 0) + " lines, Regex " + seconds(native) + ", std::regex " + seconds(standard) + ", " + ratio(standard / native) + " faster");
+    }
+
+    // '.' stops at both line terminators, as in std::regex.
+    Regex dot("a.b");
+
+    for (const char *text : { "a b", "a\nb", "a\rb" })
+        if (dot.match(text) != std::regex_search(text, std::regex("a.b")))
+            throw std::runtime_error("Regex and std::regex disagree on '.'");
+}
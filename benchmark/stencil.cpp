@@ -0,0 +1,95 @@
+#include "benchmark.h"
+
+#include "stencil.h"
+
+using namespace x86;
+
+// ((x + a) * b) ^ c with a, b and c as holes.
+static void generate(Compiler &c) {
+    c.mov(c.ref(4, ESP), EAX);
+    c.add(c.abs("a"), EAX);
+    c.mov(c.abs("b"), ECX);
+    c.imul(ECX, EAX);
+    c._xor(c.abs("c"), EAX);
+    c.ret();
+}
+
+// Cost of producing a specialized function: copying and patching a cached
+// stencil against emitting the same code with a Compiler and running
+// compileFunction, for count distinct sets of constants. Only generation
+// is timed; the functions built from one set are run to check they agree.
+void benchmarkStencil() {
+    const uint count = 100000;
+    StencilCache cache;
+    volatile int sink = 0;
+
+    double emitted = measure([&]() {
+        for (uint i = 0; i < count; i++) {
+            Compiler c;
+            generate(c);
+            c.relocate("a", i);
+            c.relocate("b", 3);
+            c.relocate("c", 5);
+            sink = c.compileFunction().getCode()[0];
+        }
+    });
+
+    double instantiated = measure([&]() {
+        for (uint i = 0; i < count; i++) {
+            const Stencil &stencil = cache.get("affine", generate);
+            std::vector<int> values(3);
+
+            values[stencil.arg("a")] = i;
+            values[stencil.arg("b")] = 3;
+            values[stencil.arg("c")] = 5;
+
+            sink = stencil.instantiate(values).getCode()[0];
+        }
+    });
+
+    // Instances kept in a CodeHeap: moved there from their own Function,
+    // or copied straight into an arena slot.
+    CodeHeap heap;
+
+    auto fill = [&](bool direct) {
+        return measure([&]() {
+            heap.clear();
+
+            for (uint i = 0; i < count; i++) {
+                const Stencil &stencil = cache.get("affine", generate);
+                std::vector<int> values(3);
+
+                values[stencil.arg("a")] = i;
+                values[stencil.arg("b")] = 3;
+                values[stencil.arg("c")] = 5;
+
+                Function &f = direct ? stencil.instantiate(heap, values) : heap.add(stencil.instantiate(values));
+                sink = f.getCode()[0];
+            }
+        });
+    };
+
+    double added = fill(false), placed = fill(true);
+
+    // All paths must produce the same code.
+    Compiler c;
+    generate(c);
+    c.relocate("a", 11);
+    c.relocate("b", 3);
+    c.relocate("c", 5);
+
+    const Stencil &stencil = cache.get("affine", generate);
+    std::vector<int> values(3);
+
+    values[stencil.arg("a")] = 11;
+    values[stencil.arg("b")] = 3;
+    values[stencil.arg("c")] = 5;
+
+    int expected = c.compileFunction().invoke(1, 7);
+
+    if (stencil.instantiate(values).invoke(1, 7) != expected || stencil.instantiate(heap, values).invoke(1, 7) != expected)
+        throw std::runtime_error("stencil and compiled function disagree");
+
+    report("stencil", toString(count, 10, 0) + " functions: Compiler " + seconds(emitted) + ", stencil " + seconds(instantiated) + ", " + ratio(emitted / instantiated) + " faster");
+    report("stencil", toString(count, 10, 0) + " functions in a CodeHeap: added " + seconds(added) + ", placed " + seconds(placed) + ", " + ratio(added / placed) + " faster");
+}
@@ -0,0 +1,151 @@
+#include "benchmark.h"
+
+#include "templatejit.h"
+
+using namespace x86;
+
+typedef TemplateJIT::StandardOpcode Op;
+
+static void emit(std::vector<byte> &code, Op op) {
+    code << static_cast<byte>(op);
+}
+
+static void emit(std::vector<byte> &code, Op op, int operand) {
+    code << static_cast<byte>(op);
+
+    for (uint i = 0; i < 4; i++)
+        code << static_cast<byte>(operand >> (8 * i));
+}
+
+// A switch-dispatched interpreter of the standard opcodes, without helper
+// calls.
+static int interpret(const std::vector<byte> &code, int *locals) {
+    int stack[64];
+    int sp = 0;
+    uint pc = 0;
+
+    for (;;) {
+        Op op = static_cast<Op>(code[pc]);
+        int operand = 0;
+
+        memcpy(&operand, &code[pc + 1], sizeof(operand));
+
+        switch (op) {
+        case TemplateJIT::Push:
+            stack[sp++] = operand;
+            pc += 5;
+            break;
+        case TemplateJIT::Load:
+            stack[sp++] = locals[operand];
+            pc += 5;
+            break;
+        case TemplateJIT::Store:
+            locals[operand] = stack[--sp];
+            pc += 5;
+            break;
+        case TemplateJIT::Drop:
+            sp--;
+            pc++;
+            break;
+        case TemplateJIT::Add:
+            sp--;
+            stack[sp - 1] = static_cast<uint>(stack[sp - 1]) + stack[sp];
+            pc++;
+            break;
+        case TemplateJIT::Sub:
+            sp--;
+            stack[sp - 1] = static_cast<uint>(stack[sp - 1]) - stack[sp];
+            pc++;
+            break;
+        case TemplateJIT::Mul:
+            sp--;
+            stack[sp - 1] = static_cast<uint>(stack[sp - 1]) * stack[sp];
+            pc++;
+            break;
+        case TemplateJIT::Less:
+            sp--;
+            stack[sp - 1] = stack[sp - 1] < stack[sp];
+            pc++;
+            break;
+        case TemplateJIT::Equal:
+            sp--;
+            stack[sp - 1] = stack[sp - 1] == stack[sp];
+            pc++;
+            break;
+        case TemplateJIT::Jump:
+            pc = operand;
+            break;
+        case TemplateJIT::JumpIfZero:
+            pc = stack[--sp] ? pc + 5 : operand;
+            break;
+        case TemplateJIT::Return:
+            return stack[--sp];
+        default:
+            throw std::runtime_error("opcode " + toString(op, 10, 0) + " is not interpreted");
+        }
+    }
+}
+
+// Sum of i * i for i < n, run by the interpreter and by TemplateJIT code.
+void benchmarkTemplateJIT() {
+    enum { N, I, Sum };
+
+    std::vector<byte> code;
+
+    emit(code, TemplateJIT::Push, 0);
+    emit(code, TemplateJIT::Store, I);
+    emit(code, TemplateJIT::Push, 0);
+    emit(code, TemplateJIT::Store, Sum);
+
+    int loop = code.size();
+
+    emit(code, TemplateJIT::Load, I);
+    emit(code, TemplateJIT::Load, N);
+    emit(code, TemplateJIT::Less);
+
+    uint exit = code.size() + 1;
+
+    emit(code, TemplateJIT::JumpIfZero, 0);
+    emit(code, TemplateJIT::Load, Sum);
+    emit(code, TemplateJIT::Load, I);
+    emit(code, TemplateJIT::Load, I);
+    emit(code, TemplateJIT::Mul);
+    emit(code, TemplateJIT::Add);
+    emit(code, TemplateJIT::Store, Sum);
+    emit(code, TemplateJIT::Load, I);
+    emit(code, TemplateJIT::Push, 1);
+    emit(code, TemplateJIT::Add);
+    emit(code, TemplateJIT::Store, I);
+    emit(code, TemplateJIT::Jump, loop);
+
+    int done = code.size();
+    memcpy(&code[exit], &done, sizeof(done));
+
+    emit(code, TemplateJIT::Load, Sum);
+    emit(code, TemplateJIT::Return);
+
+    const int n = 20000000;
+
+    // Static, so the generated code can reach them with 32-bit addresses.
+    static int locals[3];
+    static VMState state = { locals, 0 };
+
+    int interpreted = 0, compiled = 0;
+
+    double interpreter = measure([&]() {
+        locals[N] = n;
+        interpreted = interpret(code, locals);
+    });
+
+    Function f = TemplateJIT::standard().compile(code, "squares");
+
+    double jit = measure([&]() {
+        locals[N] = n;
+        compiled = f.invoke(1, reinterpret_cast<int>(&state));
+    });
+
+    if (interpreted != compiled)
+        throw std::runtime_error("interpreter and TemplateJIT disagree");
+
+    report("templatejit", toString(n, 10, 0) + " iterations: interpreter " + seconds(interpreter) + ", TemplateJIT " + seconds(jit) + ", " + ratio(interpreter / jit) + " faster");
+}
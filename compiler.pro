@@ -3,6 +3,8 @@ CONFIG += ordered
 
 SUBDIRS = \
     compiler \
-    test
+    test \
+    benchmark
 
 test.depends = compiler
+benchmark.depends = compiler
@@ -0,0 +1,181 @@
+#include "archive.h"
+
+#include "common.h"
+
+#include <map>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+namespace x86 {
+
+void Archive::add(const std::string &name, const Compiler &module) {
+    std::vector<std::string> symbols;
+
+    for (const std::string &func : module.funcs)
+        symbols << "_" + func;
+
+    add(name, module.writeOBJ(), symbols);
+}
+
+void Archive::add(const std::string &name, const ByteArray &object, const std::vector<std::string> &symbols) {
+    members.push_back({ name, object, symbols });
+}
+
+void Archive::write(std::ostream &stream) const {
+    std::map<std::string, uint> index;
+
+    for (uint i = 0; i < members.size(); i++)
+        for (const std::string &symbol : members[i].symbols)
+            if (!index.insert({ symbol, i }).second)
+                throw std::runtime_error("symbol '" + symbol + "' is defined in more than one member");
+
+    // Member names that do not fit the 16 character header field, minus the
+    // terminating slash, go to the "//" member and are referred to as
+    // "/offset".
+    std::string longNames;
+    std::vector<std::string> names;
+
+    for (const Member &member : members)
+        if (member.name.size() < 16)
+            names << member.name + "/";
+        else {
+            names << "/" + toString(longNames.size(), 10, 0);
+            longNames += member.name + "/\n";
+        }
+
+    uint symbolNamesSize = 0;
+
+    for (auto &symbol : index)
+        symbolNamesSize += symbol.first.size() + 1;
+
+    uint firstIndexSize = 4 + 4 * index.size() + symbolNamesSize;
+    uint secondIndexSize = 4 + 4 * members.size() + 4 + 2 * index.size() + symbolNamesSize;
+
+    // Offsets are counted from the start of the archive, which need not be
+    // the start of the stream.
+    std::streampos start = stream.tellp();
+    uint size = 0;
+
+    auto put = [&](const void *data, uint count) {
+        stream.write(static_cast<const char *>(data), count);
+        size += count;
+    };
+
+    auto put32 = [&](uint32_t value) {
+        put(&value, sizeof(value));
+    };
+
+    auto header = [&](const std::string &name, uint length) {
+        char fields[61];
+        sprintf(fields, "%-16s%-12s%-6s%-6s%-8s%-10u`\n", name.data(), "0", "0", "0", "644", length);
+        put(fields, 60);
+    };
+
+    auto pad = [&]() {
+        if (size % 2)
+            put("\n", 1);
+    };
+
+    put("!<arch>\n", 8);
+
+    // System V index: big-endian member offsets per symbol, then the names.
+    // Member order is kept, so symbols are listed as they appear in members.
+    // The offsets are zero until the members have been written.
+    header("/", firstIndexSize);
+    put32(__builtin_bswap32(index.size()));
+
+    std::vector<std::pair<uint, std::string>> ordered;
+
+    for (auto &symbol : index)
+        ordered.push_back({ symbol.second, symbol.first });
+
+    std::stable_sort(ordered.begin(), ordered.end(), [](const std::pair<uint, std::string> &a, const std::pair<uint, std::string> &b) {
+        return a.first < b.first;
+    });
+
+    uint firstOffsets = size;
+
+    for (uint i = 0; i < ordered.size(); i++)
+        put32(0);
+
+    for (auto &symbol : ordered)
+        put(symbol.second.data(), symbol.second.size() + 1);
+
+    pad();
+
+    // Microsoft index: little-endian member offsets, then sorted symbols with
+    // 1-based member numbers.
+    header("/", secondIndexSize);
+    put32(members.size());
+
+    uint secondOffsets = size;
+
+    for (uint i = 0; i < members.size(); i++)
+        put32(0);
+
+    put32(index.size());
+
+    for (auto &symbol : index) {
+        uint16_t member = symbol.second + 1;
+        put(&member, sizeof(member));
+    }
+
+    for (auto &symbol : index)
+        put(symbol.first.data(), symbol.first.size() + 1);
+
+    pad();
+
+    if (!longNames.empty()) {
+        header("//", longNames.size());
+        put(longNames.data(), longNames.size());
+        pad();
+    }
+
+    std::vector<uint32_t> offsets;
+
+    for (uint i = 0; i < members.size(); i++) {
+        offsets << size;
+
+        header(names[i], members[i].object.size());
+        put(members[i].object.data(), members[i].object.size());
+        pad();
+    }
+
+    // Fills in the offsets now that the members are placed.
+    std::vector<uint32_t> firstIndex;
+
+    for (auto &symbol : ordered)
+        firstIndex << __builtin_bswap32(offsets[symbol.first]);
+
+    stream.seekp(start + std::streamoff(firstOffsets));
+    stream.write(reinterpret_cast<const char *>(firstIndex.data()), 4 * firstIndex.size());
+    stream.seekp(start + std::streamoff(secondOffsets));
+    stream.write(reinterpret_cast<const char *>(offsets.data()), 4 * offsets.size());
+    stream.seekp(start + std::streamoff(size));
+
+    if (!stream)
+        throw std::runtime_error("cannot write the archive");
+}
+
+ByteArray Archive::write() const {
+    std::ostringstream stream;
+    write(stream);
+
+    std::string data = stream.str();
+    ByteArray image;
+
+    image.push(reinterpret_cast<const byte *>(data.data()), data.size());
+    return image;
+}
+
+void Archive::write(const std::string &fileName) const {
+    std::ofstream stream(fileName, std::ios::binary);
+
+    if (!stream)
+        throw std::runtime_error("cannot open '" + fileName + "'");
+
+    write(stream);
+}
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <ostream>
+
+#include "compiler.h"
+
+namespace x86 {
+
+// Bundles objects into a static library in ar format. The archive starts
+// with a symbol index of every member's functions, in both the System V
+// layout read by GNU ld and the sorted one MSVC's link expects, so a linker
+// finds the member defining a symbol with one lookup.
+class Archive {
+    struct Member {
+        std::string name;
+        ByteArray object;
+        std::vector<std::string> symbols;
+    };
+
+    std::vector<Member> members;
+
+public:
+    // Adds module.writeOBJ() as member name, indexing the module's functions.
+    void add(const std::string &name, const Compiler &module);
+    void add(const std::string &name, const ByteArray &object, const std::vector<std::string> &symbols);
+
+    // Writes the index with zero offsets, streams the members after it and
+    // then seeks back to fill the offsets in, so the stream must be
+    // seekable; a file is written without holding the archive in memory.
+    void write(std::ostream &stream) const;
+    ByteArray write() const;
+    void write(const std::string &fileName) const;
+};
+}
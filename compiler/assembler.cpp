@@ -0,0 +1,1316 @@
+#include "assembler.h"
+
+#include "common.h"
+
+#include <cctype>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+namespace x86 {
+
+namespace {
+
+bool isAlnum(char ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9');
+}
+
+bool isIdentifierChar(char ch) {
+    return isAlnum(ch) || ch == '_' || ch == '.' || ch == '$' || ch == '@';
+}
+
+// Open addressing hash table looking names up in place, so mnemonics and
+// registers are found without building a string for them.
+template <class T>
+class NameTable {
+    struct Entry {
+        std::string name;
+        T value;
+    };
+
+    std::vector<Entry> entries;
+
+    static uint hash(const char *name, uint length) {
+        uint result = 2166136261u;
+
+        for (uint i = 0; i < length; i++)
+            result = (result ^ static_cast<byte>(name[i])) * 16777619u;
+
+        return result;
+    }
+
+public:
+    explicit NameTable(uint capacity) {
+        uint size = 16;
+
+        while (size < 2 * capacity)
+            size *= 2;
+
+        entries.resize(size);
+    }
+
+    // Keeps the value of a name already present.
+    void insert(const std::string &name, const T &value) {
+        uint mask = entries.size() - 1;
+
+        for (uint i = hash(name.data(), name.size()) & mask;; i = (i + 1) & mask)
+            if (entries[i].name.empty()) {
+                entries[i] = { name, value };
+                return;
+            } else if (entries[i].name == name)
+                return;
+    }
+
+    const T *find(const char *name, uint length) const {
+        uint mask = entries.size() - 1;
+
+        for (uint i = hash(name, length) & mask; !entries[i].name.empty(); i = (i + 1) & mask)
+            if (entries[i].name.size() == length && memcmp(entries[i].name.data(), name, length) == 0)
+                return &entries[i].value;
+
+        return nullptr;
+    }
+};
+}
+
+Assembler::Operand::Operand(OperandKind kind, uint reg, const Value &value, bool indirect, bool bare, const MemRef &mem)
+    : kind(kind)
+    , reg(reg)
+    , value(value)
+    , indirect(indirect)
+    , bare(bare)
+    , mem(mem) {
+}
+
+Assembler::Assembler(Compiler &c)
+    : c(c)
+    , section(c.text)
+    , pos(0)
+    , end(0)
+    , line(0) {
+}
+
+void Assembler::assemble(const char *text, uint size) {
+    pos = text;
+    end = text + size;
+    line = 1;
+
+    try {
+        while (pos < end)
+            statement();
+
+        declareExternals();
+    } catch (const std::runtime_error &e) {
+        throw std::runtime_error("line " + toString(line, 10, 0) + ": " + e.what());
+    }
+}
+
+void Assembler::assemble(const std::string &text) {
+    assemble(text.data(), text.size());
+}
+
+void Assembler::statement() {
+    skipSpaces();
+
+    if (pos < end && *pos == '#')
+        while (pos < end && *pos != '\n')
+            pos++;
+
+    if (pos == end)
+        return;
+
+    if (*pos == '\n' || *pos == ';') {
+        if (*pos == '\n')
+            line++;
+
+        pos++;
+        return;
+    }
+
+    uint length = word();
+    const char *name = pos - length;
+
+    // A label leaves the rest of the line to the next statement.
+    if (accept(':')) {
+        label(std::string(name, length));
+        return;
+    }
+
+    if (name[0] == '.')
+        directive(std::string(name, length));
+    else
+        instruction(name, length);
+
+    if (!atEnd())
+        error("unexpected '" + std::string(1, *pos) + "'");
+}
+
+void Assembler::instruction(const char *mnemonic, uint length) {
+    auto is = [&](const char *prefix) {
+        return strlen(prefix) == length && memcmp(prefix, mnemonic, length) == 0;
+    };
+
+    if (section != Compiler::TEXT && section != Compiler::COLD)
+        error("instruction '" + std::string(mnemonic, length) + "' outside of .text");
+
+    if (is("lock") || is("rep") || is("repe") || is("repz") || is("repne") || is("repnz")) {
+        if (is("lock"))
+            c.lock();
+        else if (is("rep"))
+            c.rep();
+        else if (is("repe") || is("repz"))
+            c.repe();
+        else
+            c.repne();
+
+        if (!atEnd()) {
+            uint next = word();
+            instruction(pos - next, next);
+        }
+
+        return;
+    }
+
+    operands.clear();
+
+    if (!atEnd())
+        do {
+            if (operands.size() == MAX_OPERANDS)
+                error("too many operands for '" + std::string(mnemonic, length) + "'");
+
+            operands.push_back(parseOperand());
+        } while (accept(','));
+
+    const std::vector<Handler> *forms = lookup(mnemonic, length);
+
+    if (!forms)
+        error("unknown instruction '" + std::string(mnemonic, length) + "'");
+
+    for (const Handler &handler : *forms)
+        if (handler(c, operands.data(), operands.size()))
+            return;
+
+    error("invalid operands for '" + std::string(mnemonic, length) + "'");
+}
+
+void Assembler::directive(const std::string &name) {
+    if (name == ".text")
+        setSection(Compiler::TEXT);
+    else if (name == ".data")
+        setSection(Compiler::DATA);
+    else if (name == ".bss")
+        setSection(Compiler::BSS);
+    else if (name == ".section") {
+        std::string sectionName = identifier();
+        skipStatement();
+
+        if (sectionName == ".text")
+            setSection(Compiler::TEXT);
+        else if (sectionName == ".text.cold" || sectionName == ".text.unlikely")
+            setSection(Compiler::COLD);
+        else if (sectionName == ".data")
+            setSection(Compiler::DATA);
+        else if (sectionName == ".bss")
+            setSection(Compiler::BSS);
+        else if (sectionName == ".rdata" || sectionName.compare(0, 7, ".rodata") == 0)
+            setSection(Compiler::RDATA);
+        else if (sectionName.compare(0, 5, ".note") == 0 || sectionName == ".comment")
+            setSection(static_cast<SectionID>(0));
+        else
+            error("unsupported section '" + sectionName + "'");
+    } else if (name == ".align" || name == ".balign" || name == ".p2align") {
+        int alignment = constant(parseExpression());
+        byte fill = 0;
+
+        // The optional maximum number of bytes to skip is not honoured; the
+        // location is always aligned.
+        if (accept(',')) {
+            if (!atEnd() && *pos != ',')
+                fill = constant(parseExpression());
+
+            if (accept(','))
+                parseExpression();
+        }
+
+        if (name == ".p2align")
+            alignment = alignment >= 0 && alignment < 31 ? 1 << alignment : 0;
+
+        if (alignment <= 0)
+            error("invalid alignment");
+
+        alignSection(alignment, fill);
+    } else if (name == ".globl" || name == ".global") {
+        do {
+            std::string symbol = identifier();
+            globals.insert(symbol);
+
+            if (c.isSymbolDefined(symbol) && c.symbols.at(symbol).baseSymbol == ".text" && find(c.funcs.begin(), c.funcs.end(), symbol) == c.funcs.end())
+                c.funcs << symbol;
+        } while (accept(','));
+    } else if (name == ".set" || name == ".equ") {
+        std::string symbol = identifier();
+        expect(',');
+        constants[symbol] = constant(parseExpression());
+    } else if (name == ".byte" || name == ".short" || name == ".word" || name == ".value" || name == ".long" || name == ".int" || name == ".quad") {
+        uint size = name == ".byte" ? 1 : name == ".long" || name == ".int" ? 4 : name == ".quad" ? 8 : 2;
+
+        do
+            emitValue(parseExpression(), size);
+        while (accept(','));
+    } else if (name == ".ascii" || name == ".asciz" || name == ".string") {
+        do {
+            std::string str = parseString();
+            emit(str.data(), str.size() + (name == ".ascii" ? 0 : 1));
+        } while (accept(','));
+    } else if (name == ".zero" || name == ".skip" || name == ".space") {
+        int count = constant(parseExpression());
+        byte value = accept(',') ? constant(parseExpression()) : 0;
+
+        if (count < 0)
+            error("negative size");
+
+        if (section == Compiler::BSS && value == 0)
+            c.section(Compiler::BSS).allocate(count);
+        else {
+            std::string bytes(count, static_cast<char>(value));
+            emit(bytes.data(), bytes.size());
+        }
+    } else if (name == ".comm" || name == ".lcomm") {
+        std::string symbol = identifier();
+        expect(',');
+        int size = constant(parseExpression());
+        int alignment = accept(',') ? constant(parseExpression()) : 4;
+
+        if (size < 0 || alignment <= 0)
+            error("invalid size or alignment of '" + symbol + "'");
+
+        c.section(Compiler::BSS).allocate((alignment - c.sectionSize(Compiler::BSS) % alignment) % alignment);
+        c.bss(symbol, size);
+    } else if (name == ".file" || name == ".ident" || name == ".type" || name == ".size" || name == ".loc" || name.compare(0, 5, ".cfi_") == 0)
+        skipStatement();
+    else
+        error("unknown directive '" + name + "'");
+}
+
+void Assembler::label(const std::string &name) {
+    std::string symbol = name;
+
+    if (isdigit(static_cast<byte>(name[0]))) {
+        if (!std::all_of(name.begin(), name.end(), [](char ch) { return isdigit(static_cast<byte>(ch)); }))
+            error("invalid label '" + name + "'");
+
+        symbol = numericLabel(name, numericLabels[name]++);
+    }
+
+    if (section == Compiler::TEXT && globals.count(symbol))
+        c.function(symbol);
+    else if (section == Compiler::TEXT || section == Compiler::COLD)
+        c.label(symbol);
+    else if (section)
+        c.pushSymbol(symbol, Compiler::sectionName(section), c.sectionSize(section));
+    else
+        error("label '" + name + "' in a discarded section");
+}
+
+void Assembler::setSection(SectionID id) {
+    if (id == Compiler::COLD)
+        c.cold();
+    else
+        c.hot();
+
+    section = id;
+}
+
+void Assembler::emit(const void *data, uint size) {
+    if (!section)
+        return;
+
+    if (section == Compiler::BSS)
+        error(".bss can only hold zeros");
+
+    c.section(section).push(reinterpret_cast<const byte *>(data), size);
+}
+
+void Assembler::emitValue(const Value &value, uint size) {
+    if (value.symbol.empty()) {
+        long long wide = value.offset;
+        emit(&wide, size);
+        return;
+    }
+
+    if (size != 4)
+        error("'" + value.symbol + "' needs a 4 byte field");
+
+    if (section == Compiler::BSS)
+        error(".bss can only hold zeros");
+
+    if (section)
+        c.reference(section, SymRef(value.symbol, Compiler::RefAbs, value.offset));
+}
+
+void Assembler::alignSection(uint alignment, byte fill) {
+    if (section == Compiler::TEXT || section == Compiler::COLD)
+        c.align(alignment);
+    else if (section == Compiler::BSS)
+        c.section(Compiler::BSS).allocate((alignment - c.sectionSize(Compiler::BSS) % alignment) % alignment);
+    else if (section) {
+        std::string bytes((alignment - c.sectionSize(section) % alignment) % alignment, static_cast<char>(fill));
+        emit(bytes.data(), bytes.size());
+    }
+}
+
+void Assembler::declareExternals() {
+    std::set<std::string> undefined, branched;
+
+    // References leave undefined symbols in the Compiler without a base.
+    for (auto &symbol : c.symbols)
+        if (symbol.second.baseSymbol.empty() && referenced.count(symbol.first))
+            undefined.insert(symbol.first);
+
+    if (!undefined.empty())
+        for (const Compiler::Reloc &reloc : c.relocs)
+            if (reloc.type == Compiler::RefRel && undefined.count(reloc.name))
+                branched.insert(reloc.name);
+
+    for (const std::string &name : undefined)
+        if (branched.count(name))
+            c.externalFunction(name);
+        else
+            c.externalVariable(name);
+
+    referenced.clear();
+}
+
+Assembler::Operand Assembler::parseOperand() {
+    static const NameTable<std::pair<OperandKind, uint>> registers = [] {
+        static const struct {
+            const char *name;
+            OperandKind kind;
+            uint reg;
+        } names[] = {
+            { "eax", Reg, EAX }, { "ecx", Reg, ECX }, { "edx", Reg, EDX }, { "ebx", Reg, EBX },
+            { "esp", Reg, ESP }, { "ebp", Reg, EBP }, { "esi", Reg, ESI }, { "edi", Reg, EDI },
+            { "ax", Word, EAX }, { "cx", Word, ECX }, { "dx", Word, EDX }, { "bx", Word, EBX },
+            { "sp", Word, ESP }, { "bp", Word, EBP }, { "si", Word, ESI }, { "di", Word, EDI },
+            { "al", Byte, AL }, { "cl", Byte, CL }, { "dl", Byte, DL }, { "bl", Byte, BL },
+            { "ah", Byte, AH }, { "ch", Byte, CH }, { "dh", Byte, DH }, { "bh", Byte, BH },
+            { "xmm0", XMM, XMM0 }, { "xmm1", XMM, XMM1 }, { "xmm2", XMM, XMM2 }, { "xmm3", XMM, XMM3 },
+            { "xmm4", XMM, XMM4 }, { "xmm5", XMM, XMM5 }, { "xmm6", XMM, XMM6 }, { "xmm7", XMM, XMM7 },
+            { "ymm0", YMM, YMM0 }, { "ymm1", YMM, YMM1 }, { "ymm2", YMM, YMM2 }, { "ymm3", YMM, YMM3 },
+            { "ymm4", YMM, YMM4 }, { "ymm5", YMM, YMM5 }, { "ymm6", YMM, YMM6 }, { "ymm7", YMM, YMM7 },
+            { "st", FPU, ST0 }
+        };
+
+        NameTable<std::pair<OperandKind, uint>> table(sizeof(names) / sizeof(names[0]));
+
+        for (auto &name : names)
+            table.insert(name.name, { name.kind, name.reg });
+
+        return table;
+    }();
+
+    auto parseRegister = [&](OperandKind &kind, uint &reg) {
+        expect('%');
+
+        const char *start = pos;
+
+        while (pos < end && isAlnum(*pos))
+            pos++;
+
+        const std::pair<OperandKind, uint> *found = registers.find(start, pos - start);
+
+        if (!found)
+            error("unknown register '%" + std::string(start, pos) + "'");
+
+        kind = found->first;
+        reg = found->second;
+
+        if (kind == FPU && accept('(')) {
+            reg = constant(parseExpression());
+
+            if (reg > ST7)
+                error("invalid register '%st(" + toString(reg, 10, 0) + ")'");
+
+            expect(')');
+        }
+    };
+
+    auto parseBaseOrIndex = [&]() {
+        OperandKind kind;
+        uint reg;
+        parseRegister(kind, reg);
+
+        if (kind != Reg)
+            error("address registers must be 32-bit");
+
+        return static_cast<Register>(reg);
+    };
+
+    const MemRef none(0, 0);
+    Value value = { "", 0 };
+    bool indirect = accept('*');
+
+    skipSpaces();
+
+    if (pos < end && *pos == '%') {
+        OperandKind kind;
+        uint reg;
+        parseRegister(kind, reg);
+
+        return Operand(kind, reg, value, indirect, false, none);
+    }
+
+    if (accept('$'))
+        return Operand(Imm, 0, parseExpression(), indirect, false, none);
+
+    // '(' starts the base and index unless it opens an expression.
+    const char *next = pos + 1;
+
+    while (next < end && (*next == ' ' || *next == '\t'))
+        next++;
+
+    if (pos == end || *pos != '(' || (next < end && *next != '%' && *next != ','))
+        value = parseExpression();
+
+    bool hasBase = false, hasIndex = false, bare = false;
+    Register base = EAX, index = EAX;
+    int scale = 1;
+
+    if (accept('(')) {
+        skipSpaces();
+
+        if (pos < end && *pos == '%') {
+            base = parseBaseOrIndex();
+            hasBase = true;
+        }
+
+        if (accept(',')) {
+            skipSpaces();
+            index = parseBaseOrIndex();
+            hasIndex = true;
+
+            if (accept(','))
+                scale = constant(parseExpression());
+
+            if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+                error("invalid scale " + toString(scale, 10, 0));
+        }
+
+        expect(')');
+    } else
+        bare = true;
+
+    SymRef ref(value.symbol, Compiler::RefAbs, value.offset);
+    bool named = !value.symbol.empty();
+    int disp = value.offset;
+
+    if (!hasBase && !hasIndex)
+        return Operand(Mem, 0, value, indirect, bare, named ? c.ref(ref) : c.ref(disp));
+    else if (!hasIndex)
+        return Operand(Mem, 0, value, indirect, bare, named ? c.ref(ref, base) : disp ? c.ref(disp, base) : c.ref(base));
+    else if (!hasBase)
+        return Operand(Mem, 0, value, indirect, bare, named ? c.ref(ref, index, scale) : disp ? c.ref(disp, index, scale) : c.ref(index, scale));
+    else
+        return Operand(Mem, 0, value, indirect, bare, named ? c.ref(ref, base, index, scale) : disp ? c.ref(disp, base, index, scale) : c.ref(base, index, scale));
+}
+
+std::string Assembler::parseString() {
+    skipSpaces();
+    expect('"');
+
+    std::string str;
+
+    while (true) {
+        if (pos == end || *pos == '\n')
+            error("unterminated string");
+
+        char ch = *pos++;
+
+        if (ch == '"')
+            return str;
+
+        str += ch == '\\' ? static_cast<char>(escape()) : ch;
+    }
+}
+
+byte Assembler::escape() {
+    if (pos == end)
+        error("unterminated escape sequence");
+
+    char ch = *pos++;
+
+    switch (ch) {
+    case 'b':
+        return '\b';
+    case 'f':
+        return '\f';
+    case 'n':
+        return '\n';
+    case 'r':
+        return '\r';
+    case 't':
+        return '\t';
+    case 'v':
+        return '\v';
+    case 'x': {
+        uint value = 0;
+
+        while (pos < end && isxdigit(static_cast<byte>(*pos))) {
+            value = value * 16 + (isdigit(static_cast<byte>(*pos)) ? *pos - '0' : tolower(*pos) - 'a' + 10);
+            pos++;
+        }
+
+        return value;
+    }
+    default:
+        if (ch >= '0' && ch <= '7') {
+            uint value = ch - '0';
+
+            for (int i = 0; i < 2 && pos < end && *pos >= '0' && *pos <= '7'; i++)
+                value = value * 8 + (*pos++ - '0');
+
+            return value;
+        }
+
+        return ch;
+    }
+}
+
+Assembler::Value Assembler::parseExpression() {
+    Value left = parseBitwise();
+
+    while (true)
+        if (accept('+')) {
+            Value right = parseBitwise();
+
+            if (!left.symbol.empty() && !right.symbol.empty())
+                error("cannot add '" + right.symbol + "' to '" + left.symbol + "'");
+
+            left = { left.symbol.empty() ? right.symbol : left.symbol, left.offset + right.offset };
+        } else if (accept('-')) {
+            Value right = parseBitwise();
+
+            if (!right.symbol.empty()) {
+                // The difference of two symbols in one section is a constant
+                // once both are defined.
+                auto defined = [&](const std::string &name) {
+                    return c.isSymbolDefined(name) && !c.symbols.at(name).baseSymbol.empty() && c.symbols.at(name).baseSymbol[0] == '.';
+                };
+
+                if (left.symbol.empty() || !defined(left.symbol) || !defined(right.symbol) || c.symbols.at(left.symbol).baseSymbol != c.symbols.at(right.symbol).baseSymbol)
+                    error("cannot subtract '" + right.symbol + "'");
+
+                left = { "", static_cast<int>(c.symbols.at(left.symbol).offset - c.symbols.at(right.symbol).offset) + left.offset - right.offset };
+            } else
+                left.offset -= right.offset;
+        } else
+            return left;
+}
+
+Assembler::Value Assembler::parseBitwise() {
+    Value left = parseProduct();
+
+    while (true)
+        if (accept('&'))
+            left = { "", constant(left) & constant(parseProduct()) };
+        else if (accept('|'))
+            left = { "", constant(left) | constant(parseProduct()) };
+        else if (accept('^'))
+            left = { "", constant(left) ^ constant(parseProduct()) };
+        else
+            return left;
+}
+
+Assembler::Value Assembler::parseProduct() {
+    Value left = parseUnary();
+
+    while (true) {
+        skipSpaces();
+
+        if (pos + 1 < end && pos[0] == '<' && pos[1] == '<') {
+            pos += 2;
+            left = { "", static_cast<int>(static_cast<uint>(constant(left)) << (constant(parseUnary()) & 31)) };
+        } else if (pos + 1 < end && pos[0] == '>' && pos[1] == '>') {
+            pos += 2;
+            left = { "", constant(left) >> (constant(parseUnary()) & 31) };
+        } else if (accept('*'))
+            left = { "", static_cast<int>(static_cast<uint>(constant(left)) * constant(parseUnary())) };
+        else if (accept('/') || accept('%')) {
+            char op = pos[-1];
+            int dividend = constant(left), divisor = constant(parseUnary());
+
+            if (divisor == 0)
+                error("division by zero");
+
+            left = { "", op == '/' ? dividend / divisor : dividend % divisor };
+        } else
+            return left;
+    }
+}
+
+Assembler::Value Assembler::parseUnary() {
+    if (accept('-'))
+        return { "", static_cast<int>(0u - constant(parseUnary())) };
+
+    if (accept('~'))
+        return { "", ~constant(parseUnary()) };
+
+    if (accept('+'))
+        return parseUnary();
+
+    return parsePrimary();
+}
+
+Assembler::Value Assembler::parsePrimary() {
+    skipSpaces();
+
+    if (accept('(')) {
+        Value result = parseExpression();
+        expect(')');
+        return result;
+    }
+
+    if (pos == end)
+        error("expected operand");
+
+    if (*pos == '\'') {
+        pos++;
+
+        if (pos == end)
+            error("unterminated character");
+
+        char ch = *pos++;
+        byte value = ch == '\\' ? escape() : static_cast<byte>(ch);
+
+        if (pos < end && *pos == '\'')
+            pos++;
+
+        return { "", value };
+    }
+
+    if (isdigit(static_cast<byte>(*pos))) {
+        const char *digits = pos;
+
+        while (digits < end && isdigit(static_cast<byte>(*digits)))
+            digits++;
+
+        // "1b" and "1f" refer to the nearest numeric label 1 before or after.
+        if (digits < end && (*digits == 'b' || *digits == 'f') && (digits + 1 == end || !isIdentifierChar(digits[1]))) {
+            std::string number(pos, digits);
+            uint definitions = numericLabels.count(number) ? numericLabels.at(number) : 0;
+
+            pos = digits + 1;
+
+            if (digits[0] == 'b' && definitions == 0)
+                error("no label '" + number + "' before");
+
+            std::string name = numericLabel(number, digits[0] == 'b' ? definitions - 1 : definitions);
+            referenced.insert(name);
+
+            return { name, 0 };
+        }
+
+        uint base = 10;
+
+        if (pos + 1 < end && pos[0] == '0' && (pos[1] == 'x' || pos[1] == 'X')) {
+            base = 16;
+            pos += 2;
+        } else if (pos + 1 < end && pos[0] == '0' && (pos[1] == 'b' || pos[1] == 'B')) {
+            base = 2;
+            pos += 2;
+        } else if (pos[0] == '0')
+            base = 8;
+
+        const char *start = pos;
+        uint value = 0;
+
+        for (; pos < end && isAlnum(*pos); pos++) {
+            uint digit = isdigit(static_cast<byte>(*pos)) ? *pos - '0' : tolower(*pos) - 'a' + 10;
+
+            if (digit >= base)
+                error("invalid number");
+
+            value = value * base + digit;
+        }
+
+        if (pos == start)
+            error("invalid number");
+
+        return { "", static_cast<int>(value) };
+    }
+
+    if (*pos == '.' && (pos + 1 == end || !isIdentifierChar(pos[1]))) {
+        pos++;
+        return here();
+    }
+
+    if (!isIdentifierChar(*pos))
+        error("expected operand");
+
+    return symbolValue(identifier());
+}
+
+Assembler::Value Assembler::symbolValue(const std::string &name) {
+    auto i = constants.find(name);
+
+    if (i != constants.end())
+        return { "", i->second };
+
+    referenced.insert(name);
+    return { name, 0 };
+}
+
+Assembler::Value Assembler::here() {
+    if (!section)
+        error("'.' in a discarded section");
+
+    std::string name = c.blockLabel();
+    c.pushSymbol(name, Compiler::sectionName(section), c.sectionSize(section));
+
+    return { name, 0 };
+}
+
+int Assembler::constant(const Value &value) {
+    if (!value.symbol.empty())
+        error("'" + value.symbol + "' is not a constant");
+
+    return value.offset;
+}
+
+// Skips an identifier, which ends at pos, and returns its length.
+uint Assembler::word() {
+    skipSpaces();
+
+    const char *start = pos;
+
+    while (pos < end && isIdentifierChar(*pos))
+        pos++;
+
+    if (pos == start)
+        error(pos == end || *pos == '\n' ? "expected identifier" : "unexpected '" + std::string(1, *pos) + "'");
+
+    return pos - start;
+}
+
+std::string Assembler::identifier() {
+    uint length = word();
+    return std::string(pos - length, length);
+}
+
+std::string Assembler::numericLabel(const std::string &digits, uint definition) const {
+    return "__local" + digits + "_" + std::to_string(definition);
+}
+
+void Assembler::skipSpaces() {
+    while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r'))
+        pos++;
+}
+
+void Assembler::skipStatement() {
+    bool quoted = false;
+
+    for (; pos < end && *pos != '\n' && (quoted || (*pos != ';' && *pos != '#')); pos++)
+        if (*pos == '"' && pos[-1] != '\\')
+            quoted = !quoted;
+}
+
+bool Assembler::accept(char ch) {
+    skipSpaces();
+
+    if (pos < end && *pos == ch) {
+        pos++;
+        return true;
+    }
+
+    return false;
+}
+
+bool Assembler::atEnd() {
+    skipSpaces();
+    return pos == end || *pos == '\n' || *pos == ';' || *pos == '#';
+}
+
+void Assembler::expect(char ch) {
+    if (!accept(ch))
+        error(std::string("expected '") + ch + "'");
+}
+
+void Assembler::error(const std::string &message) const {
+    throw std::runtime_error(message);
+}
+
+template <class... Args, uint... I>
+bool Assembler::apply(Compiler &c, void (Compiler::*f)(Args...), const Operand *operands, uint count, Indices<I...>) {
+    if (count != sizeof...(Args))
+        return false;
+
+    bool matches[] = { true, match(operands[I], static_cast<typename std::decay<Args>::type *>(nullptr))... };
+
+    for (bool matched : matches)
+        if (!matched)
+            return false;
+
+    (c.*f)(get(operands[I], static_cast<typename std::decay<Args>::type *>(nullptr))...);
+    return true;
+}
+
+template <class Lead, class... Args, uint... I>
+bool Assembler::apply(Compiler &c, void (Compiler::*f)(Lead, Args...), Lead lead, const Operand *operands, uint count, Indices<I...>) {
+    if (count != sizeof...(Args))
+        return false;
+
+    bool matches[] = { true, match(operands[I], static_cast<typename std::decay<Args>::type *>(nullptr))... };
+
+    for (bool matched : matches)
+        if (!matched)
+            return false;
+
+    (c.*f)(lead, get(operands[I], static_cast<typename std::decay<Args>::type *>(nullptr))...);
+    return true;
+}
+
+template <class... Args>
+Assembler::Handler Assembler::form(void (Compiler::*f)(Args...)) {
+    return [f](Compiler &c, const Operand *operands, uint count) {
+        return apply(c, f, operands, count, typename MakeIndices<sizeof...(Args)>::type());
+    };
+}
+
+template <class Lead, class... Args>
+Assembler::Handler Assembler::form(void (Compiler::*f)(Lead, Args...), Lead lead) {
+    return [f, lead](Compiler &c, const Operand *operands, uint count) {
+        return apply(c, f, lead, operands, count, typename MakeIndices<sizeof...(Args)>::type());
+    };
+}
+
+Assembler::Handler Assembler::popForm(void (Compiler::*f)(FPURegister)) {
+    return [f](Compiler &c, const Operand *operands, uint count) {
+        if (count != 2 || operands[0].kind != FPU || operands[0].reg != ST0 || operands[1].kind != FPU)
+            return false;
+
+        (c.*f)(static_cast<FPURegister>(operands[1].reg));
+        return true;
+    };
+}
+
+Assembler::Handler Assembler::branch(void (Compiler::*f)(const SymRef &), void (Compiler::*reg)(Register), void (Compiler::*mem)(const MemRef &)) {
+    return [=](Compiler &c, const Operand *operands, uint count) {
+        if (count != 1)
+            return false;
+
+        const Operand &target = operands[0];
+
+        if (target.indirect && target.kind == Reg)
+            (c.*reg)(static_cast<Register>(target.reg));
+        else if (target.indirect && target.kind == Mem)
+            (c.*mem)(target.mem);
+        else if (!target.indirect && target.bare && !target.value.symbol.empty())
+            (c.*f)(SymRef(target.value.symbol, Compiler::RefRel, target.value.offset));
+        else
+            return false;
+
+        return true;
+    };
+}
+
+const std::unordered_map<std::string, std::vector<Assembler::Handler>> &Assembler::handlers() {
+    static const std::unordered_map<std::string, std::vector<Handler>> table = [] {
+        std::unordered_map<std::string, std::vector<Handler>> table;
+
+        auto arithmetic = [&](const std::string &name, void (Compiler::*immReg)(int, Register), void (Compiler::*symReg)(const SymRef &, Register),
+                              void (Compiler::*immMem)(int, const MemRef &), void (Compiler::*symMem)(const SymRef &, const MemRef &),
+                              void (Compiler::*regReg)(Register, Register), void (Compiler::*regMem)(Register, const MemRef &),
+                              void (Compiler::*memReg)(const MemRef &, Register), void (Compiler::*byteMem)(byte, const MemRef &)) {
+            table[name] = { form(immReg), form(symReg), form(immMem), form(symMem), form(regReg), form(regMem), form(memReg) };
+            table[name + "b"] = { form(byteMem) };
+        };
+
+        // Byte register operands imply the size, so they also match without
+        // the 'b' suffix.
+        auto byteArithmetic = [&](const std::string &name, void (Compiler::*immReg)(byte, ByteRegister), void (Compiler::*regReg)(ByteRegister, ByteRegister),
+                                  void (Compiler::*regMem)(ByteRegister, const MemRef &), void (Compiler::*memReg)(const MemRef &, ByteRegister)) {
+            for (const std::string &mnemonic : { name, name + "b" })
+                table[mnemonic].insert(table[mnemonic].end(), { form(immReg), form(regReg), form(regMem), form(memReg) });
+        };
+
+        arithmetic("adc", &Compiler::adc, &Compiler::adc, &Compiler::adc, &Compiler::adc, &Compiler::adc, &Compiler::adc, &Compiler::adc, &Compiler::adcb);
+        arithmetic("add", &Compiler::add, &Compiler::add, &Compiler::add, &Compiler::add, &Compiler::add, &Compiler::add, &Compiler::add, &Compiler::addb);
+        arithmetic("and", &Compiler::_and, &Compiler::_and, &Compiler::_and, &Compiler::_and, &Compiler::_and, &Compiler::_and, &Compiler::_and, &Compiler::andb);
+        arithmetic("cmp", &Compiler::cmp, &Compiler::cmp, &Compiler::cmp, &Compiler::cmp, &Compiler::cmp, &Compiler::cmp, &Compiler::cmp, &Compiler::cmpb);
+        arithmetic("or", &Compiler::_or, &Compiler::_or, &Compiler::_or, &Compiler::_or, &Compiler::_or, &Compiler::_or, &Compiler::_or, &Compiler::orb);
+        arithmetic("sbb", &Compiler::sbb, &Compiler::sbb, &Compiler::sbb, &Compiler::sbb, &Compiler::sbb, &Compiler::sbb, &Compiler::sbb, &Compiler::sbbb);
+        arithmetic("sub", &Compiler::sub, &Compiler::sub, &Compiler::sub, &Compiler::sub, &Compiler::sub, &Compiler::sub, &Compiler::sub, &Compiler::subb);
+        arithmetic("xor", &Compiler::_xor, &Compiler::_xor, &Compiler::_xor, &Compiler::_xor, &Compiler::_xor, &Compiler::_xor, &Compiler::_xor, &Compiler::xorb);
+
+        byteArithmetic("adc", &Compiler::adcb, &Compiler::adcb, &Compiler::adcb, &Compiler::adcb);
+        byteArithmetic("add", &Compiler::addb, &Compiler::addb, &Compiler::addb, &Compiler::addb);
+        byteArithmetic("and", &Compiler::andb, &Compiler::andb, &Compiler::andb, &Compiler::andb);
+        byteArithmetic("cmp", &Compiler::cmpb, &Compiler::cmpb, &Compiler::cmpb, &Compiler::cmpb);
+        byteArithmetic("or", &Compiler::orb, &Compiler::orb, &Compiler::orb, &Compiler::orb);
+        byteArithmetic("sbb", &Compiler::sbbb, &Compiler::sbbb, &Compiler::sbbb, &Compiler::sbbb);
+        byteArithmetic("sub", &Compiler::subb, &Compiler::subb, &Compiler::subb, &Compiler::subb);
+        byteArithmetic("xor", &Compiler::xorb, &Compiler::xorb, &Compiler::xorb, &Compiler::xorb);
+
+        // A count of one may be left out.
+        auto shift = [&](const std::string &name, void (Compiler::*immReg)(byte, Register), void (Compiler::*immMem)(byte, const MemRef &),
+                         void (Compiler::*clReg)(ByteRegister, Register), void (Compiler::*clMem)(ByteRegister, const MemRef &)) {
+            table[name] = { form(immReg), form(immMem), form(clReg), form(clMem), form(immReg, byte(1)), form(immMem, byte(1)) };
+        };
+
+        shift("rcl", &Compiler::rcl, &Compiler::rcl, &Compiler::rcl, &Compiler::rcl);
+        shift("rcr", &Compiler::rcr, &Compiler::rcr, &Compiler::rcr, &Compiler::rcr);
+        shift("rol", &Compiler::rol, &Compiler::rol, &Compiler::rol, &Compiler::rol);
+        shift("ror", &Compiler::ror, &Compiler::ror, &Compiler::ror, &Compiler::ror);
+        shift("sal", &Compiler::shl, &Compiler::shl, &Compiler::shl, &Compiler::shl);
+        shift("sar", &Compiler::sar, &Compiler::sar, &Compiler::sar, &Compiler::sar);
+        shift("shl", &Compiler::shl, &Compiler::shl, &Compiler::shl, &Compiler::shl);
+        shift("shr", &Compiler::shr, &Compiler::shr, &Compiler::shr, &Compiler::shr);
+
+        auto unary = [&](const std::string &name, void (Compiler::*reg)(Register), void (Compiler::*mem)(const MemRef &)) {
+            table[name] = { form(reg), form(mem) };
+        };
+
+        unary("dec", &Compiler::dec, &Compiler::dec);
+        unary("div", &Compiler::div, &Compiler::div);
+        unary("idiv", &Compiler::idiv, &Compiler::idiv);
+        unary("inc", &Compiler::inc, &Compiler::inc);
+        unary("mul", &Compiler::mul, &Compiler::mul);
+        unary("neg", &Compiler::neg, &Compiler::neg);
+        unary("not", &Compiler::_not, &Compiler::_not);
+        unary("pop", &Compiler::pop, &Compiler::pop);
+
+        auto scan = [&](const std::string &name, void (Compiler::*reg)(Register, Register), void (Compiler::*mem)(const MemRef &, Register)) {
+            table[name] = { form(reg), form(mem) };
+        };
+
+        scan("bsf", &Compiler::bsf, &Compiler::bsf);
+        scan("bsr", &Compiler::bsr, &Compiler::bsr);
+        scan("lzcnt", &Compiler::lzcnt, &Compiler::lzcnt);
+        scan("popcnt", &Compiler::popcnt, &Compiler::popcnt);
+        scan("tzcnt", &Compiler::tzcnt, &Compiler::tzcnt);
+
+        auto exchange = [&](const std::string &name, void (Compiler::*reg)(Register, Register), void (Compiler::*mem)(Register, const MemRef &)) {
+            table[name] = { form(reg), form(mem) };
+        };
+
+        exchange("cmpxchg", &Compiler::cmpxchg, &Compiler::cmpxchg);
+        exchange("xadd", &Compiler::xadd, &Compiler::xadd);
+        exchange("xchg", &Compiler::xchg, &Compiler::xchg);
+
+        auto packed = [&](const std::string &name, void (Compiler::*reg)(XMMRegister, XMMRegister), void (Compiler::*mem)(const MemRef &, XMMRegister)) {
+            table[name] = { form(reg), form(mem) };
+        };
+
+        packed("addpd", &Compiler::addpd, &Compiler::addpd);
+        packed("divpd", &Compiler::divpd, &Compiler::divpd);
+        packed("mulpd", &Compiler::mulpd, &Compiler::mulpd);
+        packed("pcmpeqb", &Compiler::pcmpeqb, &Compiler::pcmpeqb);
+        packed("subpd", &Compiler::subpd, &Compiler::subpd);
+
+        auto fpu = [&](const std::string &name, void (Compiler::*f)(const MemRef &)) {
+            table[name] = { form(f) };
+        };
+
+        fpu("fadds", &Compiler::fadds);
+        fpu("faddl", &Compiler::faddl);
+        fpu("fiaddl", &Compiler::fiaddl);
+        fpu("fdivs", &Compiler::fdivs);
+        fpu("fdivl", &Compiler::fdivl);
+        fpu("fidivl", &Compiler::fidivl);
+        fpu("fdivrs", &Compiler::fdivrs);
+        fpu("fdivrl", &Compiler::fdivrl);
+        fpu("fidivrl", &Compiler::fidivrl);
+        fpu("flds", &Compiler::flds);
+        fpu("fldl", &Compiler::fldl);
+        fpu("fmuls", &Compiler::fmuls);
+        fpu("fmull", &Compiler::fmull);
+        fpu("fimull", &Compiler::fimull);
+        fpu("fsts", &Compiler::fsts);
+        fpu("fstl", &Compiler::fstl);
+        fpu("fstps", &Compiler::fstps);
+        fpu("fstpl", &Compiler::fstpl);
+        fpu("fsubs", &Compiler::fsubs);
+        fpu("fsubl", &Compiler::fsubl);
+        fpu("fisubl", &Compiler::fisubl);
+        fpu("fsubrs", &Compiler::fsubrs);
+        fpu("fsubrl", &Compiler::fsubrl);
+        fpu("fisubrl", &Compiler::fisubrl);
+
+        auto fpuArithmetic = [&](const std::string &name, void (Compiler::*f)(FPURegister, FPURegister), void (Compiler::*pop)(FPURegister), void (Compiler::*popTop)()) {
+            table[name] = { form(f) };
+            table[name + "p"] = { form(pop), popForm(pop), form(popTop) };
+        };
+
+        fpuArithmetic("fadd", &Compiler::fadd, &Compiler::faddp, &Compiler::faddp);
+        fpuArithmetic("fdiv", &Compiler::fdiv, &Compiler::fdivp, &Compiler::fdivp);
+        fpuArithmetic("fdivr", &Compiler::fdivr, &Compiler::fdivrp, &Compiler::fdivrp);
+        fpuArithmetic("fmul", &Compiler::fmul, &Compiler::fmulp, &Compiler::fmulp);
+        fpuArithmetic("fsub", &Compiler::fsub, &Compiler::fsubp, &Compiler::fsubp);
+        fpuArithmetic("fsubr", &Compiler::fsubr, &Compiler::fsubrp, &Compiler::fsubrp);
+
+        table["fld"] = { form<FPURegister>(&Compiler::fld) };
+        table["fst"] = { form<FPURegister>(&Compiler::fst) };
+        table["fstp"] = { form<FPURegister>(&Compiler::fstp) };
+
+        const std::pair<const char *, void (Compiler::*)()> plain[] = {
+            { "cltd", &Compiler::cltd }, { "cmpsb", &Compiler::cmpsb }, { "cmpsl", &Compiler::cmpsl }, { "fchs", &Compiler::fchs },
+            { "lfence", &Compiler::lfence }, { "leave", &Compiler::leave }, { "mfence", &Compiler::mfence }, { "movsb", &Compiler::movsb },
+            { "movsl", &Compiler::movsl }, { "nop", &Compiler::nop }, { "pause", &Compiler::pause }, { "ret", &Compiler::ret },
+            { "scasb", &Compiler::scasb }, { "sfence", &Compiler::sfence }, { "stosb", &Compiler::stosb }, { "stosl", &Compiler::stosl },
+            { "vzeroupper", &Compiler::vzeroupper }
+        };
+
+        for (auto &instruction : plain)
+            table[instruction.first] = { form(instruction.second) };
+
+        const std::pair<const char *, void (Compiler::*)(const MemRef &)> memory[] = {
+            { "clflushopt", &Compiler::clflushopt }, { "cmpxchg8b", &Compiler::cmpxchg8b }, { "prefetchnta", &Compiler::prefetchnta },
+            { "prefetcht0", &Compiler::prefetcht0 }, { "prefetcht1", &Compiler::prefetcht1 }, { "prefetcht2", &Compiler::prefetcht2 }
+        };
+
+        for (auto &instruction : memory)
+            table[instruction.first] = { form(instruction.second) };
+
+        table["call"] = { branch(&Compiler::call, &Compiler::call, &Compiler::call) };
+        table["jmp"] = { branch(&Compiler::jmp, &Compiler::jmp, &Compiler::jmp) };
+
+        table["imul"] = {
+            form<Register>(&Compiler::imul),
+            form<const MemRef &>(&Compiler::imul),
+            form<Register, Register>(&Compiler::imul),
+            form<const MemRef &, Register>(&Compiler::imul),
+            form<int, Register>(&Compiler::imul),
+            form<int, Register, Register>(&Compiler::imul),
+            form<int, const MemRef &, Register>(&Compiler::imul)
+        };
+
+        table["lea"] = { form<const MemRef &, Register>(&Compiler::lea) };
+
+        table["mov"] = {
+            form<Register, Register>(&Compiler::mov),
+            form<int, Register>(&Compiler::mov),
+            form<const SymRef &, Register>(&Compiler::mov),
+            form<int, const MemRef &>(&Compiler::mov),
+            form<const SymRef &, const MemRef &>(&Compiler::mov),
+            form<Register, const MemRef &>(&Compiler::mov),
+            form<const MemRef &, Register>(&Compiler::mov),
+            form<ByteRegister, const MemRef &>(&Compiler::movb),
+            form<const MemRef &, ByteRegister>(&Compiler::movb),
+            form<byte, ByteRegister>(&Compiler::movb),
+            form<ByteRegister, ByteRegister>(&Compiler::movb)
+        };
+
+        table["movb"] = {
+            form<byte, const MemRef &>(&Compiler::movb),
+            form<ByteRegister, const MemRef &>(&Compiler::movb),
+            form<const MemRef &, ByteRegister>(&Compiler::movb),
+            form<byte, ByteRegister>(&Compiler::movb),
+            form<ByteRegister, ByteRegister>(&Compiler::movb)
+        };
+
+        // 16-bit registers only appear as the source or destination of a
+        // word sized memory access.
+        auto word = [](void (Compiler::*f)(Register, const MemRef &)) -> Handler {
+            return [f](Compiler &c, const Operand *operands, uint count) {
+                if (count != 2 || operands[0].kind != Word || operands[1].kind != Mem || operands[1].indirect)
+                    return false;
+
+                (c.*f)(static_cast<Register>(operands[0].reg), operands[1].mem);
+                return true;
+            };
+        };
+
+        auto widen = [](void (Compiler::*f)(Register, Register)) -> Handler {
+            return [f](Compiler &c, const Operand *operands, uint count) {
+                if (count != 2 || operands[0].kind != Word || operands[1].kind != Reg)
+                    return false;
+
+                (c.*f)(static_cast<Register>(operands[0].reg), static_cast<Register>(operands[1].reg));
+                return true;
+            };
+        };
+
+        table["movw"] = {
+            word(&Compiler::movw),
+            [](Compiler &c, const Operand *operands, uint count) {
+                if (count != 2 || operands[0].kind != Mem || operands[0].indirect || operands[1].kind != Word)
+                    return false;
+
+                c.movw(operands[0].mem, static_cast<Register>(operands[1].reg));
+                return true;
+            }
+        };
+
+        table["movd"] = { form<Register, XMMRegister>(&Compiler::movd), form<XMMRegister, Register>(&Compiler::movd) };
+        table["movdqu"] = { form<const MemRef &, XMMRegister>(&Compiler::movdqu), form<XMMRegister, const MemRef &>(&Compiler::movdqu) };
+        table["movq"] = { form<const MemRef &, XMMRegister>(&Compiler::movq), form<XMMRegister, const MemRef &>(&Compiler::movq) };
+        table["movupd"] = { form<const MemRef &, XMMRegister>(&Compiler::movupd), form<XMMRegister, const MemRef &>(&Compiler::movupd) };
+        table["movapd"] = { form<XMMRegister, XMMRegister>(&Compiler::movapd) };
+        table["movntdq"] = { form<XMMRegister, const MemRef &>(&Compiler::movntdq) };
+        table["movnti"] = { form<Register, const MemRef &>(&Compiler::movnti) };
+        table["movsbl"] = { form<ByteRegister, Register>(&Compiler::movsbl), form<const MemRef &, Register>(&Compiler::movsbl) };
+        table["movzbl"] = { form<ByteRegister, Register>(&Compiler::movzbl), form<const MemRef &, Register>(&Compiler::movzbl) };
+        table["movswl"] = { widen(&Compiler::movswl), form<const MemRef &, Register>(&Compiler::movswl) };
+        table["movzwl"] = { widen(&Compiler::movzwl), form<const MemRef &, Register>(&Compiler::movzwl) };
+        table["pand"] = { form<XMMRegister, XMMRegister>(&Compiler::pand) };
+        table["pmovmskb"] = { form<XMMRegister, Register>(&Compiler::pmovmskb) };
+        table["pshufd"] = { form<byte, XMMRegister, XMMRegister>(&Compiler::pshufd) };
+        table["pxor"] = { form<XMMRegister, XMMRegister>(&Compiler::pxor) };
+        table["xorpd"] = { form<XMMRegister, XMMRegister>(&Compiler::xorpd) };
+
+        table["push"] = {
+            form<Register>(&Compiler::push),
+            form<const MemRef &>(&Compiler::push),
+            form<int>(&Compiler::push),
+            form<const SymRef &>(&Compiler::push)
+        };
+
+        table["test"] = {
+            form<int, Register>(&Compiler::test),
+            form<int, const MemRef &>(&Compiler::test),
+            form<Register, Register>(&Compiler::test),
+            form<Register, const MemRef &>(&Compiler::test),
+            form<const MemRef &, Register>(&Compiler::test),
+            form<byte, ByteRegister>(&Compiler::testb),
+            form<ByteRegister, ByteRegister>(&Compiler::testb),
+            form<ByteRegister, const MemRef &>(&Compiler::testb),
+            form<const MemRef &, ByteRegister>(&Compiler::testb)
+        };
+
+        table["testb"] = {
+            form<byte, const MemRef &>(&Compiler::testb),
+            form<byte, ByteRegister>(&Compiler::testb),
+            form<ByteRegister, ByteRegister>(&Compiler::testb),
+            form<ByteRegister, const MemRef &>(&Compiler::testb),
+            form<const MemRef &, ByteRegister>(&Compiler::testb)
+        };
+
+        table["vaddpd"] = { form<YMMRegister, YMMRegister, YMMRegister>(&Compiler::vaddpd) };
+        table["vdivpd"] = { form<YMMRegister, YMMRegister, YMMRegister>(&Compiler::vdivpd) };
+        table["vinsertf128"] = { form<byte, XMMRegister, YMMRegister, YMMRegister>(&Compiler::vinsertf128) };
+        table["vmovdqu"] = { form<const MemRef &, YMMRegister>(&Compiler::vmovdqu), form<YMMRegister, const MemRef &>(&Compiler::vmovdqu) };
+        table["vmovntdq"] = { form<YMMRegister, const MemRef &>(&Compiler::vmovntdq) };
+        table["vmovupd"] = { form<const MemRef &, YMMRegister>(&Compiler::vmovupd), form<YMMRegister, const MemRef &>(&Compiler::vmovupd) };
+        table["vmulpd"] = { form<YMMRegister, YMMRegister, YMMRegister>(&Compiler::vmulpd) };
+        table["vsubpd"] = { form<YMMRegister, YMMRegister, YMMRegister>(&Compiler::vsubpd) };
+        table["vxorpd"] = { form<YMMRegister, YMMRegister, YMMRegister>(&Compiler::vxorpd) };
+
+        const std::pair<const char *, Condition> conditions[] = {
+            { "o", O }, { "no", NO }, { "b", B }, { "c", B }, { "nae", B }, { "ae", AE }, { "nb", AE }, { "nc", AE },
+            { "e", E }, { "z", E }, { "ne", NE }, { "nz", NE }, { "be", BE }, { "na", BE }, { "a", A }, { "nbe", A },
+            { "s", S }, { "ns", NS }, { "p", P }, { "pe", P }, { "np", NP }, { "po", NP }, { "l", L }, { "nge", L },
+            { "ge", GE }, { "nl", GE }, { "le", LE }, { "ng", LE }, { "g", G }, { "nle", G }
+        };
+
+        for (auto &condition : conditions) {
+            Condition cond = condition.second;
+
+            table[std::string("j") + condition.first] = { [cond](Compiler &c, const Operand *operands, uint count) {
+                if (count != 1 || operands[0].indirect || !operands[0].bare || operands[0].value.symbol.empty())
+                    return false;
+
+                c.j(cond, SymRef(operands[0].value.symbol, Compiler::RefRel, operands[0].value.offset));
+                return true;
+            } };
+
+            table[std::string("set") + condition.first] = { form<Condition, ByteRegister>(&Compiler::set, cond), form<Condition, const MemRef &>(&Compiler::set, cond) };
+            table[std::string("cmov") + condition.first] = { form<Condition, Register, Register>(&Compiler::cmov, cond), form<Condition, const MemRef &, Register>(&Compiler::cmov, cond) };
+        }
+
+        return table;
+    }();
+
+    return table;
+}
+
+const std::vector<Assembler::Handler> *Assembler::lookup(const char *mnemonic, uint length) {
+    static const NameTable<const std::vector<Handler> *> mnemonics = [] {
+        NameTable<const std::vector<Handler> *> table(2 * handlers().size());
+
+        for (auto &entry : handlers())
+            table.insert(entry.first, &entry.second);
+
+        // The 'l' suffix only spells out the operand size.
+        for (auto &entry : handlers())
+            table.insert(entry.first + "l", &entry.second);
+
+        return table;
+    }();
+
+    const std::vector<Handler> *const *forms = mnemonics.find(mnemonic, length);
+    return forms ? *forms : nullptr;
+}
+
+bool Assembler::match(const Operand &operand, Register *) {
+    return operand.kind == Reg && !operand.indirect;
+}
+
+bool Assembler::match(const Operand &operand, ByteRegister *) {
+    return operand.kind == Byte;
+}
+
+bool Assembler::match(const Operand &operand, XMMRegister *) {
+    return operand.kind == XMM;
+}
+
+bool Assembler::match(const Operand &operand, YMMRegister *) {
+    return operand.kind == YMM;
+}
+
+bool Assembler::match(const Operand &operand, FPURegister *) {
+    return operand.kind == FPU;
+}
+
+bool Assembler::match(const Operand &operand, int *) {
+    return operand.kind == Imm && operand.value.symbol.empty();
+}
+
+bool Assembler::match(const Operand &operand, byte *) {
+    return operand.kind == Imm && operand.value.symbol.empty() && operand.value.offset >= -128 && operand.value.offset <= 255;
+}
+
+bool Assembler::match(const Operand &operand, SymRef *) {
+    return operand.kind == Imm && !operand.value.symbol.empty();
+}
+
+bool Assembler::match(const Operand &operand, MemRef *) {
+    return operand.kind == Mem && !operand.indirect;
+}
+
+Register Assembler::get(const Operand &operand, Register *) {
+    return static_cast<Register>(operand.reg);
+}
+
+ByteRegister Assembler::get(const Operand &operand, ByteRegister *) {
+    return static_cast<ByteRegister>(operand.reg);
+}
+
+XMMRegister Assembler::get(const Operand &operand, XMMRegister *) {
+    return static_cast<XMMRegister>(operand.reg);
+}
+
+YMMRegister Assembler::get(const Operand &operand, YMMRegister *) {
+    return static_cast<YMMRegister>(operand.reg);
+}
+
+FPURegister Assembler::get(const Operand &operand, FPURegister *) {
+    return static_cast<FPURegister>(operand.reg);
+}
+
+int Assembler::get(const Operand &operand, int *) {
+    return operand.value.offset;
+}
+
+byte Assembler::get(const Operand &operand, byte *) {
+    return static_cast<byte>(operand.value.offset);
+}
+
+Assembler::SymRef Assembler::get(const Operand &operand, SymRef *) {
+    return SymRef(operand.value.symbol, Compiler::RefAbs, operand.value.offset);
+}
+
+const Assembler::MemRef &Assembler::get(const Operand &operand, MemRef *) {
+    return operand.mem;
+}
+}
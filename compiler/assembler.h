@@ -0,0 +1,174 @@
+#pragma once
+
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "compiler.h"
+
+namespace x86 {
+
+// Assembles AT&T syntax text into a Compiler, so assembly produced by other
+// tools can be compiled, linked and written as an object without an
+// external assembler.
+//
+// Statements end at a newline or ';', comments start with '#'. Instructions
+// are those Compiler encodes, by their AT&T names with an optional 'l'
+// suffix ("movl", "pushl"), preceded by lock/rep/repe/repne if needed.
+// Labels may be numeric ("1:"), referred to as "1b" or "1f". Expressions
+// combine numbers, characters ('a), symbols and '.' with unary - ~ and
+// binary * / % << >> & | ^ + -, where a symbol may carry a constant
+// offset, or be subtracted from a symbol of the same section that is
+// already defined.
+//
+// Directives: .text, .data, .bss, .section (.text, .text.cold, .data,
+// .bss, .rdata, .rodata*; .note* and .comment are dropped), .align,
+// .balign, .p2align, .globl/.global, .set/.equ, .byte, .short/.word,
+// .long/.int, .quad, .ascii, .asciz/.string, .zero/.skip/.space, .comm and
+// .lcomm. Global labels in .text start functions; objects only export
+// functions, so .globl has no effect on data. Symbols still undefined at
+// the end of the text become externals: functions if they are branched
+// to, variables otherwise. .file, .ident, .type, .size, .loc and .cfi_*
+// are ignored; Compiler derives unwind information itself.
+class Assembler {
+    typedef Compiler::SectionID SectionID;
+    typedef Compiler::SymRef SymRef;
+    typedef Compiler::MemRef MemRef;
+
+    enum OperandKind {
+        Reg,
+        Word,
+        Byte,
+        XMM,
+        YMM,
+        FPU,
+        Imm,
+        Mem
+    };
+
+    // A constant, or a symbol plus a constant.
+    struct Value {
+        std::string symbol;
+        int offset;
+    };
+
+    struct Operand {
+        OperandKind kind;
+        uint reg;
+        Value value;   // immediate, or displacement of a memory operand
+        bool indirect; // '*' before a call or jmp target
+        bool bare;     // memory operand without base and index, i.e. a branch target
+        MemRef mem;
+
+        Operand(OperandKind kind, uint reg, const Value &value, bool indirect, bool bare, const MemRef &mem);
+    };
+
+    typedef std::function<bool(Compiler &, const Operand *, uint)> Handler;
+
+    template <uint... I>
+    struct Indices {};
+
+    template <uint N, uint... I>
+    struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+
+    template <uint... I>
+    struct MakeIndices<0, I...> {
+        typedef Indices<I...> type;
+    };
+
+    static const uint MAX_OPERANDS = 4;
+
+    Compiler &c;
+    SectionID section;
+
+    std::map<std::string, int> constants;
+    std::set<std::string> globals;
+    std::unordered_set<std::string> referenced;
+    std::map<std::string, uint> numericLabels;
+    std::vector<Operand> operands;
+
+    const char *pos, *end;
+    uint line;
+
+public:
+    explicit Assembler(Compiler &c);
+
+    void assemble(const char *text, uint size);
+    void assemble(const std::string &text);
+
+private:
+    void statement();
+    void instruction(const char *mnemonic, uint length);
+    void directive(const std::string &name);
+    void label(const std::string &name);
+
+    void setSection(SectionID id);
+    void emit(const void *data, uint size);
+    void emitValue(const Value &value, uint size);
+    void alignSection(uint alignment, byte fill);
+    void declareExternals();
+
+    Operand parseOperand();
+    std::string parseString();
+    byte escape();
+
+    Value parseExpression();
+    Value parseBitwise();
+    Value parseProduct();
+    Value parseUnary();
+    Value parsePrimary();
+
+    Value symbolValue(const std::string &name);
+    Value here();
+    int constant(const Value &value);
+
+    uint word();
+    std::string identifier();
+    std::string numericLabel(const std::string &digits, uint definition) const;
+
+    void skipSpaces();
+    void skipStatement();
+    bool accept(char ch);
+    bool atEnd();
+    void expect(char ch);
+    [[noreturn]] void error(const std::string &message) const;
+
+    static const std::unordered_map<std::string, std::vector<Handler>> &handlers();
+    static const std::vector<Handler> *lookup(const char *mnemonic, uint length);
+
+    template <class... Args>
+    static Handler form(void (Compiler::*f)(Args...));
+
+    template <class Lead, class... Args>
+    static Handler form(void (Compiler::*f)(Lead, Args...), Lead lead);
+
+    static Handler popForm(void (Compiler::*f)(FPURegister));
+    static Handler branch(void (Compiler::*f)(const SymRef &), void (Compiler::*reg)(Register), void (Compiler::*mem)(const MemRef &));
+
+    template <class... Args, uint... I>
+    static bool apply(Compiler &c, void (Compiler::*f)(Args...), const Operand *operands, uint count, Indices<I...>);
+
+    template <class Lead, class... Args, uint... I>
+    static bool apply(Compiler &c, void (Compiler::*f)(Lead, Args...), Lead lead, const Operand *operands, uint count, Indices<I...>);
+
+    static bool match(const Operand &operand, Register *);
+    static bool match(const Operand &operand, ByteRegister *);
+    static bool match(const Operand &operand, XMMRegister *);
+    static bool match(const Operand &operand, YMMRegister *);
+    static bool match(const Operand &operand, FPURegister *);
+    static bool match(const Operand &operand, int *);
+    static bool match(const Operand &operand, byte *);
+    static bool match(const Operand &operand, SymRef *);
+    static bool match(const Operand &operand, MemRef *);
+
+    static Register get(const Operand &operand, Register *);
+    static ByteRegister get(const Operand &operand, ByteRegister *);
+    static XMMRegister get(const Operand &operand, XMMRegister *);
+    static YMMRegister get(const Operand &operand, YMMRegister *);
+    static FPURegister get(const Operand &operand, FPURegister *);
+    static int get(const Operand &operand, int *);
+    static byte get(const Operand &operand, byte *);
+    static SymRef get(const Operand &operand, SymRef *);
+    static const MemRef &get(const Operand &operand, MemRef *);
+};
+}
@@ -2,6 +2,7 @@
 
 #include <memory>
 #include <fstream>
+#include <stdexcept>
 
 uint ByteArray::initialCapacity = 1;
 
@@ -12,16 +13,20 @@ void ByteArray::setInitialCapacity(uint initialCapacity) {
 ByteArray::ByteArray()
     : _size(0)
     , _capacity(0)
-    , _data(0) {
+    , _data(0)
+    , _reallocations(0)
+    , _owned(true) {
 }
 
 ByteArray::ByteArray(const ByteArray &array)
-    : _data(0) {
+    : _data(0)
+    , _owned(true) {
     *this = array;
 }
 
 ByteArray::ByteArray(ByteArray &&array)
-    : _data(0) {
+    : _data(0)
+    , _owned(true) {
     *this = std::move(array);
 }
 
@@ -32,10 +37,13 @@ ByteArray::~ByteArray() {
 ByteArray &ByteArray::operator=(const ByteArray &array) {
     _size = array._size;
     _capacity = array._capacity;
+    _reallocations = array._reallocations;
 
-    ::free(_data);
+    if (_owned)
+        ::free(_data);
 
     _data = (byte *)malloc(_capacity);
+    _owned = true;
     memcpy(_data, array._data, _size);
 
     return *this;
@@ -44,14 +52,19 @@ ByteArray &ByteArray::operator=(const ByteArray &array) {
 ByteArray &ByteArray::operator=(ByteArray &&array) {
     _size = array._size;
     _capacity = array._capacity;
+    _reallocations = array._reallocations;
 
-    ::free(_data);
+    if (_owned)
+        ::free(_data);
 
     _data = array._data;
+    _owned = array._owned;
 
     array._data = 0;
     array._size = 0;
     array._capacity = 0;
+    array._reallocations = 0;
+    array._owned = true;
 
     return *this;
 }
@@ -60,13 +73,19 @@ byte *ByteArray::allocate(uint count) {
     if (!enoughSpace(count)) {
         uint newCapacity = ceilToPowerOf2(std::max(initialCapacity, _size + count));
 
-        byte *newData = (byte *)realloc(_data, newCapacity);
+        byte *newData = (byte *)(_owned ? realloc(_data, newCapacity) : malloc(newCapacity));
 
         if (!newData)
             return 0;
 
+        if (!_owned)
+            memcpy(newData, _data, _size);
+
+        _owned = true;
+
         _capacity = newCapacity;
         _data = newData;
+        _reallocations++;
     }
 
     _size += count;
@@ -84,12 +103,36 @@ int ByteArray::reallocate() {
 
     int delta = newData - _data;
 
-    ::free(_data);
+    if (_owned)
+        ::free(_data);
+
     _data = newData;
+    _owned = true;
 
     return delta;
 }
 
+void ByteArray::moveTo(byte *data) {
+    memmove(data, _data, _size);
+
+    if (_owned)
+        ::free(_data);
+
+    _data = data;
+    _capacity = _size;
+    _owned = false;
+}
+
+void ByteArray::assign(byte *data, uint size) {
+    if (_owned)
+        ::free(_data);
+
+    _data = data;
+    _size = size;
+    _capacity = size;
+    _owned = false;
+}
+
 void ByteArray::push(const byte *data, uint size) {
     memcpy(allocate(size), data, size);
 }
@@ -107,11 +150,13 @@ bool ByteArray::free(uint count) {
 }
 
 void ByteArray::release() {
-    ::free(_data);
+    if (_owned)
+        ::free(_data);
 
     _size = 0;
     _capacity = 0;
     _data = 0;
+    _owned = true;
 }
 
 bool ByteArray::enoughSpace(uint count) const {
@@ -130,8 +175,26 @@ uint ByteArray::capacity() const {
     return _capacity;
 }
 
+uint ByteArray::reallocations() const {
+    return _reallocations;
+}
+
 void ByteArray::write(const std::string &fileName) const {
     std::ofstream stream(fileName, std::ios::binary);
     stream.write((char *)_data, _size);
     stream.close();
 }
+
+ByteArray ByteArray::read(const std::string &fileName) {
+    std::ifstream stream(fileName, std::ios::binary | std::ios::ate);
+
+    if (!stream)
+        throw std::runtime_error("cannot open '" + fileName + "'");
+
+    ByteArray array;
+    uint size = stream.tellg();
+
+    stream.seekg(0);
+    stream.read((char *)array.allocate(size), size);
+    return array;
+}
@@ -7,6 +7,8 @@ class ByteArray {
 
     uint _size, _capacity;
     byte *_data;
+    uint _reallocations;
+    bool _owned; // false once moved to memory owned elsewhere
 
 public:
     static void setInitialCapacity(uint initialCapacity);
@@ -24,6 +26,15 @@ public:
     byte *allocate(uint count);
     int reallocate();
 
+    // Moves the contents to data, which may overlap them, and keeps them
+    // there without owning the memory: it is not freed, and growing or
+    // reallocating copies the contents to memory of the array's own.
+    void moveTo(byte *data);
+
+    // Refers to size bytes at data, as moveTo() leaves them, without
+    // copying anything there.
+    void assign(byte *data, uint size);
+
     template <class T>
     ByteArray &push(T value);
 
@@ -42,8 +53,10 @@ public:
     byte *data() const;
     uint size() const;
     uint capacity() const;
+    uint reallocations() const;
 
     void write(const std::string &fileName) const;
+    static ByteArray read(const std::string &fileName);
 };
 
 template <class T>
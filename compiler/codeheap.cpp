@@ -0,0 +1,141 @@
+#include "codeheap.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace x86 {
+
+CodeHeap::CodeHeap(uint capacity) {
+    // The arena never grows, as growing would move the code in it.
+    arena.allocate(capacity);
+    arena.free(capacity);
+}
+
+Function &CodeHeap::add(Function &&f) {
+    uint size = slot(f);
+    byte *dst = reserve(size);
+
+    functions.push_back(std::move(f));
+    Function &result = functions.back();
+
+    if (size > 0)
+        result.reallocate(dst);
+
+    return result;
+}
+
+Function &CodeHeap::allocate(uint size) {
+    byte *dst = reserve(slot(size));
+
+    functions.emplace_back();
+    Function &result = functions.back();
+
+    if (size > 0)
+        result.code.assign(dst, size);
+
+    return result;
+}
+
+void CodeHeap::remove(Function &f) {
+    for (auto i = functions.begin(); i != functions.end(); i++)
+        if (&*i == &f) {
+            functions.erase(i);
+            return;
+        }
+
+    throw std::runtime_error("function is not in the code heap");
+}
+
+void CodeHeap::clear() {
+    functions.clear();
+    arena.free(arena.size());
+}
+
+uint CodeHeap::compact() {
+    std::vector<Function *> order;
+
+    for (Function &f : functions)
+        if (f.code.data())
+            order.push_back(&f);
+
+    // Code moved out of the arena by Function::reallocate() comes back in
+    // after the code still there.
+    auto outside = [&](const Function *f) {
+        return f->code.data() < arena.data() || f->code.data() >= arena.data() + arena.size();
+    };
+
+    std::sort(order.begin(), order.end(), [&](Function *a, Function *b) {
+        return outside(a) != outside(b) ? outside(b) : a->code.data() < b->code.data();
+    });
+
+    uint top = 0, moved = 0;
+
+    // In address order, each function only moves down over space already
+    // vacated.
+    for (Function *f : order) {
+        if (outside(f) && top + slot(*f) > arena.capacity())
+            continue;
+
+        byte *dst = arena.data() + top;
+
+        if (f->code.data() != dst)
+            moved += f->reallocate(dst);
+
+        top += slot(*f);
+    }
+
+    if (top > arena.size())
+        arena.allocate(top - arena.size());
+    else
+        arena.free(arena.size() - top);
+
+    return moved;
+}
+
+CodeHeap::Stats CodeHeap::stats() const {
+    Stats stats = { 0, 0, 0 };
+    const byte *begin = 0, *end = 0;
+
+    for (const Function &f : functions) {
+        const byte *code = f.code.data();
+        uint size = f.code.size();
+
+        if (!code)
+            continue;
+
+        stats.functions++;
+        stats.bytes += size;
+
+        if (!begin || code < begin)
+            begin = code;
+
+        if (code + size > end)
+            end = code + size;
+    }
+
+    stats.span = end - begin;
+    return stats;
+}
+
+uint CodeHeap::capacity() const {
+    return arena.capacity();
+}
+
+byte *CodeHeap::reserve(uint size) {
+    if (!arena.enoughSpace(size))
+        compact();
+
+    if (!arena.enoughSpace(size))
+        throw std::runtime_error("code heap is full");
+
+    return arena.allocate(size);
+}
+
+uint CodeHeap::slot(const Function &f) {
+    return slot(f.code.size());
+}
+
+uint CodeHeap::slot(uint size) {
+    return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <list>
+
+#include "function.h"
+
+namespace x86 {
+
+// Generated functions owned for as long as a long-running process keeps
+// them, with their code placed in an arena of fixed capacity. Dropping
+// functions leaves holes between the live ones; compact() slides the live
+// code down over them, so the arena has room at its end again.
+//
+// Compaction invalidates every pointer into the moved code: callers keep
+// the Function reference and look entry points up again afterwards, and no
+// thread may be running code of the heap meanwhile. Sites patched to a
+// Function (Function::patch) are the exception and follow the move; raw
+// addresses given to Compiler::relocate do not. Functions must not be moved
+// out of the heap.
+class CodeHeap {
+    static const uint ALIGNMENT = 16;
+
+    ByteArray arena;
+    std::list<Function> functions;
+
+public:
+    struct Stats {
+        uint functions;
+        uint bytes; // code size of the live functions
+        uint span;  // from the lowest to the highest byte of live code
+    };
+
+    explicit CodeHeap(uint capacity = 16 << 20);
+
+    // Throws if the arena has no room left for the code, even after
+    // compact().
+    Function &add(Function &&f);
+
+    // An empty function whose code is size uninitialized bytes in the
+    // arena, for the caller to fill in place; throws like add().
+    Function &allocate(uint size);
+    void remove(Function &f);
+    void clear();
+
+    // Returns the number of bytes moved.
+    uint compact();
+
+    Stats stats() const;
+    uint capacity() const;
+
+private:
+    // Room for size bytes at the end of the arena, compacting it first if
+    // needed.
+    byte *reserve(uint size);
+
+    static uint slot(const Function &f);
+    static uint slot(uint size);
+};
+}
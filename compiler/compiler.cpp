@@ -1,11 +1,18 @@
 #include "compiler.h"
 
 #include "common.h"
+#include "stencil.h"
+#include "threadcounters.h"
 
 #include <cassert>
 #include <cmath>
+#include <set>
+#include <unordered_map>
+#include <fstream>
 #include <algorithm>
 #include <exception>
+#include <functional>
+#include <cpuid.h>
 
 namespace x86 {
 
@@ -35,6 +42,52 @@ Compiler::SymRef Compiler::SymRef::operator+(int offset) const {
     return SymRef(name, type, this->offset + offset);
 }
 
+std::string Compiler::Stats::toJSON() const {
+    static const char *phaseNames[] = { "emission", "relocate", "writeOBJ", "compileFunction" };
+
+    std::string json = "{\"sections\":{", separator;
+
+    for (auto &section : sectionSizes) {
+        json += separator + "\"" + section.first + "\":" + toString(section.second, 10, 0);
+        separator = ",";
+    }
+
+    json += "},\"opcodes\":{";
+    separator = "";
+
+    for (auto &op : opcodes) {
+        json += separator + "\"" + op.first + "\":" + toString(op.second, 10, 0);
+        separator = ",";
+    }
+
+    json += "},\"symbols\":" + toString(symbols, 10, 0);
+    json += ",\"relocs\":" + toString(relocs, 10, 0);
+    json += ",\"reallocations\":" + toString(reallocations, 10, 0);
+    json += ",\"seconds\":{";
+
+    for (int i = 0; i < NUM_PHASES; i++)
+        json += (i > 0 ? ",\"" : "\"") + std::string(phaseNames[i]) + "\":" + toString(seconds[i], 10, 9);
+
+    return json + "}}";
+}
+
+Compiler::PhaseTimer::PhaseTimer(const Compiler &compiler, Phase phase)
+    : compiler(compiler)
+    , phase(phase)
+    , active(compiler.statsEnabled && !compiler.timing) {
+    if (active) {
+        compiler.timing = true;
+        start = std::chrono::steady_clock::now();
+    }
+}
+
+Compiler::PhaseTimer::~PhaseTimer() {
+    if (active) {
+        compiler.seconds[phase] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        compiler.timing = false;
+    }
+}
+
 Compiler::MemRef::MemRef(byte mod, byte rm)
     : mod(mod)
     , rm(rm)
@@ -116,8 +169,49 @@ void Compiler::externalVariable(const std::string &name) {
 }
 
 void Compiler::function(const std::string &name) {
+    if (text == COLD)
+        throw std::runtime_error("function '" + name + "' cannot start in cold code");
+
     pushSymbol(name, ".text", section(TEXT).size());
     funcs << name;
+
+    unwindTables.push_back({ name, "", entryFrame(), {} });
+    hotTable = unwindTables.size() - 1;
+    hotStart = section(TEXT).size();
+    frame = entryFrame();
+    inEpilogue = false;
+
+    // A thread's first entry registers its counter copy; the call keeps
+    // every register but EFLAGS, so arguments passed in registers survive.
+    if (instrumentation == PerThreadCounters) {
+        std::string registered = blockLabel();
+
+        prefix(0x65);
+        cmp(0, ref(abs("__threadSlots")));
+        j(NE, rel(registered));
+        push(EAX);
+        push(ECX);
+        push(EDX);
+        call(rel("__enterThread"));
+        pop(EDX);
+        pop(ECX);
+        pop(EAX);
+        pushSymbol(registered, sectionName(text), sectionSize(text));
+    }
+
+    if (instrumentation != NoInstrumentation)
+        count(name);
+}
+
+void Compiler::label(const std::string &name) {
+    pushSymbol(name, sectionName(text), section(text).size());
+
+    if (instrumentation != NoInstrumentation)
+        count(name);
+}
+
+void Compiler::setInstrumentation(Instrumentation mode) {
+    instrumentation = mode;
 }
 
 Compiler::SymRef Compiler::abs(const std::string &name) const {
@@ -218,12 +312,18 @@ Compiler::MemRef Compiler::ref(Register index, byte scale) const {
 }
 
 void Compiler::relocate(const std::string &name, int value) {
+    PhaseTimer timer(*this, Relocation);
+
+    resolved[name] += value;
+
     for (auto &reloc : relocs)
         if (reloc.name == name) {
+            byte *site = section(reloc.section).data() + reloc.offset;
+
             if (reloc.type == RefAbs)
-                *reinterpret_cast<int *>(section(TEXT).data() + reloc.offset) += value;
+                *reinterpret_cast<int *>(site) += value;
             else
-                *reinterpret_cast<int *>(section(TEXT).data() + reloc.offset) += value - reinterpret_cast<int>(section(TEXT).data() + reloc.offset + 4);
+                *reinterpret_cast<int *>(site) += value - reinterpret_cast<int>(site + 4);
         }
 }
 
@@ -239,50 +339,302 @@ void Compiler::constant(double value) {
     gen(value);
 }
 
+void Compiler::adc(int imm, Register dst) {
+    alu(2, imm, dst);
+}
+
+void Compiler::adc(const SymRef &ref, Register dst) {
+    alu(2, ref, dst);
+}
+
+void Compiler::adcb(byte imm, const MemRef &dst) {
+    alub(2, imm, dst);
+}
+
+void Compiler::adcb(byte imm, ByteRegister dst) {
+    alub(2, imm, dst);
+}
+
+void Compiler::adcb(ByteRegister src, ByteRegister dst) {
+    alub(2, src, dst);
+}
+
+void Compiler::adcb(ByteRegister src, const MemRef &dst) {
+    alub(2, src, dst);
+}
+
+void Compiler::adcb(const MemRef &src, ByteRegister dst) {
+    alub(2, src, dst);
+}
+
+void Compiler::adc(int imm, const MemRef &dst) {
+    alu(2, imm, dst);
+}
+
+void Compiler::adc(const SymRef &ref, const MemRef &dst) {
+    alu(2, ref, dst);
+}
+
+void Compiler::adc(Register src, Register dst) {
+    alu(2, src, dst);
+}
+
+void Compiler::adc(Register src, const MemRef &dst) {
+    alu(2, src, dst);
+}
+
+void Compiler::adc(const MemRef &src, Register dst) {
+    alu(2, src, dst);
+}
+
 void Compiler::add(int imm, Register dst) {
-    if (isByte(imm))
-        instr(0x83, 0, dst, static_cast<byte>(imm));
-    else if (dst == EAX)
-        instr(0x05, imm);
-    else
-        instr(0x81, 0, dst, imm);
+    uint start = sectionSize(text);
+    alu(0, imm, dst);
+
+    if (dst == ESP)
+        adjustFrame(start, -imm);
 }
 
 void Compiler::add(const SymRef &ref, Register dst) {
-    if (dst == EAX)
-        instr(0x05, ref);
-    else
-        instr(0x81, 0, dst, ref);
+    alu(0, ref, dst);
 }
 
 void Compiler::addb(byte imm, const MemRef &dst) {
-    instr(0x80, 0, dst, imm);
+    alub(0, imm, dst);
+}
+
+void Compiler::addb(byte imm, ByteRegister dst) {
+    alub(0, imm, dst);
+}
+
+void Compiler::addb(ByteRegister src, ByteRegister dst) {
+    alub(0, src, dst);
+}
+
+void Compiler::addb(ByteRegister src, const MemRef &dst) {
+    alub(0, src, dst);
+}
+
+void Compiler::addb(const MemRef &src, ByteRegister dst) {
+    alub(0, src, dst);
 }
 
 void Compiler::add(int imm, const MemRef &dst) {
-    if (isByte(imm))
-        instr(0x83, 0, dst, static_cast<byte>(imm));
-    else
-        instr(0x81, 0, dst, imm);
+    alu(0, imm, dst);
 }
 
 void Compiler::add(const SymRef &ref, const MemRef &dst) {
-    instr(0x81, 0, dst, ref);
+    alu(0, ref, dst);
+}
+
+void Compiler::add(Register src, Register dst) {
+    alu(0, src, dst);
 }
 
 void Compiler::add(Register src, const MemRef &dst) {
-    instr(0x01, src, dst);
+    alu(0, src, dst);
 }
 
 void Compiler::add(const MemRef &src, Register dst) {
-    instr(0x03, dst, src);
+    alu(0, src, dst);
 }
 
-void Compiler::_and(int imm, Register reg) {
-    if (reg == EAX)
-        instr(0x25, imm);
-    else
-        instr(0x81, 4, reg, imm);
+void Compiler::addpd(XMMRegister src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x58, dst, static_cast<Register>(src));
+}
+
+void Compiler::addpd(const MemRef &src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x58, dst, src);
+}
+
+void Compiler::align(uint alignment) {
+    pad((alignment - sectionSize(text) % alignment) % alignment);
+
+    if (text == TEXT)
+        alignments[sectionSize(TEXT)] = std::max(alignments[sectionSize(TEXT)], alignment);
+}
+
+void Compiler::_and(int imm, Register dst) {
+    alu(4, imm, dst);
+}
+
+void Compiler::_and(const SymRef &ref, Register dst) {
+    alu(4, ref, dst);
+}
+
+void Compiler::andb(byte imm, const MemRef &dst) {
+    alub(4, imm, dst);
+}
+
+void Compiler::andb(byte imm, ByteRegister dst) {
+    alub(4, imm, dst);
+}
+
+void Compiler::andb(ByteRegister src, ByteRegister dst) {
+    alub(4, src, dst);
+}
+
+void Compiler::andb(ByteRegister src, const MemRef &dst) {
+    alub(4, src, dst);
+}
+
+void Compiler::andb(const MemRef &src, ByteRegister dst) {
+    alub(4, src, dst);
+}
+
+void Compiler::_and(int imm, const MemRef &dst) {
+    alu(4, imm, dst);
+}
+
+void Compiler::_and(const SymRef &ref, const MemRef &dst) {
+    alu(4, ref, dst);
+}
+
+void Compiler::_and(Register src, Register dst) {
+    alu(4, src, dst);
+}
+
+void Compiler::_and(Register src, const MemRef &dst) {
+    alu(4, src, dst);
+}
+
+void Compiler::_and(const MemRef &src, Register dst) {
+    alu(4, src, dst);
+}
+
+void Compiler::casLoop(const MemRef &dst, const std::function<void()> &update) {
+    std::string loop = blockLabel();
+
+    mov(dst, EAX);
+
+    pushSymbol(loop, sectionName(text), sectionSize(text));
+    update();
+    lock();
+    cmpxchg(EDX, dst);
+    j(NE, rel(loop));
+}
+
+void Compiler::clflushopt(const MemRef &ref) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0xae, 7, ref);
+}
+
+void Compiler::cltd() {
+    instr(0x99);
+}
+
+void Compiler::cold() {
+    if (text == COLD)
+        return;
+
+    hotFrame = frame;
+    text = COLD;
+
+    if (hotTable < 0)
+        return;
+
+    std::string begin = blockLabel();
+    pushSymbol(begin, sectionName(COLD), sectionSize(COLD));
+
+    unwindTables.push_back({ begin, blockLabel(), frame, {} });
+    coldTable = unwindTables.size() - 1;
+    coldStart = sectionSize(COLD);
+}
+
+void Compiler::hot() {
+    if (text == TEXT)
+        return;
+
+    if (coldTable >= 0)
+        pushSymbol(unwindTables[coldTable].end, sectionName(COLD), sectionSize(COLD));
+
+    coldTable = -1;
+    text = TEXT;
+    frame = hotFrame;
+    inEpilogue = false;
+}
+
+void Compiler::cmov(Condition cond, Register src, Register dst) {
+    prefix(0x0f);
+    instr(0x40 + cond, dst, src);
+}
+
+void Compiler::cmov(Condition cond, const MemRef &src, Register dst) {
+    prefix(0x0f);
+    instr(0x40 + cond, dst, src);
+}
+
+void Compiler::cmp(int imm, Register dst) {
+    alu(7, imm, dst);
+}
+
+void Compiler::cmp(const SymRef &ref, Register dst) {
+    alu(7, ref, dst);
+}
+
+void Compiler::cmpb(byte imm, const MemRef &dst) {
+    alub(7, imm, dst);
+}
+
+void Compiler::cmpb(byte imm, ByteRegister dst) {
+    alub(7, imm, dst);
+}
+
+void Compiler::cmpb(ByteRegister src, ByteRegister dst) {
+    alub(7, src, dst);
+}
+
+void Compiler::cmpb(ByteRegister src, const MemRef &dst) {
+    alub(7, src, dst);
+}
+
+void Compiler::cmpb(const MemRef &src, ByteRegister dst) {
+    alub(7, src, dst);
+}
+
+void Compiler::cmp(int imm, const MemRef &dst) {
+    alu(7, imm, dst);
+}
+
+void Compiler::cmp(const SymRef &ref, const MemRef &dst) {
+    alu(7, ref, dst);
+}
+
+void Compiler::cmp(Register src, Register dst) {
+    alu(7, src, dst);
+}
+
+void Compiler::cmp(Register src, const MemRef &dst) {
+    alu(7, src, dst);
+}
+
+void Compiler::cmp(const MemRef &src, Register dst) {
+    alu(7, src, dst);
+}
+
+void Compiler::bsf(Register src, Register dst) {
+    prefix(0x0f);
+    instr(0xbc, dst, src);
+}
+
+void Compiler::bsf(const MemRef &src, Register dst) {
+    prefix(0x0f);
+    instr(0xbc, dst, src);
+}
+
+void Compiler::bsr(Register src, Register dst) {
+    prefix(0x0f);
+    instr(0xbd, dst, src);
+}
+
+void Compiler::bsr(const MemRef &src, Register dst) {
+    prefix(0x0f);
+    instr(0xbd, dst, src);
 }
 
 void Compiler::call(int disp) {
@@ -330,6 +682,61 @@ void Compiler::fiaddl(const MemRef &ref) {
     instr(0xda, 0, ref);
 }
 
+void Compiler::cmpsb() {
+    instr(0xa6);
+}
+
+void Compiler::cmpsl() {
+    instr(0xa7);
+}
+
+void Compiler::cmpxchg(Register src, Register dst) {
+    prefix(0x0f);
+    instr(0xb1, src, dst);
+}
+
+void Compiler::cmpxchg(Register src, const MemRef &dst) {
+    prefix(0x0f);
+    instr(0xb1, src, dst);
+}
+
+void Compiler::cmpxchg8b(const MemRef &ref) {
+    prefix(0x0f);
+    instr(0xc7, 1, ref);
+}
+
+void Compiler::dec(Register reg) {
+    instr(0x48 + reg);
+}
+
+void Compiler::dec(const MemRef &ref) {
+    instr(0xff, 1, ref);
+}
+
+void Compiler::div(Register reg) {
+    instr(0xf7, 6, reg);
+}
+
+void Compiler::div(const MemRef &ref) {
+    instr(0xf7, 6, ref);
+}
+
+void Compiler::divpd(XMMRegister src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x5e, dst, static_cast<Register>(src));
+}
+
+void Compiler::divpd(const MemRef &src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x5e, dst, src);
+}
+
+void Compiler::fchs() {
+    instr(0xd9, static_cast<byte>(0xe0));
+}
+
 void Compiler::fdivs(const MemRef &ref) {
     instr(0xd8, 6, ref);
 }
@@ -511,383 +918,3396 @@ void Compiler::fisubrl(const MemRef &ref) {
     instr(0xda, 5, ref);
 }
 
-void Compiler::lea(const MemRef &src, Register dst) {
-    instr(0x8d, dst, src);
+void Compiler::idiv(Register reg) {
+    instr(0xf7, 7, reg);
 }
 
-void Compiler::leave() {
-    instr(0xc9);
+void Compiler::idiv(const MemRef &ref) {
+    instr(0xf7, 7, ref);
 }
 
-void Compiler::mov(Register src, Register dst) {
-    instr(0x89, src, dst);
+void Compiler::imul(Register reg) {
+    instr(0xf7, 5, reg);
 }
 
-void Compiler::mov(int imm, Register dst) {
-    instr(0xb8 + dst, imm);
+void Compiler::imul(const MemRef &ref) {
+    instr(0xf7, 5, ref);
 }
 
-void Compiler::mov(const SymRef &src, Register dst) {
-    instr(0xb8 + dst, src);
+void Compiler::imul(Register src, Register dst) {
+    prefix(0x0f);
+    instr(0xaf, dst, src);
 }
 
-void Compiler::mov(int imm, const MemRef &dst) {
-    instr(0xc7, 0, dst, imm);
+void Compiler::imul(const MemRef &src, Register dst) {
+    prefix(0x0f);
+    instr(0xaf, dst, src);
 }
 
-void Compiler::mov(const SymRef &ref, const MemRef &dst) {
-    instr(0xc7, 0, dst, ref);
+void Compiler::imul(int imm, Register dst) {
+    imul(imm, dst, dst);
 }
 
-void Compiler::mov(Register src, const MemRef &dst) {
-    instr(0x89, src, dst);
+void Compiler::imul(int imm, Register src, Register dst) {
+    if (isByte(imm))
+        instr(0x6b, dst, src, static_cast<byte>(imm));
+    else
+        instr(0x69, dst, src, imm);
 }
 
-void Compiler::mov(const MemRef &src, Register dst) {
-    instr(0x8b, dst, src);
+void Compiler::imul(int imm, const MemRef &src, Register dst) {
+    if (isByte(imm))
+        instr(0x6b, dst, src, static_cast<byte>(imm));
+    else
+        instr(0x69, dst, src, imm);
 }
 
-void Compiler::nop() {
-    instr(0x90);
+void Compiler::inc(Register reg) {
+    instr(0x40 + reg);
 }
 
-void Compiler::pop(Register reg) {
-    instr(0x58 + reg);
+void Compiler::inc(const MemRef &ref) {
+    instr(0xff, 0, ref);
 }
 
-void Compiler::pop(const MemRef &ref) {
-    instr(0x8f, 0, ref);
-}
+void Compiler::inlineMemcmp(uint size) {
+    if (size == 0) {
+        _xor(EAX, EAX);
+        return;
+    }
 
-void Compiler::push(Register reg) {
-    instr(0x50 + reg);
-}
+    if (vectorWidth < 16 || size < 16 || size > 8 * 16) {
+        mov(size, ECX);
+        repe();
+        cmpsb();
+        movzbl(ref(-1, ESI), EAX);
+        movzbl(ref(-1, EDI), EDX);
+        sub(EDX, EAX);
+        return;
+    }
 
-void Compiler::push(const MemRef &ref) {
-    instr(0xff, 6, ref);
-}
+    std::string found = blockLabel(), done = blockLabel();
 
-void Compiler::push(int value) {
-    if (isByte(value))
-        instr(0x6a, static_cast<byte>(value));
-    else
-        instr(0x68, value);
-}
+    for (uint offset = 0, at = 0; offset < size; offset += 16) {
+        uint next = std::min(offset, size - 16);
 
-void Compiler::push(const SymRef &ref) {
-    instr(0x68, ref);
-}
+        if (next != at) {
+            add(next - at, ESI);
+            add(next - at, EDI);
+            at = next;
+        }
 
-void Compiler::ret() {
-    instr(0xc3);
-}
+        compareChunk(found);
+    }
 
-void Compiler::sub(int imm, Register dst) {
-    if (isByte(imm))
-        instr(0x83, 5, dst, static_cast<byte>(imm));
-    else if (dst == EAX)
-        instr(0x2d, imm);
-    else
-        instr(0x81, 5, dst, imm);
-}
+    jmp(rel(done));
 
-void Compiler::sub(const SymRef &ref, Register dst) {
-    if (dst == EAX)
-        instr(0x2d, ref);
-    else
-        instr(0x81, 5, dst, ref);
-}
+    pushSymbol(found, sectionName(text), sectionSize(text));
+    bsf(EAX, ECX);
+    movzbl(ref(ESI, ECX, 1), EAX);
+    movzbl(ref(EDI, ECX, 1), EDX);
+    sub(EDX, EAX);
 
-void Compiler::subb(byte imm, const MemRef &dst) {
-    instr(0x80, 5, dst, imm);
+    pushSymbol(done, sectionName(text), sectionSize(text));
 }
 
-void Compiler::sub(int imm, const MemRef &dst) {
-    if (isByte(imm))
-        instr(0x83, 5, dst, static_cast<byte>(imm));
-    else
-        instr(0x81, 5, dst, imm);
-}
+void Compiler::inlineMemcmp() {
+    std::string tail = blockLabel(), found = blockLabel(), done = blockLabel();
 
-void Compiler::sub(const SymRef &ref, const MemRef &dst) {
-    instr(0x81, 5, dst, ref);
-}
+    _xor(EAX, EAX);
 
-void Compiler::sub(Register src, const MemRef &dst) {
-    instr(0x29, src, dst);
-}
+    if (vectorWidth >= 16) {
+        std::string loop = blockLabel();
 
-void Compiler::sub(const MemRef &src, Register dst) {
-    instr(0x2b, dst, src);
-}
+        cmp(16, ECX);
+        j(B, rel(tail));
 
-ByteArray Compiler::writeOBJ() const {
-    ByteArray image;
+        pushSymbol(loop, sectionName(text), sectionSize(text));
+        compareChunk(found);
+        add(16, ESI);
+        add(16, EDI);
+        sub(16, ECX);
+        cmp(16, ECX);
+        j(AE, rel(loop));
+    }
 
-    FileHeader fileHeader = {};
+    pushSymbol(tail, sectionName(text), sectionSize(text));
+    test(ECX, ECX);
+    j(E, rel(done));
+    repe();
+    cmpsb();
+    movzbl(ref(-1, ESI), EAX);
+    movzbl(ref(-1, EDI), EDX);
+    sub(EDX, EAX);
+    jmp(rel(done));
+
+    pushSymbol(found, sectionName(text), sectionSize(text));
+    bsf(EAX, ECX);
+    movzbl(ref(ESI, ECX, 1), EAX);
+    movzbl(ref(EDI, ECX, 1), EDX);
+    sub(EDX, EAX);
+
+    pushSymbol(done, sectionName(text), sectionSize(text));
+}
+
+void Compiler::inlineMemcpy(uint size) {
+    if (size > 8 * vectorWidth) {
+        mov(size, ECX);
+        rep();
+        movsb();
+        return;
+    }
 
-    fileHeader.machine = IMAGE_FILE_MACHINE_I386;
-    fileHeader.numberOfSections = 4;
-    fileHeader.characteristics = IMAGE_FILE_32BIT_MACHINE | IMAGE_FILE_LINE_NUMS_STRIPPED;
+    uint chunk = blockChunk(size);
 
-    uint ptr = sizeof(fileHeader) + fileHeader.numberOfSections * sizeof(SectionHeader);
+    for (uint offset = 0, slot = 0; offset < size; offset += chunk, slot ^= 1) {
+        uint at = std::min(offset, size - chunk);
 
-    std::vector<SectionHeader> sectionHeaders;
+        loadChunk(chunk, ref(at, ESI), slot);
+        storeChunk(chunk, slot, ref(at, EDI));
+    }
 
-    SectionHeader header = {};
+    if (chunk == 32)
+        vzeroupper();
+}
 
-    strcat(header.name, ".text");
-    header.sizeOfRawData = sectionSize(TEXT);
-    header.pointerToRawData = ptr;
-    header.characteristics = IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ | IMAGE_SCN_CNT_CODE;
+void Compiler::inlineMemcpy() {
+    std::string large = blockLabel(), done = blockLabel();
 
-    ptr += header.sizeOfRawData;
-    sectionHeaders << header;
+    cmp(8 * vectorWidth, ECX);
+    j(AE, rel(large));
 
-    header = {};
+    blockSizeClasses(false, done);
 
-    strcat(header.name, ".data");
-    header.sizeOfRawData = sectionSize(DATA);
-    header.pointerToRawData = header.sizeOfRawData ? ptr : 0;
-    header.characteristics = IMAGE_SCN_MEM_WRITE | IMAGE_SCN_MEM_READ | IMAGE_SCN_CNT_INITIALIZED_DATA;
+    pushSymbol(large, sectionName(text), sectionSize(text));
+    rep();
+    movsb();
 
-    ptr += header.sizeOfRawData;
-    sectionHeaders << header;
+    pushSymbol(done, sectionName(text), sectionSize(text));
 
-    header = {};
+    if (vectorWidth == 32)
+        vzeroupper();
+}
 
-    strcat(header.name, ".bss");
-    header.sizeOfRawData = sectionSize(BSS);
-    header.pointerToRawData = header.sizeOfRawData ? ptr : 0;
-    header.characteristics = IMAGE_SCN_MEM_WRITE | IMAGE_SCN_MEM_READ | IMAGE_SCN_CNT_UNINITIALIZED_DATA;
+void Compiler::inlineMemset(byte value, uint size) {
+    if (size == 0)
+        return;
 
-    ptr += header.sizeOfRawData;
-    sectionHeaders << header;
+    if (size > 8 * vectorWidth) {
+        fillRegisters(value, 4);
+        mov(size, ECX);
+        rep();
+        stosb();
+        return;
+    }
 
-    header = {};
+    uint chunk = blockChunk(size);
 
-    strcat(header.name, ".rdata");
-    header.sizeOfRawData = sectionSize(RDATA);
-    header.pointerToRawData = header.sizeOfRawData ? ptr : 0;
-    header.characteristics = IMAGE_SCN_MEM_READ | IMAGE_SCN_CNT_INITIALIZED_DATA;
+    fillRegisters(value, chunk);
 
-    ptr += header.sizeOfRawData;
-    sectionHeaders << header;
+    for (uint offset = 0; offset < size; offset += chunk)
+        storeChunk(chunk, 0, ref(std::min(offset, size - chunk), EDI));
 
-    sectionHeaders[0].pointerToRelocations = ptr;
-    sectionHeaders[0].numberOfRelocations = relocs.size();
+    if (chunk == 32)
+        vzeroupper();
+}
 
-    std::vector<RelocationDirective> textRelocs;
-    std::vector<SymbolTableEntry> symbolTable;
-    std::vector<std::string> symbolNames;
-    uint stringTableSize = 0;
-    ByteArray stringTable;
+void Compiler::inlineMemset(byte value) {
+    std::string large = blockLabel(), done = blockLabel();
 
-    for (const std::string &func : funcs) {
-        SymbolTableEntry entry = {};
+    fillRegisters(value, vectorWidth);
 
-        strcat(entry.e.name, ("_" + func).data());
-        entry.value = symbols.at(func).offset;
-        entry.sectionNumber = TEXT;
-        entry.type = IMAGE_SYM_DTYPE_FUNCTION << SCT_COMPLEX_TYPE_SHIFT;
-        entry.storageClass = IMAGE_SYM_CLASS_EXTERNAL;
+    cmp(8 * vectorWidth, ECX);
+    j(AE, rel(large));
 
-        symbolTable << entry;
-        symbolNames << entry.e.name;
-    }
+    blockSizeClasses(true, done);
 
-    uint sectionNumber = 1;
-    for (auto &header : sectionHeaders) {
-        SymbolTableEntry entry = {};
+    pushSymbol(large, sectionName(text), sectionSize(text));
+    rep();
+    stosb();
 
-        strcat(entry.e.name, header.name);
-        entry.sectionNumber = sectionNumber++;
-        entry.type = IMAGE_SYM_TYPE_NULL;
-        entry.storageClass = IMAGE_SYM_CLASS_STATIC;
+    pushSymbol(done, sectionName(text), sectionSize(text));
 
-        symbolTable << entry;
-        symbolNames << entry.e.name;
-    }
+    if (vectorWidth == 32)
+        vzeroupper();
+}
 
-    for (const std::string &func : externFuncs) {
-        SymbolTableEntry entry = {};
+void Compiler::j(Condition cond, int disp) {
+    prefix(0x0f);
+    instr(0x80 + cond, disp);
+}
 
-        strcat(entry.e.name, ("_" + func).data());
-        entry.sectionNumber = IMAGE_SYM_UNDEFINED;
-        entry.type = IMAGE_SYM_DTYPE_FUNCTION << SCT_COMPLEX_TYPE_SHIFT;
-        entry.storageClass = IMAGE_SYM_CLASS_EXTERNAL;
+void Compiler::j(Condition cond, const SymRef &ref) {
+    prefix(0x0f);
+    instr(0x80 + cond, ref);
+}
 
-        symbolTable << entry;
-        symbolNames << entry.e.name;
-    }
+void Compiler::jmp(int disp) {
+    instr(0xe9, disp);
+}
 
-    for (auto &reloc : relocs) {
-        RelocationDirective dir = {};
+void Compiler::jmp(const SymRef &ref) {
+    instr(0xe9, ref);
+}
 
-        dir.virtualAddress = reloc.offset;
-        dir.symbolIndex = find(symbolNames.begin(), symbolNames.end(), symbols.at(reloc.name).baseSymbol) - symbolNames.begin();
-        dir.type = reloc.type == RefRel ? IMAGE_REL_I386_REL32 : IMAGE_REL_I386_DIR32;
+void Compiler::jmp(Register reg) {
+    instr(0xff, 4, reg);
+}
 
-        textRelocs << dir;
-    }
+void Compiler::jmp(const MemRef &ref) {
+    instr(0xff, 4, ref);
+}
 
-    fileHeader.pointerToSymbolTable = ptr + relocs.size() * sizeof(RelocationDirective);
-    fileHeader.numberOfSymbols = symbolTable.size();
+void Compiler::lea(const MemRef &src, Register dst) {
+    uint start = sectionSize(text);
+    instr(0x8d, dst, src);
 
-    image.push(fileHeader);
+    if (dst == ESP)
+        loadFrame(start, src);
+}
 
-    image.push(reinterpret_cast<byte *>(sectionHeaders.data()), sectionHeaders.size() * sizeof(SectionHeader));
+void Compiler::leave() {
+    uint start = sectionSize(text);
+    instr(0xc9);
+    leaveFrame(start);
+}
 
-    for (auto &section : sections)
-        image.push(section.second);
+void Compiler::lfence() {
+    prefix(0x0f);
+    instr(0xae, 5, EAX);
+}
 
-    image.push(reinterpret_cast<byte *>(textRelocs.data()), textRelocs.size() * sizeof(RelocationDirective));
-    image.push(reinterpret_cast<byte *>(symbolTable.data()), symbolTable.size() * sizeof(SymbolTableEntry));
+void Compiler::lock() {
+    prefix(0xf0);
+}
 
-    if (stringTableSize > 0) {
-        image.push(stringTableSize);
-        image.push(stringTable);
-    }
+void Compiler::lzcnt(Register src, Register dst) {
+    prefix(0xf3);
+    prefix(0x0f);
+    instr(0xbd, dst, src);
+}
 
-    return image;
+void Compiler::lzcnt(const MemRef &src, Register dst) {
+    prefix(0xf3);
+    prefix(0x0f);
+    instr(0xbd, dst, src);
 }
 
-ByteArray Compiler::writeEXE() const {
-    ByteArray image;
-    return image;
+void Compiler::mfence() {
+    prefix(0x0f);
+    instr(0xae, 6, EAX);
 }
 
-ByteArray Compiler::writeDLL(const std::string & /*name*/) const {
-    ByteArray image;
-    return image;
+void Compiler::mov(Register src, Register dst) {
+    uint start = sectionSize(text);
+    instr(0x89, src, dst);
+    moveFrame(start, src, dst);
 }
 
-const ByteArray &Compiler::getCode() const {
-    return section(TEXT);
+void Compiler::mov(int imm, Register dst) {
+    instr(0xb8 + dst, imm);
+
+    if (dst == ESP)
+        clobberFrame();
 }
 
-Function Compiler::compileFunction() {
-    return std::move(Function(std::move(section(TEXT))));
+void Compiler::mov(const SymRef &src, Register dst) {
+    instr(0xb8 + dst, src);
+
+    if (dst == ESP)
+        clobberFrame();
 }
 
-void Compiler::instr(byte op) {
-    gen(op);
+void Compiler::mov(int imm, const MemRef &dst) {
+    instr(0xc7, 0, dst, imm);
 }
 
-void Compiler::instr(byte op, byte imm) {
-    gen(op);
-    gen(imm);
+void Compiler::mov(const SymRef &ref, const MemRef &dst) {
+    instr(0xc7, 0, dst, ref);
 }
 
-void Compiler::instr(byte op, int imm) {
-    gen(op);
-    gen(imm);
+void Compiler::mov(Register src, const MemRef &dst) {
+    instr(0x89, src, dst);
 }
 
-void Compiler::instr(byte op, const SymRef &ref) {
-    if (!isSymbolDefined(ref.name))
-        pushSymbol(ref.name, "", 0);
+void Compiler::mov(const MemRef &src, Register dst) {
+    instr(0x8b, dst, src);
 
-    instr(op, ref.offset);
+    if (dst == ESP)
+        clobberFrame();
+}
 
-    pushReloc({ ref.name, ref.type, sectionSize(TEXT) - 4 });
+void Compiler::movapd(XMMRegister src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x28, dst, static_cast<Register>(src));
 }
 
-void Compiler::instr(byte op, byte reg, Register rm) {
-    instr(op, reg, { Reg, rm, 0, 0, 0, 0 });
+void Compiler::movb(byte imm, const MemRef &dst) {
+    instr(0xc6, 0, dst, imm);
 }
 
-void Compiler::instr(byte op, byte reg, Register rm, byte imm) {
-    instr(op, reg, rm);
-    gen(imm);
+void Compiler::movb(byte imm, ByteRegister dst) {
+    instr(0xb0 + dst, imm);
 }
 
-void Compiler::instr(byte op, byte reg, Register rm, int imm) {
-    instr(op, reg, rm);
-    gen(imm);
+void Compiler::movb(ByteRegister src, ByteRegister dst) {
+    instr(0x88, src, static_cast<Register>(dst));
 }
 
-void Compiler::instr(byte op, byte reg, Register rm, const SymRef &ref) {
-    if (!isSymbolDefined(ref.name))
-        pushSymbol(ref.name, "", 0);
+void Compiler::movb(ByteRegister src, const MemRef &dst) {
+    instr(0x88, src, dst);
+}
 
-    instr(op, reg, rm, ref.offset);
+void Compiler::movb(const MemRef &src, ByteRegister dst) {
+    instr(0x8a, dst, src);
+}
 
-    pushReloc({ ref.name, ref.type, sectionSize(TEXT) - 4 });
+void Compiler::movd(Register src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x6e, dst, src);
 }
 
-void Compiler::instr(byte op, byte reg, const MemRef &rm) {
-    gen(op);
+void Compiler::movd(XMMRegister src, Register dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x7e, src, dst);
+}
 
-    gen(composeByte(rm.mod, reg, rm.rm));
+void Compiler::movdqu(const MemRef &src, XMMRegister dst) {
+    prefix(0xf3);
+    prefix(0x0f);
+    instr(0x6f, dst, src);
+}
 
-    if (rm.scale != 0)
-        gen(composeByte(log2(rm.scale), rm.index, rm.base));
+void Compiler::movdqu(XMMRegister src, const MemRef &dst) {
+    prefix(0xf3);
+    prefix(0x0f);
+    instr(0x7f, src, dst);
+}
 
-    if (rm.mod == Disp8)
-        gen(static_cast<byte>(rm.ref.offset));
-    else if (rm.mod == Disp32 || (rm.mod == Disp0 && (rm.rm == 5 || (rm.rm == 4 && rm.base == 5)))) {
-        gen(rm.ref.offset);
+void Compiler::movnti(Register src, const MemRef &dst) {
+    prefix(0x0f);
+    instr(0xc3, src, dst);
+}
 
-        if (!rm.ref.name.empty()) {
-            if (!isSymbolDefined(rm.ref.name))
-                pushSymbol(rm.ref.name, "", 0);
+void Compiler::movntdq(XMMRegister src, const MemRef &dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0xe7, src, dst);
+}
 
-            pushReloc({ rm.ref.name, rm.ref.type, sectionSize(TEXT) - 4 });
-        }
-    }
+void Compiler::movq(const MemRef &src, XMMRegister dst) {
+    prefix(0xf3);
+    prefix(0x0f);
+    instr(0x7e, dst, src);
 }
 
-void Compiler::instr(byte op, byte reg, const MemRef &rm, byte imm) {
-    instr(op, reg, rm);
-    gen(imm);
+void Compiler::movq(XMMRegister src, const MemRef &dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0xd6, src, dst);
 }
 
-void Compiler::instr(byte op, byte reg, const MemRef &rm, int imm) {
-    instr(op, reg, rm);
-    gen(imm);
+void Compiler::movsb() {
+    instr(0xa4);
 }
 
-void Compiler::instr(byte op, byte reg, const MemRef &rm, const SymRef &ref) {
-    if (!isSymbolDefined(ref.name))
-        pushSymbol(ref.name, "", 0);
+void Compiler::movsl() {
+    instr(0xa5);
+}
 
-    instr(op, reg, rm, ref.offset);
+void Compiler::movsbl(ByteRegister src, Register dst) {
+    prefix(0x0f);
+    instr(0xbe, dst, static_cast<Register>(src));
+}
 
-    pushReloc({ ref.name, ref.type, sectionSize(TEXT) - 4 });
+void Compiler::movsbl(const MemRef &src, Register dst) {
+    prefix(0x0f);
+    instr(0xbe, dst, src);
 }
 
-bool Compiler::isSectionDefined(SectionID id) const {
-    return sections.find(id) != sections.end();
+void Compiler::movswl(Register src, Register dst) {
+    prefix(0x0f);
+    instr(0xbf, dst, src);
 }
 
-uint Compiler::sectionSize(SectionID id) const {
-    return isSectionDefined(id) ? section(id).size() : 0;
+void Compiler::movswl(const MemRef &src, Register dst) {
+    prefix(0x0f);
+    instr(0xbf, dst, src);
 }
 
-ByteArray &Compiler::section(SectionID id) {
-    if (!isSectionDefined(id))
-        sections[id] = ByteArray();
+void Compiler::movupd(const MemRef &src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x10, dst, src);
+}
 
-    return sections.at(id);
+void Compiler::movupd(XMMRegister src, const MemRef &dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x11, src, dst);
 }
 
-const ByteArray &Compiler::section(SectionID id) const {
-    return sections.at(id);
+void Compiler::movw(Register src, const MemRef &dst) {
+    prefix(0x66);
+    instr(0x89, src, dst);
 }
 
-bool Compiler::isSymbolDefined(const std::string &name) const {
-    return symbols.find(name) != symbols.end();
+void Compiler::movw(const MemRef &src, Register dst) {
+    prefix(0x66);
+    instr(0x8b, dst, src);
 }
 
-void Compiler::pushSymbol(const std::string &name, const std::string &baseSymbol, uint offset) {
-    if (isSymbolDefined(name))
-        throw std::runtime_error("symbol '" + name + "' is already defined");
+void Compiler::movzbl(ByteRegister src, Register dst) {
+    prefix(0x0f);
+    instr(0xb6, dst, static_cast<Register>(src));
+}
 
-    symbols[name] = Symbol{ baseSymbol, offset };
+void Compiler::movzbl(const MemRef &src, Register dst) {
+    prefix(0x0f);
+    instr(0xb6, dst, src);
 }
 
-void Compiler::pushReloc(const Reloc &reloc) {
-    relocs << reloc;
+void Compiler::movzwl(Register src, Register dst) {
+    prefix(0x0f);
+    instr(0xb7, dst, src);
+}
+
+void Compiler::movzwl(const MemRef &src, Register dst) {
+    prefix(0x0f);
+    instr(0xb7, dst, src);
+}
+
+void Compiler::mul(Register reg) {
+    instr(0xf7, 4, reg);
+}
+
+void Compiler::mul(const MemRef &ref) {
+    instr(0xf7, 4, ref);
+}
+
+void Compiler::mulpd(XMMRegister src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x59, dst, static_cast<Register>(src));
+}
+
+void Compiler::mulpd(const MemRef &src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x59, dst, src);
+}
+
+void Compiler::neg(Register reg) {
+    instr(0xf7, 3, reg);
+}
+
+void Compiler::neg(const MemRef &ref) {
+    instr(0xf7, 3, ref);
+}
+
+void Compiler::nop() {
+    instr(0x90);
+}
+
+void Compiler::pand(XMMRegister src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0xdb, dst, static_cast<Register>(src));
+}
+
+void Compiler::patchableCall(const std::string &site, const SymRef &ref) {
+    patchable(site, 0xe8, ref);
+}
+
+void Compiler::patchableJmp(const std::string &site, const SymRef &ref) {
+    patchable(site, 0xe9, ref);
+}
+
+void Compiler::_not(Register reg) {
+    instr(0xf7, 2, reg);
+}
+
+void Compiler::_not(const MemRef &ref) {
+    instr(0xf7, 2, ref);
+}
+
+void Compiler::_or(int imm, Register dst) {
+    alu(1, imm, dst);
+}
+
+void Compiler::_or(const SymRef &ref, Register dst) {
+    alu(1, ref, dst);
+}
+
+void Compiler::orb(byte imm, const MemRef &dst) {
+    alub(1, imm, dst);
+}
+
+void Compiler::orb(byte imm, ByteRegister dst) {
+    alub(1, imm, dst);
+}
+
+void Compiler::orb(ByteRegister src, ByteRegister dst) {
+    alub(1, src, dst);
+}
+
+void Compiler::orb(ByteRegister src, const MemRef &dst) {
+    alub(1, src, dst);
+}
+
+void Compiler::orb(const MemRef &src, ByteRegister dst) {
+    alub(1, src, dst);
+}
+
+void Compiler::_or(int imm, const MemRef &dst) {
+    alu(1, imm, dst);
+}
+
+void Compiler::_or(const SymRef &ref, const MemRef &dst) {
+    alu(1, ref, dst);
+}
+
+void Compiler::_or(Register src, Register dst) {
+    alu(1, src, dst);
+}
+
+void Compiler::_or(Register src, const MemRef &dst) {
+    alu(1, src, dst);
+}
+
+void Compiler::_or(const MemRef &src, Register dst) {
+    alu(1, src, dst);
+}
+
+Compiler::CallGraph Compiler::readProfile(const std::string &fileName) {
+    std::ifstream stream(fileName);
+
+    if (!stream)
+        throw std::runtime_error("cannot open profile '" + fileName + "'");
+
+    CallGraph graph;
+    std::string line;
+
+    while (std::getline(stream, line)) {
+        std::istringstream fields(line);
+        std::string caller, callee, count;
+
+        if (!(fields >> caller >> callee))
+            continue;
+
+        if (fields >> count)
+            graph[{ caller, callee }] += fromString<ulong>(count);
+        else
+            graph[{ caller, caller }] += fromString<ulong>(callee);
+    }
+
+    return graph;
+}
+
+void Compiler::orderFunctions(const std::vector<std::string> &order) {
+    std::vector<FunctionRange> ranges = functionRanges(), result;
+
+    if (!ranges.empty() && ranges[0].name.empty()) {
+        result << ranges[0];
+        ranges.erase(ranges.begin());
+    }
+
+    for (const std::string &name : order)
+        for (auto i = ranges.begin(); i != ranges.end(); i++)
+            if (i->name == name) {
+                result << *i;
+                ranges.erase(i);
+                break;
+            }
+
+    result.insert(result.end(), ranges.begin(), ranges.end());
+
+    rearrange(result);
+}
+
+void Compiler::orderFunctions(const CallGraph &graph) {
+    std::map<std::string, ulong> weights;
+    std::map<std::pair<std::string, std::string>, ulong> edges;
+
+    for (auto &edge : graph) {
+        const std::string &a = edge.first.first, &b = edge.first.second;
+
+        weights[a] += edge.second;
+
+        if (a != b) {
+            weights[b] += edge.second;
+            edges[a < b ? edge.first : std::make_pair(b, a)] += edge.second;
+        }
+    }
+
+    typedef std::pair<ulong, std::pair<std::string, std::string>> WeightedEdge;
+
+    std::vector<WeightedEdge> sorted;
+
+    for (auto &edge : edges)
+        sorted.push_back({ edge.second, edge.first });
+
+    std::stable_sort(sorted.begin(), sorted.end(), [](const WeightedEdge &a, const WeightedEdge &b) {
+        return a.first > b.first;
+    });
+
+    // Pettis-Hansen: merge the chains joined by the heaviest edges first, so
+    // functions calling each other a lot end up next to each other.
+    std::map<std::string, uint> chainOf;
+    std::vector<std::vector<std::string>> chains;
+
+    for (auto &weight : weights) {
+        chainOf[weight.first] = chains.size();
+        chains.push_back({ weight.first });
+    }
+
+    for (auto &edge : sorted) {
+        uint a = chainOf[edge.second.first], b = chainOf[edge.second.second];
+
+        if (a == b)
+            continue;
+
+        std::vector<std::string> &first = chains[a], &second = chains[b];
+        uint i = find(first.begin(), first.end(), edge.second.first) - first.begin();
+        uint j = find(second.begin(), second.end(), edge.second.second) - second.begin();
+
+        // Of a+b, rev(a)+b, a+rev(b) and b+a, pick the one placing the
+        // endpoints of the edge closest together (counted in functions).
+        uint distances[] = {
+            static_cast<uint>(first.size() - 1 - i + j),
+            i + j,
+            static_cast<uint>(first.size() - 1 - i + second.size() - 1 - j),
+            static_cast<uint>(second.size() - 1 - j + i)
+        };
+
+        uint best = std::min_element(distances, distances + 4) - distances;
+
+        if (best == 1)
+            std::reverse(first.begin(), first.end());
+        else if (best == 2)
+            std::reverse(second.begin(), second.end());
+
+        for (const std::string &name : second)
+            chainOf[name] = a;
+
+        if (best == 3)
+            first.insert(first.begin(), second.begin(), second.end());
+        else
+            first.insert(first.end(), second.begin(), second.end());
+
+        second.clear();
+    }
+
+    std::vector<std::pair<ulong, uint>> hotness;
+
+    for (uint i = 0; i < chains.size(); i++)
+        if (!chains[i].empty()) {
+            ulong total = 0;
+
+            for (const std::string &name : chains[i])
+                total += weights[name];
+
+            hotness.push_back({ total, i });
+        }
+
+    std::stable_sort(hotness.begin(), hotness.end(), [](const std::pair<ulong, uint> &a, const std::pair<ulong, uint> &b) {
+        return a.first > b.first;
+    });
+
+    std::vector<std::string> order;
+
+    for (auto &chain : hotness)
+        order.insert(order.end(), chains[chain.second].begin(), chains[chain.second].end());
+
+    orderFunctions(order);
+}
+
+void Compiler::orderFunctions(const std::map<std::string, uint> &counts) {
+    CallGraph graph;
+
+    for (auto &count : counts)
+        graph[{ count.first, count.first }] = count.second;
+
+    orderFunctions(graph);
+}
+
+uint Compiler::foldFunctions() {
+    std::vector<FunctionRange> ranges = functionRanges();
+    std::vector<std::vector<uint>> rangeRelocs(ranges.size());
+    uint size = sectionSize(TEXT);
+    const byte *code = section(TEXT).data();
+
+    auto rangeOf = [&](uint offset) {
+        uint i = 0;
+
+        while (i + 1 < ranges.size() && ranges[i + 1].begin <= offset)
+            i++;
+
+        return i;
+    };
+
+    for (uint i = 0; i < relocs.size(); i++)
+        if (relocs[i].section == TEXT)
+            rangeRelocs[rangeOf(relocs[i].offset)] << i;
+
+    std::vector<bool> eligible(ranges.size()), removed(ranges.size());
+
+    for (uint i = 0; i < ranges.size(); i++)
+        eligible[i] = !ranges[i].name.empty() && ranges[i].begin < ranges[i].end;
+
+    for (auto &site : patchSites)
+        eligible[rangeOf(site.second)] = false;
+
+    // The code with its reference fields cleared, then every reference:
+    // where it is, its addend, and its target. Targets inside the function
+    // are identified by their offset in it, other defined ones by their
+    // place in their section, so references to functions folded in an
+    // earlier round match. References resolved by relocate() are compared
+    // by the address they reach.
+    auto signature = [&](uint i) {
+        const FunctionRange &range = ranges[i];
+        std::string bytes(reinterpret_cast<const char *>(code + range.begin), range.end - range.begin);
+        std::ostringstream targets;
+
+        for (uint index : rangeRelocs[i]) {
+            const Reloc &reloc = relocs[index];
+            const Symbol &symbol = symbols.at(reloc.name);
+            uint offset = reloc.offset - range.begin;
+            int value = *reinterpret_cast<const int *>(code + reloc.offset);
+            bool isResolved = resolved.find(reloc.name) != resolved.end();
+
+            if (reloc.type == RefRel && isResolved)
+                value += reinterpret_cast<int>(code + reloc.offset + 4);
+
+            bytes.replace(offset, 4, 4, '\0');
+            targets << offset << ' ' << reloc.type << ' ' << value << ' ';
+
+            if (isResolved)
+                targets << '=';
+            else if (symbol.baseSymbol == ".text" && symbol.offset >= range.begin && symbol.offset < range.end)
+                targets << '@' << symbol.offset - range.begin;
+            else if (!symbol.baseSymbol.empty() && symbol.baseSymbol[0] == '.')
+                targets << symbol.baseSymbol << '+' << symbol.offset;
+            else
+                targets << reloc.name;
+
+            targets << '\n';
+        }
+
+        return bytes + '\0' + targets.str();
+    };
+
+    std::set<std::string> names;
+
+    for (bool changed = true; changed;) {
+        std::unordered_map<std::string, uint> survivors;
+        changed = false;
+
+        for (uint i = 0; i < ranges.size(); i++) {
+            if (!eligible[i] || removed[i])
+                continue;
+
+            auto survivor = survivors.insert({ signature(i), i });
+
+            if (survivor.second)
+                continue;
+
+            const FunctionRange &from = ranges[i], &to = ranges[survivor.first->second];
+
+            // Labels in the folded code, and the functions folded into it
+            // before, move to the same place in the survivor.
+            for (auto &symbol : symbols) {
+                uint &offset = symbol.second.offset;
+
+                if (symbol.second.baseSymbol == ".text" && offset >= from.begin && (offset < from.end || (offset == size && from.end == size)))
+                    offset = offset - from.begin + to.begin;
+            }
+
+            names.insert(from.name);
+            removed[i] = true;
+            changed = true;
+        }
+    }
+
+    if (names.empty())
+        return 0;
+
+    folded.insert(names.begin(), names.end());
+
+    for (uint i = unwindTables.size(); i-- > 0;)
+        if (names.count(unwindTables[i].begin)) {
+            unwindTables.erase(unwindTables.begin() + i);
+
+            for (int *table : { &hotTable, &coldTable })
+                if (*table == static_cast<int>(i))
+                    *table = -1;
+                else if (*table > static_cast<int>(i))
+                    (*table)--;
+        }
+
+    std::vector<FunctionRange> kept;
+
+    for (uint i = 0; i < ranges.size(); i++)
+        if (!removed[i])
+            kept << ranges[i];
+
+    rearrange(kept);
+
+    // The kept functions close up, but one holding aligned code may need
+    // more padding at its new place than the folded code took.
+    return size > sectionSize(TEXT) ? size - sectionSize(TEXT) : 0;
+}
+
+void Compiler::pause() {
+    prefix(0xf3);
+    instr(0x90);
+}
+
+void Compiler::pcmpeqb(XMMRegister src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x74, dst, static_cast<Register>(src));
+}
+
+void Compiler::pcmpeqb(const MemRef &src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x74, dst, src);
+}
+
+void Compiler::pmovmskb(XMMRegister src, Register dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0xd7, dst, static_cast<Register>(src));
+}
+
+void Compiler::pop(Register reg) {
+    uint start = sectionSize(text);
+    instr(0x58 + reg);
+    popFrame(start, reg);
+}
+
+void Compiler::pop(const MemRef &ref) {
+    uint start = sectionSize(text);
+    instr(0x8f, 0, ref);
+    adjustFrame(start, -4);
+}
+
+void Compiler::popcnt(Register src, Register dst) {
+    prefix(0xf3);
+    prefix(0x0f);
+    instr(0xb8, dst, src);
+}
+
+void Compiler::popcnt(const MemRef &src, Register dst) {
+    prefix(0xf3);
+    prefix(0x0f);
+    instr(0xb8, dst, src);
+}
+
+void Compiler::prefetch(PrefetchHint hint, const MemRef &ref) {
+    prefix(0x0f);
+    instr(0x18, hint, ref);
+}
+
+void Compiler::prefetchnta(const MemRef &ref) {
+    prefetch(PrefetchNTA, ref);
+}
+
+void Compiler::prefetcht0(const MemRef &ref) {
+    prefetch(PrefetchT0, ref);
+}
+
+void Compiler::prefetcht1(const MemRef &ref) {
+    prefetch(PrefetchT1, ref);
+}
+
+void Compiler::prefetcht2(const MemRef &ref) {
+    prefetch(PrefetchT2, ref);
+}
+
+void Compiler::pshufd(byte imm, XMMRegister src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x70, dst, static_cast<Register>(src), imm);
+}
+
+void Compiler::push(Register reg) {
+    instr(0x50 + reg);
+    pushFrame(reg);
+}
+
+void Compiler::push(const MemRef &ref) {
+    uint start = sectionSize(text);
+    instr(0xff, 6, ref);
+    adjustFrame(start, 4);
+}
+
+void Compiler::push(int value) {
+    uint start = sectionSize(text);
+
+    if (isByte(value))
+        instr(0x6a, static_cast<byte>(value));
+    else
+        instr(0x68, value);
+
+    adjustFrame(start, 4);
+}
+
+void Compiler::push(const SymRef &ref) {
+    uint start = sectionSize(text);
+    instr(0x68, ref);
+    adjustFrame(start, 4);
+}
+
+void Compiler::rcl(byte imm, Register dst) {
+    shift(2, imm, dst);
+}
+
+void Compiler::rcl(byte imm, const MemRef &dst) {
+    shift(2, imm, dst);
+}
+
+void Compiler::rcl(ByteRegister count, Register dst) {
+    shift(2, count, dst);
+}
+
+void Compiler::rcl(ByteRegister count, const MemRef &dst) {
+    shift(2, count, dst);
+}
+
+void Compiler::rcr(byte imm, Register dst) {
+    shift(3, imm, dst);
+}
+
+void Compiler::rcr(byte imm, const MemRef &dst) {
+    shift(3, imm, dst);
+}
+
+void Compiler::rcr(ByteRegister count, Register dst) {
+    shift(3, count, dst);
+}
+
+void Compiler::rcr(ByteRegister count, const MemRef &dst) {
+    shift(3, count, dst);
+}
+
+void Compiler::pxor(XMMRegister src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0xef, dst, static_cast<Register>(src));
+}
+
+void Compiler::rep() {
+    prefix(0xf3);
+}
+
+void Compiler::repe() {
+    prefix(0xf3);
+}
+
+void Compiler::repne() {
+    prefix(0xf2);
+}
+
+void Compiler::ret() {
+    instr(0xc3);
+    returnFrame();
+}
+
+void Compiler::rol(byte imm, Register dst) {
+    shift(0, imm, dst);
+}
+
+void Compiler::rol(byte imm, const MemRef &dst) {
+    shift(0, imm, dst);
+}
+
+void Compiler::rol(ByteRegister count, Register dst) {
+    shift(0, count, dst);
+}
+
+void Compiler::rol(ByteRegister count, const MemRef &dst) {
+    shift(0, count, dst);
+}
+
+void Compiler::ror(byte imm, Register dst) {
+    shift(1, imm, dst);
+}
+
+void Compiler::ror(byte imm, const MemRef &dst) {
+    shift(1, imm, dst);
+}
+
+void Compiler::ror(ByteRegister count, Register dst) {
+    shift(1, count, dst);
+}
+
+void Compiler::ror(ByteRegister count, const MemRef &dst) {
+    shift(1, count, dst);
+}
+
+void Compiler::sar(byte imm, Register dst) {
+    shift(7, imm, dst);
+}
+
+void Compiler::sar(byte imm, const MemRef &dst) {
+    shift(7, imm, dst);
+}
+
+void Compiler::sar(ByteRegister count, Register dst) {
+    shift(7, count, dst);
+}
+
+void Compiler::sar(ByteRegister count, const MemRef &dst) {
+    shift(7, count, dst);
+}
+
+void Compiler::sbb(int imm, Register dst) {
+    alu(3, imm, dst);
+}
+
+void Compiler::sbb(const SymRef &ref, Register dst) {
+    alu(3, ref, dst);
+}
+
+void Compiler::sbbb(byte imm, const MemRef &dst) {
+    alub(3, imm, dst);
+}
+
+void Compiler::sbbb(byte imm, ByteRegister dst) {
+    alub(3, imm, dst);
+}
+
+void Compiler::sbbb(ByteRegister src, ByteRegister dst) {
+    alub(3, src, dst);
+}
+
+void Compiler::sbbb(ByteRegister src, const MemRef &dst) {
+    alub(3, src, dst);
+}
+
+void Compiler::sbbb(const MemRef &src, ByteRegister dst) {
+    alub(3, src, dst);
+}
+
+void Compiler::sbb(int imm, const MemRef &dst) {
+    alu(3, imm, dst);
+}
+
+void Compiler::sbb(const SymRef &ref, const MemRef &dst) {
+    alu(3, ref, dst);
+}
+
+void Compiler::sbb(Register src, Register dst) {
+    alu(3, src, dst);
+}
+
+void Compiler::sbb(Register src, const MemRef &dst) {
+    alu(3, src, dst);
+}
+
+void Compiler::sbb(const MemRef &src, Register dst) {
+    alu(3, src, dst);
+}
+
+void Compiler::scasb() {
+    instr(0xae);
+}
+
+void Compiler::set(Condition cond, ByteRegister dst) {
+    prefix(0x0f);
+    instr(0x90 + cond, 0, static_cast<Register>(dst));
+}
+
+void Compiler::set(Condition cond, const MemRef &dst) {
+    prefix(0x0f);
+    instr(0x90 + cond, 0, dst);
+}
+
+void Compiler::sfence() {
+    prefix(0x0f);
+    instr(0xae, 7, EAX);
+}
+
+void Compiler::shl(byte imm, Register dst) {
+    shift(4, imm, dst);
+}
+
+void Compiler::shl(byte imm, const MemRef &dst) {
+    shift(4, imm, dst);
+}
+
+void Compiler::shl(ByteRegister count, Register dst) {
+    shift(4, count, dst);
+}
+
+void Compiler::shl(ByteRegister count, const MemRef &dst) {
+    shift(4, count, dst);
+}
+
+void Compiler::shr(byte imm, Register dst) {
+    shift(5, imm, dst);
+}
+
+void Compiler::shr(byte imm, const MemRef &dst) {
+    shift(5, imm, dst);
+}
+
+void Compiler::shr(ByteRegister count, Register dst) {
+    shift(5, count, dst);
+}
+
+void Compiler::shr(ByteRegister count, const MemRef &dst) {
+    shift(5, count, dst);
+}
+
+void Compiler::spinWait(const MemRef &ref, int value, uint maxBackoff) {
+    std::string check = blockLabel(), spin = blockLabel(), done = blockLabel();
+
+    mov(1, EDX);
+
+    pushSymbol(check, sectionName(text), sectionSize(text));
+    cmp(value, ref);
+    j(E, rel(done));
+    mov(EDX, ECX);
+
+    pushSymbol(spin, sectionName(text), sectionSize(text));
+    pause();
+    dec(ECX);
+    j(NE, rel(spin));
+
+    cmp(maxBackoff, EDX);
+    j(AE, rel(check));
+    shl(1, EDX);
+    jmp(rel(check));
+
+    pushSymbol(done, sectionName(text), sectionSize(text));
+}
+
+void Compiler::stosb() {
+    instr(0xaa);
+}
+
+void Compiler::stosl() {
+    instr(0xab);
+}
+
+void Compiler::streamLoop(Register ptr, Register end, uint step, uint distance, PrefetchHint hint, const std::function<void()> &body) {
+    std::string loop = blockLabel(), done = blockLabel();
+
+    cmp(end, ptr);
+    j(AE, rel(done));
+
+    pushSymbol(loop, sectionName(text), sectionSize(text));
+    prefetch(hint, ref(distance, ptr));
+    body();
+    add(step, ptr);
+    cmp(end, ptr);
+    j(B, rel(loop));
+
+    pushSymbol(done, sectionName(text), sectionSize(text));
+}
+
+void Compiler::_switch(Register reg, std::vector<std::pair<int, std::string>> cases, const std::string &defaultLabel) {
+    std::sort(cases.begin(), cases.end());
+
+    for (uint i = 1; i < cases.size(); i++)
+        if (cases[i].first == cases[i - 1].first)
+            throw std::runtime_error("duplicate case " + toString(cases[i].first, 10, 0));
+
+    switchTree(reg, cases.data(), cases.size(), defaultLabel);
+}
+
+void Compiler::sub(int imm, Register dst) {
+    uint start = sectionSize(text);
+    alu(5, imm, dst);
+
+    if (dst == ESP)
+        adjustFrame(start, imm);
+}
+
+void Compiler::sub(const SymRef &ref, Register dst) {
+    alu(5, ref, dst);
+}
+
+void Compiler::subb(byte imm, const MemRef &dst) {
+    alub(5, imm, dst);
+}
+
+void Compiler::subb(byte imm, ByteRegister dst) {
+    alub(5, imm, dst);
+}
+
+void Compiler::subb(ByteRegister src, ByteRegister dst) {
+    alub(5, src, dst);
+}
+
+void Compiler::subb(ByteRegister src, const MemRef &dst) {
+    alub(5, src, dst);
+}
+
+void Compiler::subb(const MemRef &src, ByteRegister dst) {
+    alub(5, src, dst);
+}
+
+void Compiler::sub(int imm, const MemRef &dst) {
+    alu(5, imm, dst);
+}
+
+void Compiler::sub(const SymRef &ref, const MemRef &dst) {
+    alu(5, ref, dst);
+}
+
+void Compiler::sub(Register src, Register dst) {
+    alu(5, src, dst);
+}
+
+void Compiler::sub(Register src, const MemRef &dst) {
+    alu(5, src, dst);
+}
+
+void Compiler::sub(const MemRef &src, Register dst) {
+    alu(5, src, dst);
+}
+
+void Compiler::subpd(XMMRegister src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x5c, dst, static_cast<Register>(src));
+}
+
+void Compiler::subpd(const MemRef &src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x5c, dst, src);
+}
+
+void Compiler::test(int imm, Register dst) {
+    if (dst == EAX)
+        instr(0xa9, imm);
+    else
+        instr(0xf7, 0, dst, imm);
+}
+
+void Compiler::testb(byte imm, const MemRef &dst) {
+    instr(0xf6, 0, dst, imm);
+}
+
+void Compiler::testb(byte imm, ByteRegister dst) {
+    if (dst == AL)
+        instr(0xa8, imm);
+    else
+        instr(0xf6, 0, static_cast<Register>(dst), imm);
+}
+
+void Compiler::testb(ByteRegister src, ByteRegister dst) {
+    instr(0x84, src, static_cast<Register>(dst));
+}
+
+void Compiler::testb(ByteRegister src, const MemRef &dst) {
+    instr(0x84, src, dst);
+}
+
+void Compiler::testb(const MemRef &src, ByteRegister dst) {
+    instr(0x84, dst, src);
+}
+
+void Compiler::test(int imm, const MemRef &dst) {
+    instr(0xf7, 0, dst, imm);
+}
+
+void Compiler::test(Register src, Register dst) {
+    instr(0x85, src, dst);
+}
+
+void Compiler::test(Register src, const MemRef &dst) {
+    instr(0x85, src, dst);
+}
+
+void Compiler::test(const MemRef &src, Register dst) {
+    instr(0x85, dst, src);
+}
+
+void Compiler::tzcnt(Register src, Register dst) {
+    prefix(0xf3);
+    prefix(0x0f);
+    instr(0xbc, dst, src);
+}
+
+void Compiler::tzcnt(const MemRef &src, Register dst) {
+    prefix(0xf3);
+    prefix(0x0f);
+    instr(0xbc, dst, src);
+}
+
+void Compiler::vaddpd(YMMRegister src, YMMRegister src2, YMMRegister dst) {
+    prefix(0xc5);
+    prefix((~src2 & 0xf) << 3 | 0x85);
+    instr(0x58, dst, static_cast<Register>(src));
+}
+
+void Compiler::vdivpd(YMMRegister src, YMMRegister src2, YMMRegister dst) {
+    prefix(0xc5);
+    prefix((~src2 & 0xf) << 3 | 0x85);
+    instr(0x5e, dst, static_cast<Register>(src));
+}
+
+void Compiler::vinsertf128(byte imm, XMMRegister src, YMMRegister src2, YMMRegister dst) {
+    prefix(0xc4);
+    prefix(0xe3);
+    prefix((~src2 & 0xf) << 3 | 0x05);
+    instr(0x18, dst, static_cast<Register>(src), imm);
+}
+
+void Compiler::vmovdqu(const MemRef &src, YMMRegister dst) {
+    prefix(0xc5);
+    prefix(0xfe);
+    instr(0x6f, dst, src);
+}
+
+void Compiler::vmovdqu(YMMRegister src, const MemRef &dst) {
+    prefix(0xc5);
+    prefix(0xfe);
+    instr(0x7f, src, dst);
+}
+
+void Compiler::vmovntdq(YMMRegister src, const MemRef &dst) {
+    prefix(0xc5);
+    prefix(0xfd);
+    instr(0xe7, src, dst);
+}
+
+void Compiler::vmovupd(const MemRef &src, YMMRegister dst) {
+    prefix(0xc5);
+    prefix(0xfd);
+    instr(0x10, dst, src);
+}
+
+void Compiler::vmovupd(YMMRegister src, const MemRef &dst) {
+    prefix(0xc5);
+    prefix(0xfd);
+    instr(0x11, src, dst);
+}
+
+void Compiler::vmulpd(YMMRegister src, YMMRegister src2, YMMRegister dst) {
+    prefix(0xc5);
+    prefix((~src2 & 0xf) << 3 | 0x85);
+    instr(0x59, dst, static_cast<Register>(src));
+}
+
+void Compiler::vsubpd(YMMRegister src, YMMRegister src2, YMMRegister dst) {
+    prefix(0xc5);
+    prefix((~src2 & 0xf) << 3 | 0x85);
+    instr(0x5c, dst, static_cast<Register>(src));
+}
+
+void Compiler::vxorpd(YMMRegister src, YMMRegister src2, YMMRegister dst) {
+    prefix(0xc5);
+    prefix((~src2 & 0xf) << 3 | 0x85);
+    instr(0x57, dst, static_cast<Register>(src));
+}
+
+void Compiler::vzeroupper() {
+    prefix(0xc5);
+    prefix(0xf8);
+    instr(0x77);
+}
+
+void Compiler::xadd(Register src, Register dst) {
+    prefix(0x0f);
+    instr(0xc1, src, dst);
+}
+
+void Compiler::xadd(Register src, const MemRef &dst) {
+    prefix(0x0f);
+    instr(0xc1, src, dst);
+}
+
+void Compiler::xchg(Register src, Register dst) {
+    if (src == EAX)
+        instr(0x90 + dst);
+    else if (dst == EAX)
+        instr(0x90 + src);
+    else
+        instr(0x87, src, dst);
+
+    if (src == ESP || dst == ESP)
+        clobberFrame();
+}
+
+void Compiler::xchg(Register src, const MemRef &dst) {
+    instr(0x87, src, dst);
+}
+
+void Compiler::_xor(int imm, Register dst) {
+    alu(6, imm, dst);
+}
+
+void Compiler::_xor(const SymRef &ref, Register dst) {
+    alu(6, ref, dst);
+}
+
+void Compiler::xorb(byte imm, const MemRef &dst) {
+    alub(6, imm, dst);
+}
+
+void Compiler::xorb(byte imm, ByteRegister dst) {
+    alub(6, imm, dst);
+}
+
+void Compiler::xorb(ByteRegister src, ByteRegister dst) {
+    alub(6, src, dst);
+}
+
+void Compiler::xorb(ByteRegister src, const MemRef &dst) {
+    alub(6, src, dst);
+}
+
+void Compiler::xorb(const MemRef &src, ByteRegister dst) {
+    alub(6, src, dst);
+}
+
+void Compiler::_xor(int imm, const MemRef &dst) {
+    alu(6, imm, dst);
+}
+
+void Compiler::_xor(const SymRef &ref, const MemRef &dst) {
+    alu(6, ref, dst);
+}
+
+void Compiler::_xor(Register src, Register dst) {
+    alu(6, src, dst);
+}
+
+void Compiler::_xor(Register src, const MemRef &dst) {
+    alu(6, src, dst);
+}
+
+void Compiler::_xor(const MemRef &src, Register dst) {
+    alu(6, src, dst);
+}
+
+void Compiler::xorpd(XMMRegister src, XMMRegister dst) {
+    prefix(0x66);
+    prefix(0x0f);
+    instr(0x57, dst, static_cast<Register>(src));
+}
+
+void Compiler::setVectorWidth(uint width) {
+    if (width != 4 && width != 16 && width != 32)
+        throw std::runtime_error("invalid vector width " + toString(width, 10, 0));
+
+    vectorWidth = width;
+}
+
+const CPUFeatures &Compiler::hostFeatures() {
+    static const CPUFeatures features = detectFeatures();
+    return features;
+}
+
+TargetLevel Compiler::hostLevel() {
+    const CPUFeatures &f = hostFeatures();
+
+    if (!f.sse41 || !f.sse42 || !f.popcnt)
+        return Baseline;
+
+    if (!f.avx2 || !f.bmi1 || !f.bmi2 || !f.lzcnt)
+        return SSE4;
+
+    if (!f.avx512f)
+        return AVX2;
+
+    return AVX512;
+}
+
+void Compiler::setTarget(TargetLevel level) {
+    static const uint widths[] = { 4, 16, 32, 32 };
+
+    target = level;
+    vectorWidth = widths[level];
+}
+
+TargetLevel Compiler::getTarget() const {
+    return target;
+}
+
+void Compiler::setStatsEnabled(bool enabled) {
+    statsEnabled = enabled;
+}
+
+Compiler::Stats Compiler::getStats() const {
+    Stats stats = {};
+
+    for (auto &section : sections) {
+        stats.sectionSizes[sectionName(section.first)] = section.second.size();
+        stats.reallocations += section.second.reallocations();
+    }
+
+    stats.opcodes = opcodes;
+
+    stats.symbols = symbols.size();
+    stats.relocs = relocs.size();
+
+    std::copy(seconds, seconds + NUM_PHASES, stats.seconds);
+
+    return stats;
+}
+
+ByteArray Compiler::writeOBJ() const {
+    PhaseTimer timer(*this, ObjectWriting);
+
+    if (!threadCounters.empty())
+        throw std::runtime_error("per-thread counters cannot be written to an object");
+
+    ByteArray image;
+
+    std::vector<std::pair<uint, SectionID>> frameSites;
+    ByteArray frames = ehFrame(frameSites);
+
+    FileHeader fileHeader = {};
+
+    fileHeader.machine = IMAGE_FILE_MACHINE_I386;
+    fileHeader.numberOfSections = 4 + (sectionSize(COLD) ? 1 : 0) + (frames.size() ? 1 : 0);
+    fileHeader.characteristics = IMAGE_FILE_32BIT_MACHINE | IMAGE_FILE_LINE_NUMS_STRIPPED;
+
+    uint ptr = sizeof(fileHeader) + fileHeader.numberOfSections * sizeof(SectionHeader);
+
+    std::vector<SectionHeader> sectionHeaders;
+    std::vector<std::string> headerNames = { ".text", ".data", ".bss", ".rdata" };
+
+    SectionHeader header = {};
+
+    strcat(header.name, ".text");
+    header.sizeOfRawData = sectionSize(TEXT);
+    header.pointerToRawData = ptr;
+    header.characteristics = IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ | IMAGE_SCN_CNT_CODE;
+
+    ptr += header.sizeOfRawData;
+    sectionHeaders << header;
+
+    header = {};
+
+    strcat(header.name, ".data");
+    header.sizeOfRawData = sectionSize(DATA);
+    header.pointerToRawData = header.sizeOfRawData ? ptr : 0;
+    header.characteristics = IMAGE_SCN_MEM_WRITE | IMAGE_SCN_MEM_READ | IMAGE_SCN_CNT_INITIALIZED_DATA;
+
+    ptr += header.sizeOfRawData;
+    sectionHeaders << header;
+
+    header = {};
+
+    strcat(header.name, ".bss");
+    header.sizeOfRawData = sectionSize(BSS);
+    header.pointerToRawData = header.sizeOfRawData ? ptr : 0;
+    header.characteristics = IMAGE_SCN_MEM_WRITE | IMAGE_SCN_MEM_READ | IMAGE_SCN_CNT_UNINITIALIZED_DATA;
+
+    ptr += header.sizeOfRawData;
+    sectionHeaders << header;
+
+    header = {};
+
+    strcat(header.name, ".rdata");
+    header.sizeOfRawData = sectionSize(RDATA);
+    header.pointerToRawData = header.sizeOfRawData ? ptr : 0;
+    header.characteristics = IMAGE_SCN_MEM_READ | IMAGE_SCN_CNT_INITIALIZED_DATA;
+
+    ptr += header.sizeOfRawData;
+    sectionHeaders << header;
+
+    ByteArray stringTable;
+    std::map<std::string, uint> longNames;
+
+    // Names longer than eight characters live in the string table and are
+    // referred to by offset: "/offset" from a section header, e.offset from
+    // a symbol. Offsets count the size field that starts the table.
+    auto longName = [&](const std::string &name) {
+        if (longNames.count(name))
+            return longNames.at(name);
+
+        uint offset = sizeof(uint32_t) + stringTable.size();
+        stringTable.push(reinterpret_cast<const byte *>(name.data()), name.size() + 1);
+
+        longNames[name] = offset;
+        return offset;
+    };
+
+    auto setName = [&](SymbolTableEntry &entry, const std::string &name) {
+        if (name.size() <= sizeof(entry.e.name))
+            strncpy(entry.e.name, name.data(), sizeof(entry.e.name));
+        else
+            entry.e.e.offset = longName(name);
+    };
+
+    if (sectionSize(COLD)) {
+        header = {};
+
+        strcat(header.name, ("/" + toString(longName(sectionName(COLD)), 10, 0)).data());
+        header.sizeOfRawData = sectionSize(COLD);
+        header.pointerToRawData = ptr;
+        header.characteristics = IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ | IMAGE_SCN_CNT_CODE;
+
+        ptr += header.sizeOfRawData;
+        sectionHeaders << header;
+        headerNames << sectionName(COLD);
+    }
+
+    if (frames.size()) {
+        header = {};
+
+        strcat(header.name, ("/" + toString(longName(".eh_frame"), 10, 0)).data());
+        header.sizeOfRawData = frames.size();
+        header.pointerToRawData = ptr;
+        header.characteristics = IMAGE_SCN_MEM_READ | IMAGE_SCN_CNT_INITIALIZED_DATA;
+
+        ptr += header.sizeOfRawData;
+        sectionHeaders << header;
+        headerNames << ".eh_frame";
+    }
+
+    std::vector<RelocationDirective> relocDirectives;
+    std::vector<SymbolTableEntry> symbolTable;
+    std::vector<std::string> symbolNames;
+
+    for (const std::string &func : funcs) {
+        SymbolTableEntry entry = {};
+
+        setName(entry, "_" + func);
+        entry.value = symbols.at(func).offset;
+        entry.sectionNumber = TEXT;
+        entry.type = IMAGE_SYM_DTYPE_FUNCTION << SCT_COMPLEX_TYPE_SHIFT;
+        entry.storageClass = IMAGE_SYM_CLASS_EXTERNAL;
+
+        symbolTable << entry;
+        symbolNames << "_" + func;
+    }
+
+    for (uint i = 0; i < sectionHeaders.size(); i++) {
+        SymbolTableEntry entry = {};
+
+        setName(entry, headerNames[i]);
+        entry.sectionNumber = i + 1;
+        entry.type = IMAGE_SYM_TYPE_NULL;
+        entry.storageClass = IMAGE_SYM_CLASS_STATIC;
+
+        symbolTable << entry;
+        symbolNames << headerNames[i];
+    }
+
+    for (const std::string &func : externFuncs) {
+        SymbolTableEntry entry = {};
+
+        setName(entry, "_" + func);
+        entry.sectionNumber = IMAGE_SYM_UNDEFINED;
+        entry.type = IMAGE_SYM_DTYPE_FUNCTION << SCT_COMPLEX_TYPE_SHIFT;
+        entry.storageClass = IMAGE_SYM_CLASS_EXTERNAL;
+
+        symbolTable << entry;
+        symbolNames << "_" + func;
+    }
+
+    for (const std::string &var : externVars) {
+        SymbolTableEntry entry = {};
+
+        setName(entry, "_" + var);
+        entry.sectionNumber = IMAGE_SYM_UNDEFINED;
+        entry.type = IMAGE_SYM_TYPE_NULL;
+        entry.storageClass = IMAGE_SYM_CLASS_EXTERNAL;
+
+        symbolTable << entry;
+        symbolNames << "_" + var;
+    }
+
+    for (uint i = 0; i < sectionHeaders.size(); i++) {
+        // Frame descriptions refer to the code they cover by address.
+        if (headerNames[i] == ".eh_frame")
+            for (auto &site : frameSites) {
+                RelocationDirective dir = {};
+
+                dir.virtualAddress = site.first;
+                dir.symbolIndex = find(symbolNames.begin(), symbolNames.end(), sectionName(site.second)) - symbolNames.begin();
+                dir.type = IMAGE_REL_I386_DIR32;
+
+                relocDirectives << dir;
+                sectionHeaders[i].numberOfRelocations++;
+            }
+
+        for (auto &reloc : relocs)
+            if (reloc.section == TEXT + i) {
+                RelocationDirective dir = {};
+
+                dir.virtualAddress = reloc.offset;
+                dir.symbolIndex = find(symbolNames.begin(), symbolNames.end(), symbols.at(reloc.name).baseSymbol) - symbolNames.begin();
+                dir.type = reloc.type == RefRel ? IMAGE_REL_I386_REL32 : IMAGE_REL_I386_DIR32;
+
+                relocDirectives << dir;
+                sectionHeaders[i].numberOfRelocations++;
+            }
+
+        if (sectionHeaders[i].numberOfRelocations > 0) {
+            sectionHeaders[i].pointerToRelocations = ptr;
+            ptr += sectionHeaders[i].numberOfRelocations * sizeof(RelocationDirective);
+        }
+    }
+
+    fileHeader.pointerToSymbolTable = ptr;
+    fileHeader.numberOfSymbols = symbolTable.size();
+
+    image.push(fileHeader);
+
+    image.push(reinterpret_cast<byte *>(sectionHeaders.data()), sectionHeaders.size() * sizeof(SectionHeader));
+
+    for (auto &section : sections) {
+        // Relocations are emitted against section symbols, so the in-place
+        // addend has to carry the symbol's offset within its section.
+        byte *data = image.allocate(section.second.size());
+        memcpy(data, section.second.data(), section.second.size());
+
+        for (auto &reloc : relocs)
+            if (reloc.section == section.first && symbols.at(reloc.name).baseSymbol[0] == '.')
+                *reinterpret_cast<int *>(data + reloc.offset) += symbols.at(reloc.name).offset;
+    }
+
+    image.push(frames);
+
+    image.push(reinterpret_cast<byte *>(relocDirectives.data()), relocDirectives.size() * sizeof(RelocationDirective));
+    image.push(reinterpret_cast<byte *>(symbolTable.data()), symbolTable.size() * sizeof(SymbolTableEntry));
+
+    if (stringTable.size() > 0) {
+        image.push(static_cast<uint32_t>(sizeof(uint32_t) + stringTable.size()));
+        image.push(stringTable);
+    }
+
+    return image;
+}
+
+Compiler Compiler::readOBJ(const ByteArray &image) {
+    auto check = [&](uint offset, uint size) {
+        if (offset + size < offset || offset + size > image.size())
+            throw std::runtime_error("object file is truncated");
+    };
+
+    check(0, sizeof(FileHeader));
+    const FileHeader &fileHeader = *reinterpret_cast<const FileHeader *>(image.data());
+
+    if (fileHeader.machine != IMAGE_FILE_MACHINE_I386 || fileHeader.sizeOfOptionalHeader != 0)
+        throw std::runtime_error("not an i386 object file");
+
+    check(sizeof(FileHeader), fileHeader.numberOfSections * sizeof(SectionHeader));
+    check(fileHeader.pointerToSymbolTable, fileHeader.numberOfSymbols * sizeof(SymbolTableEntry));
+
+    const SectionHeader *sectionHeaders = reinterpret_cast<const SectionHeader *>(image.data() + sizeof(FileHeader));
+    const SymbolTableEntry *symbolTable = reinterpret_cast<const SymbolTableEntry *>(image.data() + fileHeader.pointerToSymbolTable);
+
+    uint stringTableOffset = fileHeader.pointerToSymbolTable + fileHeader.numberOfSymbols * sizeof(SymbolTableEntry);
+    uint stringTableSize = 0;
+
+    if (stringTableOffset + sizeof(uint32_t) <= image.size()) {
+        stringTableSize = *reinterpret_cast<const uint32_t *>(image.data() + stringTableOffset);
+        check(stringTableOffset, stringTableSize);
+    }
+
+    auto longName = [&](uint offset) {
+        if (offset < sizeof(uint32_t) || offset >= stringTableSize)
+            throw std::runtime_error("invalid string table offset " + toString(offset, 10, 0));
+
+        const char *name = reinterpret_cast<const char *>(image.data() + stringTableOffset + offset);
+        return std::string(name, strnlen(name, stringTableSize - offset));
+    };
+
+    Compiler module;
+    std::vector<SectionID> ids;
+    int frameSection = -1;
+
+    for (uint i = 0; i < fileHeader.numberOfSections; i++) {
+        const SectionHeader &header = sectionHeaders[i];
+        std::string name(header.name, strnlen(header.name, sizeof(header.name)));
+
+        if (name[0] == '/')
+            name = longName(atoi(name.data() + 1));
+
+        // Frame information is read once the symbols are known.
+        if (name == ".eh_frame") {
+            if (frameSection >= 0)
+                throw std::runtime_error("section '" + name + "' is defined more than once");
+
+            frameSection = i;
+            ids << static_cast<SectionID>(0);
+            continue;
+        }
+
+        SectionID id = sectionID(name);
+
+        if (id < TEXT || id > COLD)
+            throw std::runtime_error("unsupported section '" + name + "'");
+
+        if (find(ids.begin(), ids.end(), id) != ids.end())
+            throw std::runtime_error("section '" + name + "' is defined more than once");
+
+        byte *data = module.section(id).allocate(header.sizeOfRawData);
+
+        if (header.pointerToRawData) {
+            check(header.pointerToRawData, header.sizeOfRawData);
+            memcpy(data, image.data() + header.pointerToRawData, header.sizeOfRawData);
+        } else
+            memset(data, 0, header.sizeOfRawData);
+
+        ids << id;
+    }
+
+    // Module symbol names by symbol table index; relocations against
+    // anything else (absolute or debug symbols, aux records) are rejected.
+    std::vector<std::string> names(fileHeader.numberOfSymbols);
+
+    for (uint i = 0; i < fileHeader.numberOfSymbols; i += 1 + symbolTable[i].numberOfAuxSymbols) {
+        const SymbolTableEntry &entry = symbolTable[i];
+        std::string name = entry.e.e.zeroes ? std::string(entry.e.name, strnlen(entry.e.name, sizeof(entry.e.name))) : longName(entry.e.e.offset);
+        std::string undecorated = name[0] == '_' ? name.substr(1) : name;
+
+        if (entry.sectionNumber > static_cast<int>(ids.size()))
+            throw std::runtime_error("symbol '" + name + "' refers to a missing section");
+
+        if (entry.sectionNumber > 0 && !ids[entry.sectionNumber - 1])
+            continue;
+
+        if (entry.sectionNumber > 0 && entry.storageClass == IMAGE_SYM_CLASS_STATIC && entry.value == 0 && name == sectionName(ids[entry.sectionNumber - 1])) {
+            names[i] = name;
+            module.pushSymbol(name, name, 0);
+        } else if (entry.sectionNumber > 0 && entry.storageClass == IMAGE_SYM_CLASS_EXTERNAL) {
+            SectionID id = ids[entry.sectionNumber - 1];
+
+            names[i] = undecorated;
+            module.pushSymbol(undecorated, sectionName(id), entry.value);
+
+            if (id == TEXT)
+                module.funcs << undecorated;
+        } else if (entry.sectionNumber == IMAGE_SYM_UNDEFINED && entry.storageClass == IMAGE_SYM_CLASS_EXTERNAL) {
+            names[i] = undecorated;
+            module.pushSymbol(undecorated, name, 0);
+
+            if (entry.type >> SCT_COMPLEX_TYPE_SHIFT == IMAGE_SYM_DTYPE_FUNCTION)
+                module.externFuncs << undecorated;
+            else
+                module.externVars << undecorated;
+        }
+    }
+
+    for (uint i = 0; i < fileHeader.numberOfSections; i++) {
+        const SectionHeader &header = sectionHeaders[i];
+
+        if (!ids[i])
+            continue;
+
+        check(header.pointerToRelocations, header.numberOfRelocations * sizeof(RelocationDirective));
+        const RelocationDirective *dirs = reinterpret_cast<const RelocationDirective *>(image.data() + header.pointerToRelocations);
+
+        for (uint j = 0; j < header.numberOfRelocations; j++) {
+            const RelocationDirective &dir = dirs[j];
+
+            if (dir.symbolIndex >= names.size() || names[dir.symbolIndex].empty())
+                throw std::runtime_error("relocation against unsupported symbol " + toString(dir.symbolIndex, 10, 0));
+
+            if (dir.virtualAddress + sizeof(int) > header.sizeOfRawData)
+                throw std::runtime_error("relocation outside of its section");
+
+            SymRefType type;
+
+            if (dir.type == IMAGE_REL_I386_DIR32)
+                type = RefAbs;
+            else if (dir.type == IMAGE_REL_I386_REL32)
+                type = RefRel;
+            else
+                throw std::runtime_error("unsupported relocation type " + toString(dir.type, 16, 0));
+
+            module.pushReloc({ names[dir.symbolIndex], type, dir.virtualAddress, ids[i] });
+        }
+    }
+
+    if (frameSection >= 0) {
+        const SectionHeader &header = sectionHeaders[frameSection];
+
+        check(header.pointerToRawData, header.sizeOfRawData);
+        check(header.pointerToRelocations, header.numberOfRelocations * sizeof(RelocationDirective));
+        const RelocationDirective *dirs = reinterpret_cast<const RelocationDirective *>(image.data() + header.pointerToRelocations);
+
+        // Frame descriptions locate their code with absolute addresses
+        // against a code section symbol.
+        std::map<uint, SectionID> sites;
+
+        for (uint j = 0; j < header.numberOfRelocations; j++) {
+            const RelocationDirective &dir = dirs[j];
+            SectionID id = dir.symbolIndex < names.size() ? sectionID(names[dir.symbolIndex]) : static_cast<SectionID>(0);
+
+            if (dir.type != IMAGE_REL_I386_DIR32 || (id != TEXT && id != COLD))
+                throw std::runtime_error("unsupported .eh_frame relocation");
+
+            sites[dir.virtualAddress] = id;
+        }
+
+        module.readEHFrame(image.data() + header.pointerToRawData, header.sizeOfRawData, sites);
+    }
+
+    return module;
+}
+
+ByteArray Compiler::writeEXE() const {
+    ByteArray image;
+    return image;
+}
+
+ByteArray Compiler::writeDLL(const std::string & /*name*/) const {
+    ByteArray image;
+    return image;
+}
+
+const ByteArray &Compiler::getCode() const {
+    return section(TEXT);
+}
+
+Function Compiler::compileFunction() {
+    PhaseTimer timer(*this, FunctionCompilation);
+
+    uint firstSlot = 0;
+
+    if (!threadCounters.empty()) {
+        if (!ThreadCounters::supported())
+            throw std::runtime_error("per-thread counters are not supported on this platform");
+
+        firstSlot = ThreadCounters::allocate(threadCounters.size());
+        int offset = ThreadCounters::offset();
+
+        relocate("__threadSlots", offset);
+        relocate("__enterThread", reinterpret_cast<int>(&ThreadCounters::enterThread));
+
+        for (uint i = 0; i < threadCounters.size(); i++)
+            relocate("__tcount_" + threadCounters[i], offset + sizeof(uint) * (firstSlot + i));
+    }
+
+    std::vector<std::pair<uint, SectionID>> sites;
+    ByteArray frames = ehFrame(sites);
+    uint hotSize = sectionSize(TEXT);
+
+    mergeCold();
+
+    Function f(std::move(section(TEXT)));
+
+    if (isSectionDefined(DATA))
+        f.data = section(DATA);
+
+    if (isSectionDefined(RDATA))
+        f.rdata = section(RDATA);
+
+    memset(f.bss.allocate(sectionSize(BSS)), 0, sectionSize(BSS));
+
+    for (auto &reloc : relocs)
+        bind(f, reloc);
+
+    for (const std::string &func : funcs)
+        f.symbols[func] = symbols.at(func).offset;
+
+    for (const std::string &counter : counters)
+        f.counters[counter] = symbols.at("__count_" + counter).offset;
+
+    for (uint i = 0; i < threadCounters.size(); i++)
+        f.threadCounters[threadCounters[i]] = firstSlot + i;
+
+    f.firstSlot = firstSlot;
+    f.slotCount = threadCounters.size();
+
+    f.patchSites = std::move(patchSites);
+
+    for (auto &site : sites) {
+        *reinterpret_cast<int *>(frames.data() + site.first) += reinterpret_cast<int>(f.code.data() + (site.second == COLD ? hotSize : 0));
+        f.frameSites.push_back(site.first);
+    }
+
+    f.registerFrames(std::move(frames));
+    return f;
+}
+
+Stencil Compiler::compileStencil() {
+    if (sectionSize(DATA) || sectionSize(RDATA) || sectionSize(BSS))
+        throw std::runtime_error("stencils cannot define data");
+
+    mergeCold();
+
+    Stencil stencil;
+    stencil.code = std::move(section(TEXT));
+
+    for (auto &reloc : relocs) {
+        const Symbol &symbol = symbols.at(reloc.name);
+        int *site = reinterpret_cast<int *>(stencil.code.data() + reloc.offset);
+
+        if (symbol.baseSymbol == ".text") {
+            if (reloc.type == RefAbs)
+                throw std::runtime_error("absolute reference to '" + reloc.name + "' in stencil");
+
+            *site += symbol.offset - (reloc.offset + 4);
+            continue;
+        }
+
+        auto i = find(stencil.args.begin(), stencil.args.end(), reloc.name);
+
+        if (i == stencil.args.end())
+            i = stencil.args.insert(i, reloc.name);
+
+        stencil.holes.push_back({ reloc.offset, reloc.type == RefRel, static_cast<uint>(i - stencil.args.begin()) });
+    }
+
+    return stencil;
+}
+
+void Compiler::instr(byte op) {
+    PhaseTimer timer(*this, Emission);
+
+    opcode(op);
+}
+
+void Compiler::instr(byte op, byte imm) {
+    PhaseTimer timer(*this, Emission);
+
+    opcode(op);
+    gen(imm);
+}
+
+void Compiler::instr(byte op, int imm) {
+    PhaseTimer timer(*this, Emission);
+
+    opcode(op);
+    gen(imm);
+}
+
+void Compiler::instr(byte op, const SymRef &ref) {
+    PhaseTimer timer(*this, Emission);
+
+    if (!isSymbolDefined(ref.name))
+        pushSymbol(ref.name, "", 0);
+
+    instr(op, ref.offset);
+
+    pushReloc({ ref.name, ref.type, sectionSize(text) - 4, text });
+}
+
+void Compiler::instr(byte op, byte reg, Register rm) {
+    PhaseTimer timer(*this, Emission);
+
+    instr(op, reg, { Reg, rm, 0, 0, 0, 0 });
+}
+
+void Compiler::instr(byte op, byte reg, Register rm, byte imm) {
+    PhaseTimer timer(*this, Emission);
+
+    instr(op, reg, rm);
+    gen(imm);
+}
+
+void Compiler::instr(byte op, byte reg, Register rm, int imm) {
+    PhaseTimer timer(*this, Emission);
+
+    instr(op, reg, rm);
+    gen(imm);
+}
+
+void Compiler::instr(byte op, byte reg, Register rm, const SymRef &ref) {
+    PhaseTimer timer(*this, Emission);
+
+    if (!isSymbolDefined(ref.name))
+        pushSymbol(ref.name, "", 0);
+
+    instr(op, reg, rm, ref.offset);
+
+    pushReloc({ ref.name, ref.type, sectionSize(text) - 4, text });
+}
+
+void Compiler::instr(byte op, byte reg, const MemRef &rm) {
+    PhaseTimer timer(*this, Emission);
+
+    opcode(op, reg);
+
+    gen(composeByte(rm.mod, reg, rm.rm));
+
+    if (rm.scale != 0)
+        gen(composeByte(log2(rm.scale), rm.index, rm.base));
+
+    if (rm.mod == Disp8)
+        gen(static_cast<byte>(rm.ref.offset));
+    else if (rm.mod == Disp32 || (rm.mod == Disp0 && (rm.rm == 5 || (rm.rm == 4 && rm.base == 5)))) {
+        gen(rm.ref.offset);
+
+        if (!rm.ref.name.empty()) {
+            if (!isSymbolDefined(rm.ref.name))
+                pushSymbol(rm.ref.name, "", 0);
+
+            pushReloc({ rm.ref.name, rm.ref.type, sectionSize(text) - 4, text });
+        }
+    }
+}
+
+void Compiler::instr(byte op, byte reg, const MemRef &rm, byte imm) {
+    PhaseTimer timer(*this, Emission);
+
+    instr(op, reg, rm);
+    gen(imm);
+}
+
+void Compiler::instr(byte op, byte reg, const MemRef &rm, int imm) {
+    PhaseTimer timer(*this, Emission);
+
+    instr(op, reg, rm);
+    gen(imm);
+}
+
+void Compiler::instr(byte op, byte reg, const MemRef &rm, const SymRef &ref) {
+    PhaseTimer timer(*this, Emission);
+
+    if (!isSymbolDefined(ref.name))
+        pushSymbol(ref.name, "", 0);
+
+    instr(op, reg, rm, ref.offset);
+
+    pushReloc({ ref.name, ref.type, sectionSize(text) - 4, text });
+}
+
+void Compiler::alu(byte ext, int imm, Register dst) {
+    if (isByte(imm))
+        instr(0x83, ext, dst, static_cast<byte>(imm));
+    else if (dst == EAX)
+        instr(ext << 3 | 0x05, imm);
+    else
+        instr(0x81, ext, dst, imm);
+
+    // add and sub adjust the frame themselves; cmp writes nothing.
+    if (dst == ESP && ext != 0 && ext != 5 && ext != 7)
+        clobberFrame();
+}
+
+void Compiler::alu(byte ext, const SymRef &ref, Register dst) {
+    if (dst == EAX)
+        instr(ext << 3 | 0x05, ref);
+    else
+        instr(0x81, ext, dst, ref);
+
+    if (dst == ESP && ext != 7)
+        clobberFrame();
+}
+
+void Compiler::alu(byte ext, int imm, const MemRef &dst) {
+    if (isByte(imm))
+        instr(0x83, ext, dst, static_cast<byte>(imm));
+    else
+        instr(0x81, ext, dst, imm);
+}
+
+void Compiler::alu(byte ext, const SymRef &ref, const MemRef &dst) {
+    instr(0x81, ext, dst, ref);
+}
+
+void Compiler::alu(byte ext, Register src, Register dst) {
+    instr(ext << 3 | 0x01, src, dst);
+
+    if (dst == ESP && ext != 7)
+        clobberFrame();
+}
+
+void Compiler::alu(byte ext, Register src, const MemRef &dst) {
+    instr(ext << 3 | 0x01, src, dst);
+}
+
+void Compiler::alu(byte ext, const MemRef &src, Register dst) {
+    instr(ext << 3 | 0x03, dst, src);
+
+    if (dst == ESP && ext != 7)
+        clobberFrame();
+}
+
+void Compiler::alub(byte ext, byte imm, ByteRegister dst) {
+    if (dst == AL)
+        instr(ext << 3 | 0x04, imm);
+    else
+        instr(0x80, ext, static_cast<Register>(dst), imm);
+}
+
+void Compiler::alub(byte ext, byte imm, const MemRef &dst) {
+    instr(0x80, ext, dst, imm);
+}
+
+void Compiler::alub(byte ext, ByteRegister src, ByteRegister dst) {
+    instr(ext << 3, src, static_cast<Register>(dst));
+}
+
+void Compiler::alub(byte ext, ByteRegister src, const MemRef &dst) {
+    instr(ext << 3, src, dst);
+}
+
+void Compiler::alub(byte ext, const MemRef &src, ByteRegister dst) {
+    instr(ext << 3 | 0x02, dst, src);
+}
+
+void Compiler::shift(byte ext, byte imm, Register dst) {
+    if (imm == 1)
+        instr(0xd1, ext, dst);
+    else
+        instr(0xc1, ext, dst, imm);
+}
+
+void Compiler::shift(byte ext, byte imm, const MemRef &dst) {
+    if (imm == 1)
+        instr(0xd1, ext, dst);
+    else
+        instr(0xc1, ext, dst, imm);
+}
+
+void Compiler::shift(byte ext, ByteRegister count, Register dst) {
+    if (count != CL)
+        throw std::runtime_error("shift count must be in %cl");
+
+    instr(0xd3, ext, dst);
+}
+
+void Compiler::shift(byte ext, ByteRegister count, const MemRef &dst) {
+    if (count != CL)
+        throw std::runtime_error("shift count must be in %cl");
+
+    instr(0xd3, ext, dst);
+}
+
+std::string Compiler::sectionName(SectionID id) {
+    static const char *names[] = { "", ".text", ".data", ".bss", ".rdata", ".text.cold", ".edata", ".idata", ".reloc" };
+    return names[id];
+}
+
+Compiler::SectionID Compiler::sectionID(const std::string &name) {
+    for (int id = TEXT; id <= RELOC; id++)
+        if (sectionName(static_cast<SectionID>(id)) == name)
+            return static_cast<SectionID>(id);
+
+    return static_cast<SectionID>(0);
+}
+
+ByteArray &Compiler::section(Function &f, SectionID id) {
+    switch (id) {
+    case DATA:
+        return f.data;
+    case RDATA:
+        return f.rdata;
+    case BSS:
+        return f.bss;
+    default:
+        return f.code;
+    }
+}
+
+Function::Section Compiler::functionSection(SectionID id) {
+    switch (id) {
+    case DATA:
+        return Function::Data;
+    case RDATA:
+        return Function::RData;
+    case BSS:
+        return Function::BSS;
+    default:
+        return Function::Code;
+    }
+}
+
+bool Compiler::isSectionDefined(SectionID id) const {
+    return sections.find(id) != sections.end();
+}
+
+uint Compiler::sectionSize(SectionID id) const {
+    auto i = sections.find(id);
+    return i != sections.end() ? i->second.size() : 0;
+}
+
+ByteArray &Compiler::section(SectionID id) {
+    return sections[id];
+}
+
+const ByteArray &Compiler::section(SectionID id) const {
+    return sections.at(id);
+}
+
+bool Compiler::isSymbolDefined(const std::string &name) const {
+    return symbols.find(name) != symbols.end();
+}
+
+void Compiler::pushSymbol(const std::string &name, const std::string &baseSymbol, uint offset) {
+    auto result = symbols.insert({ name, Symbol{ baseSymbol, offset } });
+
+    if (result.second)
+        return;
+
+    if (!result.first->second.baseSymbol.empty())
+        throw std::runtime_error("symbol '" + name + "' is already defined");
+
+    result.first->second = Symbol{ baseSymbol, offset };
+}
+
+void Compiler::pushReloc(const Reloc &reloc) {
+    relocs << reloc;
+}
+
+void Compiler::opcode(byte op, byte reg) {
+    if (statsEnabled)
+        opcodes[opcodeName(op, reg)]++;
+
+    prefixes.clear();
+    gen(op);
+}
+
+void Compiler::prefix(byte value) {
+    if (statsEnabled)
+        prefixes << value;
+
+    gen(value);
+}
+
+std::string Compiler::opcodeName(byte op, byte reg) const {
+    // Lock and segment overrides do not change the instruction; VEX
+    // register fields (R, X, B, vvvv) do not either.
+    static const std::set<byte> ignored = { 0xf0, 0x26, 0x2e, 0x36, 0x3e, 0x64, 0x65 };
+    static const std::set<byte> groups = { 0x80, 0x81, 0x83, 0x8f, 0xc0, 0xc1, 0xc6, 0xc7, 0xd0, 0xd1, 0xd2, 0xd3, 0xf6, 0xf7, 0xfe, 0xff };
+    static const std::set<byte> escapedGroups = { 0x00, 0x01, 0x18, 0x71, 0x72, 0x73, 0xae, 0xba, 0xc7 };
+
+    std::vector<byte> bytes;
+    bool escaped = false;
+
+    for (uint i = 0; i < prefixes.size(); i++) {
+        byte value = prefixes[i];
+
+        if (ignored.count(value))
+            continue;
+
+        bytes << value;
+
+        if (value == 0xc5 && i + 1 < prefixes.size()) {
+            bytes << static_cast<byte>(prefixes[++i] & 0x07);
+            escaped = true;
+        } else if (value == 0xc4 && i + 2 < prefixes.size()) {
+            bytes << static_cast<byte>(prefixes[++i] & 0x1f);
+            bytes << static_cast<byte>(prefixes[++i] & 0x87);
+            escaped = true;
+        } else if (value == 0x0f)
+            escaped = true;
+    }
+
+    bytes << op;
+
+    std::string name;
+
+    for (byte value : bytes)
+        name += (name.empty() ? "" : " ") + std::string(value < 0x10 ? "0" : "") + toString(static_cast<int>(value), 0x10, 0);
+
+    if (reg < 8 && (escaped ? escapedGroups : groups).count(op))
+        name += " /" + toString(static_cast<int>(reg), 10, 0);
+
+    return name;
+}
+
+CPUFeatures Compiler::detectFeatures() {
+    CPUFeatures f;
+    uint eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return f;
+
+    f.sse2 = edx & bit_SSE2;
+    f.sse3 = ecx & bit_SSE3;
+    f.ssse3 = ecx & bit_SSSE3;
+    f.sse41 = ecx & bit_SSE4_1;
+    f.sse42 = ecx & bit_SSE4_2;
+    f.popcnt = ecx & bit_POPCNT;
+
+    uint xcr0 = 0;
+
+    if (ecx & bit_OSXSAVE)
+        asm("xgetbv"
+            : "=a"(xcr0)
+            : "c"(0)
+            : "edx");
+
+    bool ymmState = (xcr0 & 0x06) == 0x06;
+    bool zmmState = (xcr0 & 0xe6) == 0xe6;
+
+    f.avx = (ecx & bit_AVX) && ymmState;
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        f.bmi1 = ebx & bit_BMI;
+        f.bmi2 = ebx & bit_BMI2;
+        f.avx2 = (ebx & bit_AVX2) && ymmState;
+        f.avx512f = (ebx & bit_AVX512F) && zmmState;
+        f.erms = ebx & (1 << 9);
+        f.clflushopt = ebx & bit_CLFLUSHOPT;
+    }
+
+    if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx))
+        f.lzcnt = ecx & bit_LZCNT;
+
+    return f;
+}
+
+void Compiler::count(const std::string &name) {
+    if (instrumentation == PerThreadCounters) {
+        threadCounters << name;
+
+        prefix(0x65);
+        add(1, ref(abs("__tcount_" + name)));
+        return;
+    }
+
+    bss("__count_" + name, sizeof(uint));
+    counters << name;
+
+    if (instrumentation == LockedCounters)
+        lock();
+
+    add(1, ref(abs("__count_" + name)));
+}
+
+void Compiler::reference(SectionID id, const SymRef &ref) {
+    if (!isSymbolDefined(ref.name))
+        pushSymbol(ref.name, "", 0);
+
+    section(id).push(ref.offset);
+
+    pushReloc({ ref.name, ref.type, sectionSize(id) - 4, id });
+}
+
+void Compiler::switchTree(Register reg, const std::pair<int, std::string> *cases, uint count, const std::string &defaultLabel) {
+    if (count == 0) {
+        jmp(rel(defaultLabel));
+        return;
+    }
+
+    if (count >= 4 && static_cast<long long>(cases[count - 1].first) - cases[0].first < 3LL * count) {
+        switchTable(reg, cases, count, defaultLabel);
+        return;
+    }
+
+    if (count <= 3) {
+        for (uint i = 0; i < count; i++) {
+            cmp(cases[i].first, reg);
+            j(E, rel(cases[i].second));
+        }
+
+        jmp(rel(defaultLabel));
+        return;
+    }
+
+    uint mid = count / 2;
+    std::string lower = "__switch" + toString(switches++, 10, 0);
+
+    cmp(cases[mid].first, reg);
+    j(E, rel(cases[mid].second));
+    j(L, rel(lower));
+
+    switchTree(reg, cases + mid + 1, count - mid - 1, defaultLabel);
+
+    pushSymbol(lower, sectionName(text), sectionSize(text));
+    switchTree(reg, cases, mid, defaultLabel);
+}
+
+void Compiler::switchTable(Register reg, const std::pair<int, std::string> *cases, uint count, const std::string &defaultLabel) {
+    int min = cases[0].first, max = cases[count - 1].first;
+    std::string table = "__switch" + toString(switches++, 10, 0);
+
+    if (min == 0) {
+        cmp(max, reg);
+        j(A, rel(defaultLabel));
+    } else {
+        cmp(min, reg);
+        j(L, rel(defaultLabel));
+        cmp(max, reg);
+        j(G, rel(defaultLabel));
+    }
+
+    pushSymbol(table, ".rdata", sectionSize(RDATA));
+
+    jmp(ref(abs(table) + -4 * min, reg, 4));
+
+    for (int value = min, i = 0; value <= max; value++)
+        reference(RDATA, abs(value == cases[i].first ? cases[i++].second : defaultLabel));
+}
+
+std::string Compiler::blockLabel() {
+    return "__block" + toString(blocks++, 10, 0);
+}
+
+uint Compiler::blockChunk(uint size) const {
+    uint chunk = 1;
+
+    while (chunk * 2 <= std::min(size, vectorWidth) && (chunk != 4 || vectorWidth >= 16))
+        chunk *= 2;
+
+    return chunk;
+}
+
+void Compiler::loadChunk(uint size, const MemRef &src, uint slot) {
+    Register reg = slot ? EDX : EAX;
+
+    switch (size) {
+    case 32:
+        vmovdqu(src, static_cast<YMMRegister>(slot));
+        break;
+    case 16:
+        movdqu(src, static_cast<XMMRegister>(slot));
+        break;
+    case 8:
+        movq(src, static_cast<XMMRegister>(slot));
+        break;
+    case 4:
+        mov(src, reg);
+        break;
+    case 2:
+        movzwl(src, reg);
+        break;
+    default:
+        movzbl(src, reg);
+        break;
+    }
+}
+
+void Compiler::storeChunk(uint size, uint slot, const MemRef &dst) {
+    Register reg = slot ? EDX : EAX;
+
+    switch (size) {
+    case 32:
+        vmovdqu(static_cast<YMMRegister>(slot), dst);
+        break;
+    case 16:
+        movdqu(static_cast<XMMRegister>(slot), dst);
+        break;
+    case 8:
+        movq(static_cast<XMMRegister>(slot), dst);
+        break;
+    case 4:
+        mov(reg, dst);
+        break;
+    case 2:
+        movw(reg, dst);
+        break;
+    default:
+        movb(static_cast<ByteRegister>(reg), dst);
+        break;
+    }
+}
+
+// Broadcasts value into %eax and, for chunks of 8 bytes and up, into %xmm0
+// (and %ymm0) for storeChunk to write out.
+void Compiler::fillRegisters(byte value, uint size) {
+    if (value == 0)
+        _xor(EAX, EAX);
+    else
+        mov(static_cast<int>(value * 0x01010101u), EAX);
+
+    if (size >= 8) {
+        if (value == 0)
+            pxor(XMM0, XMM0);
+        else {
+            movd(EAX, XMM0);
+            pshufd(0, XMM0, XMM0);
+        }
+    }
+
+    if (size == 32)
+        vinsertf128(1, XMM0, YMM0, YMM0);
+}
+
+// Copies or fills %ecx < 8 * vectorWidth bytes. Sizes of at least one
+// vector go through a loop, with the last vector stored first; smaller
+// sizes store two chunks that overlap as needed to cover the block.
+void Compiler::blockSizeClasses(bool fill, const std::string &done) {
+    std::string next = blockLabel(), loop = blockLabel();
+    uint width = vectorWidth;
+
+    cmp(width, ECX);
+    j(B, rel(next));
+
+    if (!fill)
+        loadChunk(width, ref(-width, ESI, ECX, 1), 1);
+    storeChunk(width, fill ? 0 : 1, ref(-width, EDI, ECX, 1));
+
+    pushSymbol(loop, sectionName(text), sectionSize(text));
+
+    if (!fill) {
+        loadChunk(width, ref(ESI), 0);
+        add(width, ESI);
+    }
+
+    storeChunk(width, 0, ref(EDI));
+    add(width, EDI);
+    sub(width, ECX);
+    cmp(width, ECX);
+    j(A, rel(loop));
+    jmp(rel(done));
+
+    for (uint chunk = width / 2; chunk >= 2; chunk /= 2) {
+        if (chunk == 8 && width < 16)
+            continue;
+
+        pushSymbol(next, sectionName(text), sectionSize(text));
+        next = blockLabel();
+
+        cmp(chunk, ECX);
+        j(B, rel(next));
+
+        for (uint slot = 0; slot < 2; slot++) {
+            MemRef src = slot ? ref(-chunk, ESI, ECX, 1) : ref(ESI);
+            MemRef dst = slot ? ref(-chunk, EDI, ECX, 1) : ref(EDI);
+
+            if (!fill)
+                loadChunk(chunk, src, slot);
+            storeChunk(chunk, fill ? 0 : slot, dst);
+        }
+
+        jmp(rel(done));
+    }
+
+    pushSymbol(next, sectionName(text), sectionSize(text));
+    test(ECX, ECX);
+    j(E, rel(done));
+
+    if (!fill)
+        loadChunk(1, ref(ESI), 0);
+    storeChunk(1, 0, ref(EDI));
+
+    jmp(rel(done));
+}
+
+// Compares 16 bytes at %esi and %edi, jumping to found with the mismatch
+// mask in %eax.
+void Compiler::compareChunk(const std::string &found) {
+    movdqu(ref(ESI), XMM0);
+    movdqu(ref(EDI), XMM1);
+    pcmpeqb(XMM1, XMM0);
+    pmovmskb(XMM0, EAX);
+    _xor(0xffff, EAX);
+    j(NE, rel(found));
+}
+
+void Compiler::bind(Function &f, const Reloc &reloc) {
+    const Symbol &symbol = symbols.at(reloc.name);
+    SectionID id = sectionID(symbol.baseSymbol);
+
+    // Kept so that Function::reallocate can move the code; references
+    // resolved by relocate() point outside the function.
+    if (!id) {
+        if (resolved.find(reloc.name) != resolved.end())
+            f.relocations.push_back({ functionSection(reloc.section), reloc.offset, Function::External, reloc.type == RefRel });
+
+        return;
+    }
+
+    byte *target = section(f, id).data() + symbol.offset;
+    byte *site = section(f, reloc.section).data() + reloc.offset;
+
+    if (reloc.type == RefAbs)
+        *reinterpret_cast<int *>(site) += reinterpret_cast<int>(target);
+    else
+        *reinterpret_cast<int *>(site) += target - (site + 4);
+
+    f.relocations.push_back({ functionSection(reloc.section), reloc.offset, functionSection(id), reloc.type == RefRel });
+}
+
+void Compiler::mergeCold() {
+    if (!sectionSize(COLD))
+        return;
+
+    std::vector<byte *> sites;
+
+    for (auto &reloc : relocs)
+        sites << section(reloc.section).data() + reloc.offset;
+
+    uint hotSize = sectionSize(TEXT);
+
+    section(TEXT).push(section(COLD));
+    sections.erase(COLD);
+
+    for (auto &symbol : symbols)
+        if (symbol.second.baseSymbol == sectionName(COLD)) {
+            symbol.second.baseSymbol = sectionName(TEXT);
+            symbol.second.offset += hotSize;
+        }
+
+    for (uint i = 0; i < relocs.size(); i++) {
+        Reloc &reloc = relocs[i];
+
+        if (reloc.section == COLD) {
+            reloc.section = TEXT;
+            reloc.offset += hotSize;
+        }
+
+        // Relative references already resolved by relocate() depend on the
+        // address of their site, which may have moved.
+        byte *site = section(reloc.section).data() + reloc.offset;
+
+        if (reloc.type == RefRel && resolved.find(reloc.name) != resolved.end())
+            *reinterpret_cast<int *>(site) += sites[i] - site;
+    }
+
+    text = TEXT;
+}
+
+Compiler::FrameState Compiler::entryFrame() {
+    return { ESP, 4, 4, {}, true };
+}
+
+Compiler::UnwindTable *Compiler::unwindTable() {
+    int index = text == TEXT ? hotTable : text == COLD ? coldTable : -1;
+    return index >= 0 ? &unwindTables[index] : nullptr;
+}
+
+void Compiler::setFrame(const FrameState &state) {
+    frame = state;
+    frameEnd = sectionSize(text);
+
+    UnwindTable *table = unwindTable();
+
+    if (!table)
+        return;
+
+    uint offset = sectionSize(text) - (text == COLD ? coldStart : hotStart);
+
+    if (!table->rows.empty() && table->rows.back().offset == offset)
+        table->rows.back().state = state;
+    else
+        table->rows.push_back({ offset, state });
+}
+
+// An epilogue is a run of frame releasing instructions; the state before
+// its first one is what the code after the closing ret starts from.
+void Compiler::releaseFrame(uint start) {
+    if (!inEpilogue || start != frameEnd)
+        epilogueFrame = frame;
+
+    inEpilogue = true;
+}
+
+void Compiler::adjustFrame(uint start, int size) {
+    if (size < 0)
+        releaseFrame(start);
+    else
+        inEpilogue = false;
+
+    FrameState state = frame;
+    state.depth += size;
+
+    if (state.cfa == ESP)
+        state.offset = state.depth;
+
+    setFrame(state);
+}
+
+void Compiler::pushFrame(Register reg) {
+    inEpilogue = false;
+
+    FrameState state = frame;
+    state.depth += 4;
+
+    if (state.cfa == ESP)
+        state.offset = state.depth;
+
+    // Only the first save of a callee-saved register describes where the
+    // caller's value is; later pushes are spills of the current value.
+    if ((reg == EBX || reg == EBP || reg == ESI || reg == EDI) && !state.saved.count(reg)) {
+        if (!state.tracked)
+            throw std::runtime_error("cannot describe saving a register after an untracked write to %esp");
+
+        state.saved[reg] = -state.depth;
+    }
+
+    setFrame(state);
+}
+
+void Compiler::popFrame(uint start, Register reg) {
+    releaseFrame(start);
+
+    if (reg == ESP) {
+        clobberFrame();
+        return;
+    }
+
+    FrameState state = frame;
+
+    if (state.tracked && state.saved.count(reg) && state.saved.at(reg) == -state.depth)
+        state.saved.erase(reg);
+
+    state.depth -= 4;
+
+    // Popping the frame pointer leaves only %esp to find the frame by.
+    if (state.cfa == reg) {
+        if (!state.tracked)
+            throw std::runtime_error("cannot describe popping the frame pointer after an untracked write to %esp");
+
+        state.cfa = ESP;
+    }
+
+    if (state.cfa == ESP)
+        state.offset = state.depth;
+
+    setFrame(state);
+}
+
+void Compiler::moveFrame(uint start, Register src, Register dst) {
+    FrameState state = frame;
+
+    if (src == ESP && dst == EBP) {
+        if (!state.tracked && unwindTable())
+            throw std::runtime_error("cannot describe setting up a frame pointer after an untracked write to %esp");
+
+        inEpilogue = false;
+        state.cfa = EBP;
+        state.offset = state.depth;
+    } else if (src == EBP && dst == ESP && state.cfa == EBP) {
+        releaseFrame(start);
+        state.cfa = ESP;
+        state.depth = state.offset;
+        state.tracked = true;
+    } else {
+        if (dst == ESP)
+            clobberFrame();
+
+        return;
+    }
+
+    setFrame(state);
+}
+
+// lea disp(%esp), %esp moves %esp like add; lea disp(%ebp), %esp, as in
+// epilogues restoring callee-saved registers, sets it from the frame
+// pointer.
+void Compiler::loadFrame(uint start, const MemRef &src) {
+    bool sib = src.rm == 4;
+    byte base = sib ? src.base : src.rm;
+
+    if (src.mod == Reg || !src.ref.name.empty() || (sib && src.index != 4) || (src.mod == Disp0 && base == EBP)) {
+        clobberFrame();
+        return;
+    }
+
+    int disp = src.mod == Disp0 ? 0 : src.ref.offset;
+
+    if (base == ESP && frame.tracked) {
+        adjustFrame(start, -disp);
+        return;
+    }
+
+    if (base != EBP || frame.cfa != EBP) {
+        clobberFrame();
+        return;
+    }
+
+    FrameState state = frame;
+    state.depth = state.offset - disp;
+    state.tracked = true;
+
+    if (!frame.tracked || state.depth < frame.depth)
+        releaseFrame(start);
+    else
+        inEpilogue = false;
+
+    setFrame(state);
+}
+
+// A write to %esp the rows cannot follow. While the CFA is addressed
+// through %ebp the rows stay right, only the depth is lost; otherwise
+// there is no right row to emit.
+void Compiler::clobberFrame() {
+    if (!unwindTable())
+        return;
+
+    if (frame.cfa != EBP)
+        throw std::runtime_error("cannot describe a write to %esp without a frame pointer");
+
+    FrameState state = frame;
+    state.tracked = false;
+
+    setFrame(state);
+}
+
+void Compiler::leaveFrame(uint start) {
+    releaseFrame(start);
+
+    FrameState state = frame;
+
+    if (state.cfa == EBP) {
+        state.cfa = ESP;
+        state.depth = state.offset;
+        state.tracked = true;
+    }
+
+    if (state.saved.count(EBP) && state.saved.at(EBP) == -state.depth)
+        state.saved.erase(EBP);
+
+    state.depth -= 4;
+    state.offset = state.depth;
+
+    setFrame(state);
+}
+
+void Compiler::returnFrame() {
+    if (!inEpilogue)
+        return;
+
+    inEpilogue = false;
+    setFrame(epilogueFrame);
+}
+
+ByteArray Compiler::ehFrame(std::vector<std::pair<uint, SectionID>> &sites) const {
+    ByteArray frames;
+
+    if (unwindTables.empty())
+        return frames;
+
+    auto uleb = [&](uint value) {
+        do {
+            byte b = value & 0x7f;
+            value >>= 7;
+            frames.push(static_cast<byte>(value ? b | 0x80 : b));
+        } while (value);
+    };
+
+    // Emits the instructions taking the unwinder from one state to another.
+    auto change = [&](const FrameState &from, const FrameState &to) {
+        if (from.cfa != to.cfa && from.offset != to.offset) {
+            frames.push(static_cast<byte>(DW_CFA_def_cfa));
+            uleb(to.cfa);
+            uleb(to.offset);
+        } else if (from.cfa != to.cfa) {
+            frames.push(static_cast<byte>(DW_CFA_def_cfa_register));
+            uleb(to.cfa);
+        } else if (from.offset != to.offset) {
+            frames.push(static_cast<byte>(DW_CFA_def_cfa_offset));
+            uleb(to.offset);
+        }
+
+        for (auto &saved : to.saved)
+            if (!from.saved.count(saved.first) || from.saved.at(saved.first) != saved.second) {
+                frames.push(static_cast<byte>(DW_CFA_offset | saved.first));
+                uleb(-saved.second / 4);
+            }
+
+        for (auto &saved : from.saved)
+            if (!to.saved.count(saved.first))
+                frames.push(static_cast<byte>(DW_CFA_restore | saved.first));
+    };
+
+    auto advance = [&](uint delta) {
+        if (delta < 0x40)
+            frames.push(static_cast<byte>(DW_CFA_advance_loc | delta));
+        else if (delta <= 0xff) {
+            frames.push(static_cast<byte>(DW_CFA_advance_loc1));
+            frames.push(static_cast<byte>(delta));
+        } else if (delta <= 0xffff) {
+            frames.push(static_cast<byte>(DW_CFA_advance_loc2));
+            frames.push(static_cast<uint16_t>(delta));
+        } else {
+            frames.push(static_cast<byte>(DW_CFA_advance_loc4));
+            frames.push(static_cast<uint32_t>(delta));
+        }
+    };
+
+    // Entries are padded with nops to a multiple of four bytes; the length
+    // field does not count itself.
+    auto close = [&](uint start) {
+        while (frames.size() % 4)
+            frames.push(static_cast<byte>(DW_CFA_nop));
+
+        *reinterpret_cast<uint32_t *>(frames.data() + start) = frames.size() - start - 4;
+    };
+
+    // CIE: pointer-sized absolute addresses, code alignment 1, data
+    // alignment -4, return address in column 8 (%eip) at CFA - 4.
+    frames.push(static_cast<uint32_t>(0));
+    frames.push(static_cast<uint32_t>(0));
+    frames.push(static_cast<byte>(1));
+    frames.push(reinterpret_cast<const byte *>("zR"), 3);
+    uleb(1);
+    frames.push(static_cast<byte>(0x7c));
+    frames.push(static_cast<byte>(8));
+    uleb(1);
+    frames.push(static_cast<byte>(0x00));
+    frames.push(static_cast<byte>(DW_CFA_def_cfa));
+    uleb(ESP);
+    uleb(4);
+    frames.push(static_cast<byte>(DW_CFA_offset | 8));
+    uleb(1);
+    close(0);
+
+    std::map<std::string, uint> ends;
+
+    for (const FunctionRange &range : functionRanges())
+        ends[range.name] = range.end;
+
+    for (const UnwindTable &table : unwindTables) {
+        const Symbol &begin = symbols.at(table.begin);
+        SectionID id = sectionID(begin.baseSymbol);
+        uint end;
+
+        if (ends.count(table.begin))
+            end = ends.at(table.begin);
+        else if (isSymbolDefined(table.end))
+            end = symbols.at(table.end).offset;
+        else
+            end = sectionSize(id);
+
+        if (end <= begin.offset)
+            continue;
+
+        uint start = frames.size();
+
+        frames.push(static_cast<uint32_t>(0));
+        frames.push(static_cast<uint32_t>(frames.size()));
+
+        sites.push_back({ frames.size(), id });
+        frames.push(static_cast<uint32_t>(begin.offset));
+        frames.push(static_cast<uint32_t>(end - begin.offset));
+        uleb(0);
+
+        FrameState state = entryFrame();
+        uint offset = 0;
+
+        change(state, table.initial);
+        state = table.initial;
+
+        for (const UnwindRow &row : table.rows) {
+            if (row.offset >= end - begin.offset)
+                break;
+
+            // Rows only tracking the stack depth change nothing the
+            // unwinder sees while the frame is addressed through %ebp.
+            if (row.state.cfa == state.cfa && row.state.offset == state.offset && row.state.saved == state.saved)
+                continue;
+
+            advance(row.offset - offset);
+            change(state, row.state);
+
+            offset = row.offset;
+            state = row.state;
+        }
+
+        close(start);
+    }
+
+    frames.push(static_cast<uint32_t>(0));
+
+    return frames;
+}
+
+// Turns frame descriptions in the layout ehFrame writes back into unwind
+// tables. Tables of whole functions are keyed by the function as when
+// generated; others get labels at both ends.
+void Compiler::readEHFrame(const byte *frames, uint size, const std::map<uint, SectionID> &sites) {
+    auto fail = [](const std::string &reason) {
+        throw std::runtime_error("unsupported .eh_frame: " + reason);
+    };
+
+    auto read32 = [&](uint offset) {
+        if (offset + 4 > size)
+            fail("truncated entry");
+
+        return *reinterpret_cast<const uint32_t *>(frames + offset);
+    };
+
+    auto uleb = [&](uint &offset, uint end) {
+        uint value = 0;
+
+        for (uint shift = 0;; shift += 7) {
+            if (offset >= end || shift > 28)
+                fail("truncated number");
+
+            byte b = frames[offset++];
+            value |= (b & 0x7f) << shift;
+
+            if (!(b & 0x80))
+                return value;
+        }
+    };
+
+    // Runs instructions from offset to end, calling row before each advance
+    // with the state reached so far.
+    auto run = [&](uint offset, uint end, FrameState &state, const std::function<void(uint)> &row) {
+        while (offset < end) {
+            byte op = frames[offset++];
+            uint delta = 0;
+
+            switch (op & 0xc0) {
+            case DW_CFA_advance_loc:
+                row(op & 0x3f);
+                continue;
+            case DW_CFA_offset: {
+                uint factor = uleb(offset, end);
+
+                // The return address column, which the CIE places at CFA - 4.
+                if ((op & 0x3f) != 8)
+                    state.saved[static_cast<Register>(op & 0x3f)] = -4 * static_cast<int>(factor);
+
+                continue;
+            }
+            case DW_CFA_restore:
+                state.saved.erase(static_cast<Register>(op & 0x3f));
+                continue;
+            }
+
+            switch (op) {
+            case DW_CFA_nop:
+                break;
+            case DW_CFA_advance_loc1:
+            case DW_CFA_advance_loc2:
+            case DW_CFA_advance_loc4: {
+                uint bytes = op == DW_CFA_advance_loc1 ? 1 : op == DW_CFA_advance_loc2 ? 2 : 4;
+
+                if (offset + bytes > end)
+                    fail("truncated advance");
+
+                memcpy(&delta, frames + offset, bytes);
+                offset += bytes;
+                row(delta);
+                break;
+            }
+            case DW_CFA_def_cfa:
+                state.cfa = static_cast<Register>(uleb(offset, end));
+                state.offset = uleb(offset, end);
+                break;
+            case DW_CFA_def_cfa_register:
+                state.cfa = static_cast<Register>(uleb(offset, end));
+                break;
+            case DW_CFA_def_cfa_offset:
+                state.offset = uleb(offset, end);
+                break;
+            default:
+                fail("instruction " + toString(op, 16, 0));
+            }
+
+            if (state.cfa > EDI)
+                fail("CFA register " + toString(state.cfa, 10, 0));
+
+            // Loaded code gets no more instructions, so the depth only has to
+            // be consistent where the CFA is %esp-based.
+            state.depth = state.offset;
+            state.tracked = state.cfa == ESP;
+        }
+    };
+
+    std::map<std::string, uint> ends;
+
+    for (const FunctionRange &range : functionRanges())
+        if (!range.name.empty())
+            ends[range.name] = range.end;
+
+    std::set<uint> cies;
+
+    for (uint offset = 0;;) {
+        uint length = read32(offset);
+
+        if (length == 0)
+            break;
+
+        uint start = offset + 4, end = start + length;
+
+        if (end < start || end > size)
+            fail("entry overruns the section");
+
+        offset = end;
+
+        if (read32(start) == 0) {
+            // Only the CIE ehFrame writes is understood.
+            static const byte header[] = { 1, 'z', 'R', 0, 1, 0x7c, 8, 1, 0x00 };
+
+            if (end - start < 4 + sizeof(header) || memcmp(frames + start + 4, header, sizeof(header)) != 0)
+                fail("CIE");
+
+            FrameState state = entryFrame();
+            run(start + 4 + sizeof(header), end, state, [&](uint) {
+                fail("CIE advances");
+            });
+
+            if (state.cfa != ESP || state.offset != 4 || !state.saved.empty())
+                fail("CIE initial state");
+
+            cies.insert(start - 4);
+            continue;
+        }
+
+        if (!cies.count(start - read32(start)))
+            fail("FDE without a CIE");
+
+        if (!sites.count(start + 4))
+            fail("FDE without a relocated address");
+
+        SectionID id = sites.at(start + 4);
+        uint begin = read32(start + 4), range = read32(start + 8), augmentation = start + 12;
+
+        if (begin + range < begin || begin + range > sectionSize(id))
+            fail("FDE outside its section");
+
+        augmentation += uleb(augmentation, end);
+
+        UnwindTable table;
+        FrameState state = entryFrame();
+        bool initial = true;
+        uint at = 0;
+
+        auto row = [&](uint delta) {
+            if (initial)
+                table.initial = state;
+            else
+                table.rows.push_back({ at, state });
+
+            initial = false;
+            at += delta;
+        };
+
+        run(augmentation, end, state, row);
+        row(0);
+
+        for (auto &symbol : symbols)
+            if (symbol.second.baseSymbol == sectionName(id) && symbol.second.offset == begin && ends.count(symbol.first) && ends.at(symbol.first) == begin + range)
+                table.begin = symbol.first;
+
+        if (table.begin.empty()) {
+            table.begin = blockLabel();
+            table.end = blockLabel();
+
+            pushSymbol(table.begin, sectionName(id), begin);
+            pushSymbol(table.end, sectionName(id), begin + range);
+        }
+
+        unwindTables.push_back(table);
+    }
+}
+
+std::vector<Compiler::FunctionRange> Compiler::functionRanges() const {
+    std::vector<std::pair<uint, std::string>> starts;
+
+    for (const std::string &func : funcs)
+        if (!folded.count(func))
+            starts.push_back({ symbols.at(func).offset, func });
+
+    std::sort(starts.begin(), starts.end());
+
+    std::vector<FunctionRange> ranges;
+
+    if (starts.empty() || starts[0].first > 0)
+        ranges.push_back({ "", 0, starts.empty() ? sectionSize(TEXT) : starts[0].first });
+
+    for (uint i = 0; i < starts.size(); i++)
+        ranges.push_back({ starts[i].second, starts[i].first, i + 1 < starts.size() ? starts[i + 1].first : sectionSize(TEXT) });
+
+    return ranges;
+}
+
+void Compiler::rearrange(const std::vector<FunctionRange> &ranges) {
+    ByteArray old = std::move(section(TEXT));
+
+    SectionID current = text;
+    text = TEXT;
+
+    auto contains = [&](const FunctionRange &range, uint offset) {
+        return offset >= range.begin && (offset < range.end || (offset == range.end && offset == old.size()));
+    };
+
+    std::vector<uint> begins;
+
+    // Ranges are laid out back to back. One holding aligned code (align(),
+    // patch sites) keeps its offset modulo that alignment, so it survives
+    // the move.
+    for (const FunctionRange &range : ranges) {
+        uint alignment = 1;
+
+        for (auto &entry : alignments)
+            if (contains(range, entry.first))
+                alignment = std::max(alignment, entry.second);
+
+        for (auto &site : patchSites)
+            if (contains(range, site.second))
+                alignment = std::max(alignment, 4u);
+
+        pad((range.begin % alignment + alignment - sectionSize(TEXT) % alignment) % alignment);
+
+        begins << sectionSize(TEXT);
+        section(TEXT).push(old.data() + range.begin, range.end - range.begin);
+    }
+
+    text = current;
+
+    auto map = [&](uint offset, uint &result) {
+        for (uint i = 0; i < ranges.size(); i++)
+            if (contains(ranges[i], offset)) {
+                result = begins[i] + offset - ranges[i].begin;
+                return true;
+            }
+
+        return false;
+    };
+
+    for (auto &symbol : symbols)
+        if (symbol.second.baseSymbol == ".text" && !map(symbol.second.offset, symbol.second.offset))
+            throw std::runtime_error("symbol '" + symbol.first + "' lies in removed code");
+
+    for (uint i = 0; i < relocs.size();) {
+        Reloc &reloc = relocs[i];
+
+        if (reloc.section != TEXT) {
+            i++;
+            continue;
+        }
+
+        uint offset;
+
+        if (!map(reloc.offset, offset)) {
+            relocs.erase(relocs.begin() + i);
+            continue;
+        }
+
+        if (reloc.type == RefRel && resolved.find(reloc.name) != resolved.end())
+            *reinterpret_cast<int *>(section(TEXT).data() + offset) += (old.data() + reloc.offset) - (section(TEXT).data() + offset);
+
+        reloc.offset = offset;
+        i++;
+    }
+
+    for (auto i = patchSites.begin(); i != patchSites.end();)
+        if (map(i->second, i->second))
+            i++;
+        else
+            i = patchSites.erase(i);
+
+    std::map<uint, uint> moved;
+    uint offset;
+
+    for (auto &entry : alignments)
+        if (map(entry.first, offset))
+            moved[offset] = entry.second;
+
+    alignments = std::move(moved);
+}
+
+void Compiler::pad(uint count) {
+    static const byte nops[][3] = { { 0x90 }, { 0x66, 0x90 }, { 0x0f, 0x1f, 0x00 } };
+
+    for (; count > 3; count -= 3)
+        section(text).push(nops[2], 3);
+
+    if (count > 0)
+        section(text).push(nops[count - 1], count);
+}
+
+void Compiler::patchable(const std::string &site, byte op, const SymRef &ref) {
+    if (patchSites.find(site) != patchSites.end())
+        throw std::runtime_error("patch site '" + site + "' is already defined");
+
+    if (text == COLD)
+        throw std::runtime_error("patch site '" + site + "' cannot be placed in cold code");
+
+    pad((4 - (sectionSize(TEXT) + 1) % 4) % 4);
+
+    instr(op, ref);
+
+    patchSites[site] = sectionSize(TEXT) - 4;
 }
 }
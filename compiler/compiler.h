@@ -3,10 +3,15 @@
 #include "function.h"
 
 #include <map>
+#include <set>
+#include <functional>
+#include <chrono>
 #include <cstring>
 
 namespace x86 {
 
+class Stencil;
+
 enum Register {
     EAX,
     ECX,
@@ -18,6 +23,18 @@ enum Register {
     EDI
 };
 
+// Low and high byte halves of EAX..EBX, as encoded in setcc, movzbl and friends.
+enum ByteRegister {
+    AL,
+    CL,
+    DL,
+    BL,
+    AH,
+    CH,
+    DH,
+    BH
+};
+
 enum FPURegister {
     ST0,
     ST1,
@@ -29,7 +46,95 @@ enum FPURegister {
     ST7
 };
 
+enum XMMRegister {
+    XMM0,
+    XMM1,
+    XMM2,
+    XMM3,
+    XMM4,
+    XMM5,
+    XMM6,
+    XMM7
+};
+
+enum YMMRegister {
+    YMM0,
+    YMM1,
+    YMM2,
+    YMM3,
+    YMM4,
+    YMM5,
+    YMM6,
+    YMM7
+};
+
+enum Condition {
+    O,
+    NO,
+    B,
+    AE,
+    E,
+    NE,
+    BE,
+    A,
+    S,
+    NS,
+    P,
+    NP,
+    L,
+    GE,
+    LE,
+    G
+};
+
+enum Instrumentation {
+    NoInstrumentation,
+    LockedCounters,   // lock-prefixed increments, safe for code shared between threads
+    UnlockedCounters, // plain increments, for code run by a single thread at a time
+    PerThreadCounters // plain increments of a per-thread copy (see ThreadCounters)
+};
+
+// Values of the ModRM reg field of prefetch.
+enum PrefetchHint {
+    PrefetchNTA,
+    PrefetchT0,
+    PrefetchT1,
+    PrefetchT2
+};
+
+// Instruction set extensions of a CPU. AVX and AVX-512 count only when the
+// OS also saves their register state.
+struct CPUFeatures {
+    bool sse2 = false;
+    bool sse3 = false;
+    bool ssse3 = false;
+    bool sse41 = false;
+    bool sse42 = false;
+    bool popcnt = false;
+    bool lzcnt = false;
+    bool bmi1 = false;
+    bool bmi2 = false;
+    bool avx = false;
+    bool avx2 = false;
+    bool avx512f = false;
+    bool erms = false;
+    bool clflushopt = false;
+};
+
+// Feature levels code can be compiled for, each implying the previous ones:
+// SSE4 adds SSE4.2 and popcnt, AVX2 adds AVX, BMI1/2 and lzcnt.
+enum TargetLevel {
+    Baseline,
+    SSE4,
+    AVX2,
+    AVX512
+};
+
 class Compiler {
+    friend class Archive;
+    friend class Assembler;
+    friend class Linker;
+
     struct __attribute__((packed)) DosHeader {
         uint16_t magic;
         uint16_t usedBytesInTheLastPage;
@@ -266,6 +371,19 @@ class Compiler {
         uint16_t type;
     };
 
+    enum CallFrameInstruction {
+        DW_CFA_nop = 0x00,
+        DW_CFA_advance_loc1 = 0x02,
+        DW_CFA_advance_loc2 = 0x03,
+        DW_CFA_advance_loc4 = 0x04,
+        DW_CFA_def_cfa = 0x0c,
+        DW_CFA_def_cfa_register = 0x0d,
+        DW_CFA_def_cfa_offset = 0x0e,
+        DW_CFA_advance_loc = 0x40,
+        DW_CFA_offset = 0x80,
+        DW_CFA_restore = 0xc0
+    };
+
     enum RelocationTypeI386 {
         IMAGE_REL_I386_ABSOLUTE = 0x0000,
         IMAGE_REL_I386_DIR16 = 0x0001,
@@ -393,6 +511,7 @@ class Compiler {
         DATA,
         BSS,
         RDATA,
+        COLD,
         EDATA,
         IDATA,
         RELOC
@@ -425,6 +544,7 @@ class Compiler {
         std::string name;
         SymRefType type;
         uint offset;
+        SectionID section;
     };
 
     struct MemRef {
@@ -452,10 +572,102 @@ class Compiler {
     std::vector<Reloc> relocs;
 
     std::vector<std::string> funcs;
+    std::set<std::string> folded; // functions sharing the code of another
     std::vector<std::string> sectionNames;
     std::vector<std::string> externFuncs;
     std::vector<std::string> externVars;
 
+    std::map<std::string, uint> patchSites;
+    std::map<uint, uint> alignments; // .text offsets align() was asked for
+
+    Instrumentation instrumentation = NoInstrumentation;
+    std::vector<std::string> counters;
+    std::vector<std::string> threadCounters;
+
+    uint switches = 0;
+    uint blocks = 0;
+    uint vectorWidth = 4;
+    TargetLevel target = Baseline;
+
+    SectionID text = TEXT;
+    std::map<std::string, int> resolved;
+
+    struct FunctionRange {
+        std::string name;
+        uint begin, end;
+    };
+
+    // Where the caller's frame is: CFA = cfa + offset, %esp = CFA - depth,
+    // and callee-saved registers stored at CFA + saved[reg]. depth is not
+    // tracked after a write to %esp it cannot follow, until %esp is set
+    // from the frame pointer again.
+    struct FrameState {
+        Register cfa;
+        int offset, depth;
+        std::map<Register, int> saved;
+        bool tracked;
+    };
+
+    struct UnwindRow {
+        uint offset;
+        FrameState state;
+    };
+
+    // Frame states of a function, or of a run of cold code, by offset from
+    // the begin symbol. Function tables end where the function does, cold
+    // ones at the end symbol.
+    struct UnwindTable {
+        std::string begin, end;
+        FrameState initial;
+        std::vector<UnwindRow> rows;
+    };
+
+    std::vector<UnwindTable> unwindTables;
+    int hotTable = -1, coldTable = -1;
+    uint hotStart = 0, coldStart = 0; // where their begin symbols are
+    FrameState frame = entryFrame(), hotFrame = entryFrame(), epilogueFrame = entryFrame();
+    bool inEpilogue = false;
+    uint frameEnd = 0;
+
+public:
+    enum Phase {
+        Emission,
+        Relocation,
+        ObjectWriting,
+        FunctionCompilation,
+
+        NUM_PHASES
+    };
+
+    struct Stats {
+        std::map<std::string, uint> sectionSizes;
+        std::map<std::string, uint> opcodes; // by encoding, e.g. "0f 84" or "83 /5"
+        uint symbols;
+        uint relocs;
+        uint reallocations;
+        double seconds[NUM_PHASES];
+
+        std::string toJSON() const;
+    };
+
+private:
+    class PhaseTimer {
+        const Compiler &compiler;
+        Phase phase;
+        bool active;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        PhaseTimer(const Compiler &compiler, Phase phase);
+        ~PhaseTimer();
+    };
+
+    bool statsEnabled = false;
+    mutable bool timing = false;
+    std::map<std::string, uint> opcodes;
+    std::vector<byte> prefixes; // of the instruction being emitted
+    mutable double seconds[NUM_PHASES] = {};
+
     enum Mod {
         Disp0,
         Disp8,
@@ -479,7 +691,21 @@ public:
     void externalFunction(const std::string &name);
     void externalVariable(const std::string &name);
 
+    // Functions get call frame information tracked from the instructions
+    // that shape the frame: push/pop, %esp adjustments by add/sub, mov
+    // between %esp and %ebp, leave and ret. Code following a ret gets the
+    // state from before the epilogue that preceded it. writeOBJ emits the
+    // information as .eh_frame and compileFunction registers it with the
+    // unwinder, so exceptions and profilers can walk through generated code.
     void function(const std::string &name);
+    void label(const std::string &name);
+
+    // Counts every function entry and label in a .bss counter, or with
+    // PerThreadCounters in a per-thread slot. Labels then clobber EFLAGS, so
+    // flags must not be live across an instrumented label. Per-thread
+    // counting needs i386 Linux, and threads must enter the code through an
+    // instrumented function before reaching its labels.
+    void setInstrumentation(Instrumentation mode);
 
     SymRef abs(const std::string &name) const;
     SymRef rel(const std::string &name) const;
@@ -502,21 +728,113 @@ public:
     void constant(int value);
     void constant(double value);
 
+    void adc(int imm, Register dst);
+    void adc(const SymRef &ref, Register dst);
+    void adcb(byte imm, const MemRef &dst);
+    void adcb(byte imm, ByteRegister dst);
+    void adcb(ByteRegister src, ByteRegister dst);
+    void adcb(ByteRegister src, const MemRef &dst);
+    void adcb(const MemRef &src, ByteRegister dst);
+    void adc(int imm, const MemRef &dst);
+    void adc(const SymRef &ref, const MemRef &dst);
+    void adc(Register src, Register dst);
+    void adc(Register src, const MemRef &dst);
+    void adc(const MemRef &src, Register dst);
+
     void add(int imm, Register dst);
     void add(const SymRef &ref, Register dst);
     void addb(byte imm, const MemRef &dst);
+    void addb(byte imm, ByteRegister dst);
+    void addb(ByteRegister src, ByteRegister dst);
+    void addb(ByteRegister src, const MemRef &dst);
+    void addb(const MemRef &src, ByteRegister dst);
     void add(int imm, const MemRef &dst);
     void add(const SymRef &ref, const MemRef &dst);
+    void add(Register src, Register dst);
     void add(Register src, const MemRef &dst);
     void add(const MemRef &src, Register dst);
 
-    void _and(int imm, Register reg);
+    void addpd(XMMRegister src, XMMRegister dst);
+    void addpd(const MemRef &src, XMMRegister dst);
+
+    void align(uint alignment);
+
+    void _and(int imm, Register dst);
+    void _and(const SymRef &ref, Register dst);
+    void andb(byte imm, const MemRef &dst);
+    void andb(byte imm, ByteRegister dst);
+    void andb(ByteRegister src, ByteRegister dst);
+    void andb(ByteRegister src, const MemRef &dst);
+    void andb(const MemRef &src, ByteRegister dst);
+    void _and(int imm, const MemRef &dst);
+    void _and(const SymRef &ref, const MemRef &dst);
+    void _and(Register src, Register dst);
+    void _and(Register src, const MemRef &dst);
+    void _and(const MemRef &src, Register dst);
+
+    void bsf(Register src, Register dst);
+    void bsf(const MemRef &src, Register dst);
+
+    void bsr(Register src, Register dst);
+    void bsr(const MemRef &src, Register dst);
 
     void call(int disp);
     void call(const SymRef &ref);
     void call(Register reg);
     void call(const MemRef &ref);
 
+    // Atomically replaces the value at dst: update gets the current value in
+    // %eax and must leave the new one in %edx, without touching dst itself
+    // or branching out. Retries until lock cmpxchg succeeds, so update may run
+    // more than once; dst must not be addressed through %eax or %edx.
+    void casLoop(const MemRef &dst, const std::function<void()> &update);
+
+    void clflushopt(const MemRef &ref);
+
+    // Sign-extends %eax into %edx, as idiv expects.
+    void cltd();
+
+    void cmov(Condition cond, Register src, Register dst);
+    void cmov(Condition cond, const MemRef &src, Register dst);
+
+    void cmp(int imm, Register dst);
+    void cmp(const SymRef &ref, Register dst);
+    void cmpb(byte imm, const MemRef &dst);
+    void cmpb(byte imm, ByteRegister dst);
+    void cmpb(ByteRegister src, ByteRegister dst);
+    void cmpb(ByteRegister src, const MemRef &dst);
+    void cmpb(const MemRef &src, ByteRegister dst);
+    void cmp(int imm, const MemRef &dst);
+    void cmp(const SymRef &ref, const MemRef &dst);
+    void cmp(Register src, Register dst);
+    void cmp(Register src, const MemRef &dst);
+    void cmp(const MemRef &src, Register dst);
+
+    void cmpsb();
+    void cmpsl();
+
+    void cmpxchg(Register src, Register dst);
+    void cmpxchg(Register src, const MemRef &dst);
+
+    void cmpxchg8b(const MemRef &ref);
+
+    // Code emitted between cold() and hot() goes to .text.cold, which
+    // compileFunction places after all hot code and writeOBJ emits as a
+    // section of its own. Branches between the two are fixed up as usual.
+    void cold();
+    void hot();
+
+    void dec(Register reg);
+    void dec(const MemRef &ref);
+
+    // div and idiv divide %edx:%eax, leaving the quotient in %eax and the
+    // remainder in %edx.
+    void div(Register reg);
+    void div(const MemRef &ref);
+
+    void divpd(XMMRegister src, XMMRegister dst);
+    void divpd(const MemRef &src, XMMRegister dst);
+
     void fadds(const MemRef &ref);
     void faddl(const MemRef &ref);
     void fadd(FPURegister src, FPURegister dst);
@@ -524,6 +842,8 @@ public:
     void faddp();
     void fiaddl(const MemRef &ref);
 
+    void fchs();
+
     void fdivs(const MemRef &ref);
     void fdivl(const MemRef &ref);
     void fdiv(FPURegister src, FPURegister dst);
@@ -549,6 +869,14 @@ public:
     void fmulp();
     void fimull(const MemRef &ref);
 
+    // Identical code folding: functions whose code is the same byte for
+    // byte and whose references reach the same targets keep one copy in
+    // .text, the others become aliases of it. Repeats until no more fold,
+    // so callers of folded functions can fold in turn. Functions with
+    // patch sites are left alone, as are ones referring to their own data
+    // (e.g. switch tables), whose targets differ. Returns the bytes saved.
+    uint foldFunctions();
+
     void fsts(const MemRef &ref);
     void fstl(const MemRef &ref);
     void fst(FPURegister reg);
@@ -571,10 +899,56 @@ public:
     void fsubrp();
     void fisubrl(const MemRef &ref);
 
+    void idiv(Register reg);
+    void idiv(const MemRef &ref);
+
+    // The one-operand forms multiply %eax into %edx:%eax, like mul.
+    void imul(Register reg);
+    void imul(const MemRef &ref);
+    void imul(Register src, Register dst);
+    void imul(const MemRef &src, Register dst);
+    void imul(int imm, Register dst);
+    void imul(int imm, Register src, Register dst);
+    void imul(int imm, const MemRef &src, Register dst);
+
+    void inc(Register reg);
+    void inc(const MemRef &ref);
+
+    // Block operations inlined for a size known at compile time, or taken
+    // from %ecx at run time. The source, or memcmp's first operand, is in
+    // %esi and the destination, or memcmp's second operand, in %edi;
+    // memcmp leaves a libc-style result in %eax. All of them clobber %eax,
+    // %ecx, %edx, %esi, %edi, %xmm0 and %xmm1.
+    void inlineMemcmp(uint size);
+    void inlineMemcmp();
+    void inlineMemcpy(uint size);
+    void inlineMemcpy();
+    void inlineMemset(byte value, uint size);
+    void inlineMemset(byte value);
+
+    void j(Condition cond, int disp);
+    void j(Condition cond, const SymRef &ref);
+
+    void jmp(int disp);
+    void jmp(const SymRef &ref);
+    void jmp(Register reg);
+    void jmp(const MemRef &ref);
+
     void lea(const MemRef &src, Register dst);
 
     void leave();
 
+    void lfence();
+
+    // Makes the next instruction atomic; needed by cmpxchg and xadd, implied
+    // by xchg with memory.
+    void lock();
+
+    void lzcnt(Register src, Register dst);
+    void lzcnt(const MemRef &src, Register dst);
+
+    void mfence();
+
     void mov(Register src, Register dst);
     void mov(int imm, Register dst);
     void mov(const SymRef &src, Register dst);
@@ -583,33 +957,310 @@ public:
     void mov(Register src, const MemRef &dst);
     void mov(const MemRef &src, Register dst);
 
+    void movapd(XMMRegister src, XMMRegister dst);
+
+    void movb(byte imm, const MemRef &dst);
+    void movb(byte imm, ByteRegister dst);
+    void movb(ByteRegister src, ByteRegister dst);
+    void movb(ByteRegister src, const MemRef &dst);
+    void movb(const MemRef &src, ByteRegister dst);
+
+    void movd(Register src, XMMRegister dst);
+    void movd(XMMRegister src, Register dst);
+
+    void movdqu(const MemRef &src, XMMRegister dst);
+    void movdqu(XMMRegister src, const MemRef &dst);
+
+    void movntdq(XMMRegister src, const MemRef &dst);
+
+    // Non-temporal stores bypass the cache; follow them with sfence before
+    // other threads may read the data.
+    void movnti(Register src, const MemRef &dst);
+
+    void movq(const MemRef &src, XMMRegister dst);
+    void movq(XMMRegister src, const MemRef &dst);
+
+    void movsb();
+    void movsl();
+
+    void movsbl(ByteRegister src, Register dst);
+    void movsbl(const MemRef &src, Register dst);
+    void movswl(Register src, Register dst);
+    void movswl(const MemRef &src, Register dst);
+
+    void movupd(const MemRef &src, XMMRegister dst);
+    void movupd(XMMRegister src, const MemRef &dst);
+
+    void movw(Register src, const MemRef &dst);
+    void movw(const MemRef &src, Register dst);
+
+    void movzbl(ByteRegister src, Register dst);
+    void movzbl(const MemRef &src, Register dst);
+    void movzwl(Register src, Register dst);
+    void movzwl(const MemRef &src, Register dst);
+
+    void mul(Register reg);
+    void mul(const MemRef &ref);
+
+    void mulpd(XMMRegister src, XMMRegister dst);
+    void mulpd(const MemRef &src, XMMRegister dst);
+
+    void neg(Register reg);
+    void neg(const MemRef &ref);
+
     void nop();
 
+    void _not(Register reg);
+    void _not(const MemRef &ref);
+
+    void _or(int imm, Register dst);
+    void _or(const SymRef &ref, Register dst);
+    void orb(byte imm, const MemRef &dst);
+    void orb(byte imm, ByteRegister dst);
+    void orb(ByteRegister src, ByteRegister dst);
+    void orb(ByteRegister src, const MemRef &dst);
+    void orb(const MemRef &src, ByteRegister dst);
+    void _or(int imm, const MemRef &dst);
+    void _or(const SymRef &ref, const MemRef &dst);
+    void _or(Register src, Register dst);
+    void _or(Register src, const MemRef &dst);
+    void _or(const MemRef &src, Register dst);
+
+    // Call counts keyed by (caller, callee); an edge from a function to
+    // itself carries the function's own count. A profile file holds one
+    // "caller callee count" or "function count" entry per line.
+    typedef std::map<std::pair<std::string, std::string>, ulong> CallGraph;
+
+    static CallGraph readProfile(const std::string &fileName);
+
+    // Rearranges the functions in .text: listed functions first, in order,
+    // then the rest as they were. The call graph form chains functions
+    // along their heaviest edges and puts the hottest chains first; plain
+    // counts (e.g. from Function::getCounters) order by count alone.
+    void orderFunctions(const std::vector<std::string> &order);
+    void orderFunctions(const CallGraph &graph);
+    void orderFunctions(const std::map<std::string, uint> &counts);
+
+    void pand(XMMRegister src, XMMRegister dst);
+
+    // Emits a call/jmp whose rel32 is 4-byte aligned, so it can later be
+    // redirected with Function::patch while other threads execute the code.
+    void patchableCall(const std::string &site, const SymRef &ref);
+    void patchableJmp(const std::string &site, const SymRef &ref);
+
+    void pause();
+
+    void pcmpeqb(XMMRegister src, XMMRegister dst);
+    void pcmpeqb(const MemRef &src, XMMRegister dst);
+
+    void pmovmskb(XMMRegister src, Register dst);
+
     void pop(Register reg);
     void pop(const MemRef &ref);
 
+    void popcnt(Register src, Register dst);
+    void popcnt(const MemRef &src, Register dst);
+
+    void prefetch(PrefetchHint hint, const MemRef &ref);
+    void prefetchnta(const MemRef &ref);
+    void prefetcht0(const MemRef &ref);
+    void prefetcht1(const MemRef &ref);
+    void prefetcht2(const MemRef &ref);
+
+    void pshufd(byte imm, XMMRegister src, XMMRegister dst);
+
     void push(Register reg);
     void push(const MemRef &ref);
     void push(int value);
     void push(const SymRef &ref);
 
+    void pxor(XMMRegister src, XMMRegister dst);
+
+    // Shift and rotate counts come from an immediate or from %cl.
+    void rcl(byte imm, Register dst);
+    void rcl(byte imm, const MemRef &dst);
+    void rcl(ByteRegister count, Register dst);
+    void rcl(ByteRegister count, const MemRef &dst);
+
+    void rcr(byte imm, Register dst);
+    void rcr(byte imm, const MemRef &dst);
+    void rcr(ByteRegister count, Register dst);
+    void rcr(ByteRegister count, const MemRef &dst);
+
+    // Prefixes for the string instruction that follows.
+    void rep();
+    void repe();
+    void repne();
+
     void ret();
 
+    void rol(byte imm, Register dst);
+    void rol(byte imm, const MemRef &dst);
+    void rol(ByteRegister count, Register dst);
+    void rol(ByteRegister count, const MemRef &dst);
+
+    void ror(byte imm, Register dst);
+    void ror(byte imm, const MemRef &dst);
+    void ror(ByteRegister count, Register dst);
+    void ror(ByteRegister count, const MemRef &dst);
+
+    void sar(byte imm, Register dst);
+    void sar(byte imm, const MemRef &dst);
+    void sar(ByteRegister count, Register dst);
+    void sar(ByteRegister count, const MemRef &dst);
+
+    void sbb(int imm, Register dst);
+    void sbb(const SymRef &ref, Register dst);
+    void sbbb(byte imm, const MemRef &dst);
+    void sbbb(byte imm, ByteRegister dst);
+    void sbbb(ByteRegister src, ByteRegister dst);
+    void sbbb(ByteRegister src, const MemRef &dst);
+    void sbbb(const MemRef &src, ByteRegister dst);
+    void sbb(int imm, const MemRef &dst);
+    void sbb(const SymRef &ref, const MemRef &dst);
+    void sbb(Register src, Register dst);
+    void sbb(Register src, const MemRef &dst);
+    void sbb(const MemRef &src, Register dst);
+
+    void scasb();
+
+    void set(Condition cond, ByteRegister dst);
+    void set(Condition cond, const MemRef &dst);
+
+    void sfence();
+
+    void shl(byte imm, Register dst);
+    void shl(byte imm, const MemRef &dst);
+    void shl(ByteRegister count, Register dst);
+    void shl(ByteRegister count, const MemRef &dst);
+
+    void shr(byte imm, Register dst);
+    void shr(byte imm, const MemRef &dst);
+    void shr(ByteRegister count, Register dst);
+    void shr(ByteRegister count, const MemRef &dst);
+
+    // Spins until the value at ref equals value, pausing for twice as long
+    // after each failed check up to maxBackoff iterations. Clobbers %ecx
+    // and %edx.
+    void spinWait(const MemRef &ref, int value, uint maxBackoff = 1024);
+
+    void stosb();
+    void stosl();
+
+    // Runs body for every step bytes from ptr up to end, prefetching distance
+    // bytes ahead of ptr on each iteration. body may use but not move ptr
+    // and end; it usually handles one or more cache lines per step.
+    void streamLoop(Register ptr, Register end, uint step, uint distance, PrefetchHint hint, const std::function<void()> &body);
+
     void sub(int imm, Register dst);
     void sub(const SymRef &ref, Register dst);
     void subb(byte imm, const MemRef &dst);
+    void subb(byte imm, ByteRegister dst);
+    void subb(ByteRegister src, ByteRegister dst);
+    void subb(ByteRegister src, const MemRef &dst);
+    void subb(const MemRef &src, ByteRegister dst);
     void sub(int imm, const MemRef &dst);
     void sub(const SymRef &ref, const MemRef &dst);
+    void sub(Register src, Register dst);
     void sub(Register src, const MemRef &dst);
     void sub(const MemRef &src, Register dst);
 
+    void subpd(XMMRegister src, XMMRegister dst);
+    void subpd(const MemRef &src, XMMRegister dst);
+
+    // Jumps to the label of the case matching reg, or to defaultLabel. Dense
+    // case sets become bounds-checked jump tables in .rdata, sparse ones
+    // binary-search compare trees.
+    void _switch(Register reg, std::vector<std::pair<int, std::string>> cases, const std::string &defaultLabel);
+
+    void test(int imm, Register dst);
+    void testb(byte imm, const MemRef &dst);
+    void testb(byte imm, ByteRegister dst);
+    void testb(ByteRegister src, ByteRegister dst);
+    void testb(ByteRegister src, const MemRef &dst);
+    void testb(const MemRef &src, ByteRegister dst);
+    void test(int imm, const MemRef &dst);
+    void test(Register src, Register dst);
+    void test(Register src, const MemRef &dst);
+    void test(const MemRef &src, Register dst);
+
+    void tzcnt(Register src, Register dst);
+    void tzcnt(const MemRef &src, Register dst);
+
+    void vaddpd(YMMRegister src, YMMRegister src2, YMMRegister dst);
+
+    void vdivpd(YMMRegister src, YMMRegister src2, YMMRegister dst);
+
+    void vinsertf128(byte imm, XMMRegister src, YMMRegister src2, YMMRegister dst);
+
+    void vmovdqu(const MemRef &src, YMMRegister dst);
+    void vmovdqu(YMMRegister src, const MemRef &dst);
+
+    void vmovntdq(YMMRegister src, const MemRef &dst);
+
+    void vmovupd(const MemRef &src, YMMRegister dst);
+    void vmovupd(YMMRegister src, const MemRef &dst);
+
+    void vmulpd(YMMRegister src, YMMRegister src2, YMMRegister dst);
+
+    void vsubpd(YMMRegister src, YMMRegister src2, YMMRegister dst);
+
+    void vxorpd(YMMRegister src, YMMRegister src2, YMMRegister dst);
+
+    void vzeroupper();
+
+    void xadd(Register src, Register dst);
+    void xadd(Register src, const MemRef &dst);
+
+    void xchg(Register src, Register dst);
+    void xchg(Register src, const MemRef &dst);
+
+    void _xor(int imm, Register dst);
+    void _xor(const SymRef &ref, Register dst);
+    void xorb(byte imm, const MemRef &dst);
+    void xorb(byte imm, ByteRegister dst);
+    void xorb(ByteRegister src, ByteRegister dst);
+    void xorb(ByteRegister src, const MemRef &dst);
+    void xorb(const MemRef &src, ByteRegister dst);
+    void _xor(int imm, const MemRef &dst);
+    void _xor(const SymRef &ref, const MemRef &dst);
+    void _xor(Register src, Register dst);
+    void _xor(Register src, const MemRef &dst);
+    void _xor(const MemRef &src, Register dst);
+
+    void xorpd(XMMRegister src, XMMRegister dst);
+
+    // Widest move the inline block operations may use: 4 (general purpose
+    // registers only, the default), 16 (SSE2) or 32 (AVX).
+    void setVectorWidth(uint width);
+
+    // Features of the CPU this process runs on, detected once with CPUID.
+    static const CPUFeatures &hostFeatures();
+    static TargetLevel hostLevel();
+
+    // Level the emitted code may assume; generators query it to pick
+    // instructions. Also sets the vector width to 4, 16, 32 or 32.
+    void setTarget(TargetLevel level);
+    TargetLevel getTarget() const;
+
+    void setStatsEnabled(bool enabled);
+    Stats getStats() const;
+
     ByteArray writeOBJ() const;
+
+    // Reads an object written by writeOBJ back into a module, so it can be
+    // linked (e.g. Linker::link with a resolver for its externals) and
+    // compiled into a Function without generating the code again. Its
+    // .eh_frame becomes the module's unwind tables again.
+    static Compiler readOBJ(const ByteArray &image);
+
     ByteArray writeEXE() const;
     ByteArray writeDLL(const std::string &name) const;
 
     const ByteArray &getCode() const;
 
     Function compileFunction();
+    Stencil compileStencil();
 
 private:
     void instr(byte op);
@@ -625,11 +1276,36 @@ private:
     void instr(byte op, byte reg, const MemRef &rm, int imm);
     void instr(byte op, byte reg, const MemRef &rm, const SymRef &ref);
 
+    // Group 1 (add, or, adc, sbb, and, sub, xor, cmp) and group 2 (shifts
+    // and rotates) encodings, selected by the ModRM reg field ext.
+    void alu(byte ext, int imm, Register dst);
+    void alu(byte ext, const SymRef &ref, Register dst);
+    void alu(byte ext, int imm, const MemRef &dst);
+    void alu(byte ext, const SymRef &ref, const MemRef &dst);
+    void alu(byte ext, Register src, Register dst);
+    void alu(byte ext, Register src, const MemRef &dst);
+    void alu(byte ext, const MemRef &src, Register dst);
+
+    void alub(byte ext, byte imm, ByteRegister dst);
+    void alub(byte ext, byte imm, const MemRef &dst);
+    void alub(byte ext, ByteRegister src, ByteRegister dst);
+    void alub(byte ext, ByteRegister src, const MemRef &dst);
+    void alub(byte ext, const MemRef &src, ByteRegister dst);
+
+    void shift(byte ext, byte imm, Register dst);
+    void shift(byte ext, byte imm, const MemRef &dst);
+    void shift(byte ext, ByteRegister count, Register dst);
+    void shift(byte ext, ByteRegister count, const MemRef &dst);
+
     static byte composeByte(byte a, byte b, byte c);
 
     template <class T>
     void gen(T value);
 
+    static std::string sectionName(SectionID id);
+    static SectionID sectionID(const std::string &name);
+    static ByteArray &section(Function &f, SectionID id);
+    static Function::Section functionSection(SectionID id);
     bool isSectionDefined(SectionID id) const;
     uint sectionSize(SectionID id) const;
     ByteArray &section(SectionID id);
@@ -639,6 +1315,48 @@ private:
     void pushSymbol(const std::string &name, const std::string &baseSymbol, uint offset);
     void pushReloc(const Reloc &reloc);
 
+    // reg is the ModRM reg field, which extends group opcodes (none if
+    // the instruction has no ModRM).
+    void opcode(byte op, byte reg = 8);
+    void prefix(byte value);
+    std::string opcodeName(byte op, byte reg) const;
+    void reference(SectionID id, const SymRef &ref);
+    void switchTree(Register reg, const std::pair<int, std::string> *cases, uint count, const std::string &defaultLabel);
+    void switchTable(Register reg, const std::pair<int, std::string> *cases, uint count, const std::string &defaultLabel);
+    std::string blockLabel();
+    uint blockChunk(uint size) const;
+    void loadChunk(uint size, const MemRef &src, uint slot);
+    void storeChunk(uint size, uint slot, const MemRef &dst);
+    void fillRegisters(byte value, uint size);
+    void blockSizeClasses(bool fill, const std::string &done);
+    void compareChunk(const std::string &found);
+    void count(const std::string &name);
+    void bind(Function &f, const Reloc &reloc);
+    void mergeCold();
+
+    static FrameState entryFrame();
+    UnwindTable *unwindTable();
+    void setFrame(const FrameState &state);
+    void releaseFrame(uint start);
+    void adjustFrame(uint start, int size);
+    void pushFrame(Register reg);
+    void popFrame(uint start, Register reg);
+    void moveFrame(uint start, Register src, Register dst);
+    void loadFrame(uint start, const MemRef &src);
+    void clobberFrame();
+    void leaveFrame(uint start);
+    void returnFrame();
+    ByteArray ehFrame(std::vector<std::pair<uint, SectionID>> &sites) const;
+    void readEHFrame(const byte *frames, uint size, const std::map<uint, SectionID> &sites);
+
+    std::vector<FunctionRange> functionRanges() const;
+    void rearrange(const std::vector<FunctionRange> &ranges);
+
+    void pad(uint count);
+    void patchable(const std::string &site, byte op, const SymRef &ref);
+
+    static CPUFeatures detectFeatures();
+
     static bool isByte(int value);
 };
 
@@ -648,7 +1366,7 @@ inline byte Compiler::composeByte(byte a, byte b, byte c) {
 
 template <class T>
 inline void Compiler::gen(T value) {
-    section(TEXT).push(value);
+    section(text).push(value);
 }
 
 template <class T>
@@ -6,13 +6,36 @@ CONFIG -= qt
 CONFIG += staticlib
 
 SOURCES += \
+    archive.cpp \
+    assembler.cpp \
     bytearray.cpp \
+    codeheap.cpp \
     common.cpp \
     compiler.cpp \
-    function.cpp
+    expression.cpp \
+    function.cpp \
+    linker.cpp \
+    multiversion.cpp \
+    profiler.cpp \
+    regex.cpp \
+    stencil.cpp \
+    templatejit.cpp \
+    threadcounters.cpp
 
 HEADERS += \
+    archive.h \
+    assembler.h \
     bytearray.h \
+    codeheap.h \
     common.h \
     compiler.h \
-    function.h
+    expression.h \
+    function.h \
+    linker.h \
+    multiversion.h \
+    profiler.h \
+    regex.h \
+    sequence.h \
+    stencil.h \
+    templatejit.h \
+    threadcounters.h
@@ -0,0 +1,389 @@
+#include "expression.h"
+
+#include <cctype>
+#include <algorithm>
+
+namespace x86 {
+
+Expression::Expression(const std::string &formula)
+    : formula(formula)
+    , pos(0) {
+    root = parseSum();
+
+    skipSpaces();
+
+    if (pos < formula.size())
+        throw std::runtime_error("unexpected '" + formula.substr(pos, 1) + "' at " + toString(pos, 10, 0));
+}
+
+const std::vector<std::string> &Expression::getVariables() const {
+    return variables;
+}
+
+double Expression::evaluate(const double *values) const {
+    return evaluate(root, values);
+}
+
+Function Expression::compile() const {
+    Compiler c;
+    std::vector<ulong> constants;
+
+    c.push(EBP);
+    c.mov(ESP, EBP);
+    c.push(EBX);
+    c.push(ESI);
+    c.push(EDI);
+
+    c.mov(c.ref(8, EBP), ECX);
+    c.mov(c.ref(12, EBP), ESI);
+    c.mov(c.ref(16, EBP), EDI);
+    c.mov(0, EBX);
+
+    if (depth(root) > 8)
+        throw std::runtime_error("expression is too deep");
+
+    const CPUFeatures &features = Compiler::hostFeatures();
+
+    if (features.avx) {
+        c.label("wide");
+
+        c.lea(c.ref(4, EBX), EAX);
+        c.cmp(ECX, EAX);
+        c.j(G, c.rel("narrow"));
+
+        compileWide(c, root, YMM0, constants);
+        c.vmovupd(YMM0, c.ref(EDI, EBX, 8));
+
+        c.add(4, EBX);
+        c.jmp(c.rel("wide"));
+
+        // Legacy SSE code after 256-bit code would stall on the upper halves.
+        c.label("narrow");
+        c.vzeroupper();
+    }
+
+    if (features.sse2) {
+        c.label("packed");
+
+        c.lea(c.ref(2, EBX), EAX);
+        c.cmp(ECX, EAX);
+        c.j(G, c.rel("scalar"));
+
+        compilePacked(c, root, XMM0, constants);
+        c.movupd(XMM0, c.ref(EDI, EBX, 8));
+
+        c.add(2, EBX);
+        c.jmp(c.rel("packed"));
+    }
+
+    c.label("scalar");
+
+    c.cmp(ECX, EBX);
+    c.j(GE, c.rel("done"));
+
+    compileScalar(c, root, constants);
+    c.fstpl(c.ref(EDI, EBX, 8));
+
+    c.add(1, EBX);
+    c.jmp(c.rel("scalar"));
+
+    c.label("done");
+
+    c.pop(EDI);
+    c.pop(ESI);
+    c.pop(EBX);
+    c.leave();
+    c.ret();
+
+    return c.compileFunction();
+}
+
+int Expression::parseSum() {
+    int left = parseProduct();
+
+    while (true)
+        if (accept('+'))
+            left = node(Addition, 0, 0, left, parseProduct());
+        else if (accept('-'))
+            left = node(Subtraction, 0, 0, left, parseProduct());
+        else
+            return left;
+}
+
+int Expression::parseProduct() {
+    int left = parseUnary();
+
+    while (true)
+        if (accept('*'))
+            left = node(Multiplication, 0, 0, left, parseUnary());
+        else if (accept('/'))
+            left = node(Division, 0, 0, left, parseUnary());
+        else
+            return left;
+}
+
+int Expression::parseUnary() {
+    if (accept('-'))
+        return node(Negation, 0, 0, parseUnary(), -1);
+
+    if (accept('+'))
+        return parseUnary();
+
+    return parsePrimary();
+}
+
+int Expression::parsePrimary() {
+    skipSpaces();
+
+    if (accept('(')) {
+        int result = parseSum();
+
+        if (!accept(')'))
+            throw std::runtime_error("expected ')' at " + toString(pos, 10, 0));
+
+        return result;
+    }
+
+    uint start = pos;
+
+    if (pos < formula.size() && (isdigit(formula[pos]) || formula[pos] == '.')) {
+        while (pos < formula.size() && (isdigit(formula[pos]) || formula[pos] == '.'))
+            pos++;
+
+        if (pos < formula.size() && (formula[pos] == 'e' || formula[pos] == 'E')) {
+            pos++;
+
+            if (pos < formula.size() && (formula[pos] == '+' || formula[pos] == '-'))
+                pos++;
+
+            while (pos < formula.size() && isdigit(formula[pos]))
+                pos++;
+        }
+
+        return node(Constant, fromString<double>(formula.substr(start, pos - start)), 0, -1, -1);
+    }
+
+    if (pos < formula.size() && (isalpha(formula[pos]) || formula[pos] == '_')) {
+        while (pos < formula.size() && (isalnum(formula[pos]) || formula[pos] == '_'))
+            pos++;
+
+        std::string name = formula.substr(start, pos - start);
+
+        if (name == "inf" || name == "nan")
+            return node(Constant, fromString<double>(name), 0, -1, -1);
+
+        auto i = find(variables.begin(), variables.end(), name);
+
+        if (i == variables.end())
+            i = variables.insert(i, name);
+
+        return node(Variable, 0, i - variables.begin(), -1, -1);
+    }
+
+    throw std::runtime_error("expected operand at " + toString(pos, 10, 0));
+}
+
+int Expression::node(NodeType type, double value, uint variable, int left, int right) {
+    nodes.push_back({ type, value, variable, left, right });
+    return nodes.size() - 1;
+}
+
+void Expression::skipSpaces() {
+    while (pos < formula.size() && isspace(formula[pos]))
+        pos++;
+}
+
+bool Expression::accept(char c) {
+    skipSpaces();
+
+    if (pos < formula.size() && formula[pos] == c) {
+        pos++;
+        return true;
+    }
+
+    return false;
+}
+
+double Expression::evaluate(int node, const double *values) const {
+    const Node &n = nodes[node];
+
+    switch (n.type) {
+    case Constant:
+        return n.value;
+    case Variable:
+        return values[n.variable];
+    case Negation:
+        return -evaluate(n.left, values);
+    case Addition:
+        return evaluate(n.left, values) + evaluate(n.right, values);
+    case Subtraction:
+        return evaluate(n.left, values) - evaluate(n.right, values);
+    case Multiplication:
+        return evaluate(n.left, values) * evaluate(n.right, values);
+    default:
+        return evaluate(n.left, values) / evaluate(n.right, values);
+    }
+}
+
+uint Expression::depth(int node) const {
+    const Node &n = nodes[node];
+
+    switch (n.type) {
+    case Constant:
+    case Variable:
+        return 1;
+    case Negation:
+        return std::max(depth(n.left), 2u);
+    default:
+        return std::max(depth(n.left), depth(n.right) + 1);
+    }
+}
+
+void Expression::compileScalar(Compiler &c, int node, std::vector<ulong> &constants) const {
+    const Node &n = nodes[node];
+
+    switch (n.type) {
+    case Constant:
+        c.fldl(c.ref(c.abs(constant(c, n.value, constants))));
+        return;
+
+    case Variable:
+        c.mov(c.ref(n.variable * 4, ESI), EDX);
+        c.fldl(c.ref(EDX, EBX, 8));
+        return;
+
+    case Negation:
+        compileScalar(c, n.left, constants);
+        c.fchs();
+        return;
+
+    default:
+        break;
+    }
+
+    compileScalar(c, n.left, constants);
+    compileScalar(c, n.right, constants);
+
+    // The left operand ends up in %st(1); the reversed forms compute
+    // %st(1) - %st(0) and %st(1) / %st(0).
+    switch (n.type) {
+    case Addition:
+        c.faddp();
+        break;
+    case Subtraction:
+        c.fsubrp();
+        break;
+    case Multiplication:
+        c.fmulp();
+        break;
+    default:
+        c.fdivrp();
+        break;
+    }
+}
+
+void Expression::compilePacked(Compiler &c, int node, XMMRegister reg, std::vector<ulong> &constants) const {
+    const Node &n = nodes[node];
+    XMMRegister next = static_cast<XMMRegister>(reg + 1);
+
+    switch (n.type) {
+    case Constant:
+        c.movupd(c.ref(c.abs(constant(c, n.value, constants))), reg);
+        return;
+
+    case Variable:
+        c.mov(c.ref(n.variable * 4, ESI), EDX);
+        c.movupd(c.ref(EDX, EBX, 8), reg);
+        return;
+
+    case Negation:
+        // Flipping the sign bit, like fchs; 0 - x would give +0.0 for 0.0.
+        compilePacked(c, n.left, reg, constants);
+        c.movupd(c.ref(c.abs(constant(c, -0.0, constants))), next);
+        c.xorpd(next, reg);
+        return;
+
+    default:
+        break;
+    }
+
+    compilePacked(c, n.left, reg, constants);
+    compilePacked(c, n.right, next, constants);
+
+    switch (n.type) {
+    case Addition:
+        c.addpd(next, reg);
+        break;
+    case Subtraction:
+        c.subpd(next, reg);
+        break;
+    case Multiplication:
+        c.mulpd(next, reg);
+        break;
+    default:
+        c.divpd(next, reg);
+        break;
+    }
+}
+
+void Expression::compileWide(Compiler &c, int node, YMMRegister reg, std::vector<ulong> &constants) const {
+    const Node &n = nodes[node];
+    YMMRegister next = static_cast<YMMRegister>(reg + 1);
+
+    switch (n.type) {
+    case Constant:
+        c.vmovupd(c.ref(c.abs(constant(c, n.value, constants))), reg);
+        return;
+
+    case Variable:
+        c.mov(c.ref(n.variable * 4, ESI), EDX);
+        c.vmovupd(c.ref(EDX, EBX, 8), reg);
+        return;
+
+    case Negation:
+        compileWide(c, n.left, reg, constants);
+        c.vmovupd(c.ref(c.abs(constant(c, -0.0, constants))), next);
+        c.vxorpd(next, reg, reg);
+        return;
+
+    default:
+        break;
+    }
+
+    compileWide(c, n.left, reg, constants);
+    compileWide(c, n.right, next, constants);
+
+    switch (n.type) {
+    case Addition:
+        c.vaddpd(next, reg, reg);
+        break;
+    case Subtraction:
+        c.vsubpd(next, reg, reg);
+        break;
+    case Multiplication:
+        c.vmulpd(next, reg, reg);
+        break;
+    default:
+        c.vdivpd(next, reg, reg);
+        break;
+    }
+}
+
+std::string Expression::constant(Compiler &c, double value, std::vector<ulong> &constants) const {
+    ulong bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    auto i = find(constants.begin(), constants.end(), bits);
+    std::string name = "__constant" + toString(i - constants.begin(), 10, 0);
+
+    if (i == constants.end()) {
+        // Enough copies for a 256-bit load; SSE2 reads the first two.
+        double copies[] = { value, value, value, value };
+        c.rdata(name, reinterpret_cast<const byte *>(copies), sizeof(copies));
+
+        constants << bits;
+    }
+
+    return name;
+}
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "compiler.h"
+
+namespace x86 {
+
+// Arithmetic formula over named variables (+, -, *, /, unary minus,
+// parentheses, numeric literals including inf and nan), compiled to a loop
+// evaluating it over columns of doubles:
+//
+//     void f(int rows, const double **columns, double *out);
+//
+// columns[i] holds the values of getVariables()[i]. The loop runs four rows
+// at a time with 256-bit AVX arithmetic and then two at a time with packed
+// SSE2, each when Compiler::hostFeatures() reports it, and finishes the
+// remaining rows on the x87 stack.
+class Expression {
+    enum NodeType {
+        Constant,
+        Variable,
+        Negation,
+        Addition,
+        Subtraction,
+        Multiplication,
+        Division
+    };
+
+    struct Node {
+        NodeType type;
+        double value;
+        uint variable;
+        int left, right;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<std::string> variables;
+    int root;
+
+    std::string formula;
+    uint pos;
+
+public:
+    Expression(const std::string &formula);
+
+    const std::vector<std::string> &getVariables() const;
+
+    double evaluate(const double *values) const;
+
+    Function compile() const;
+
+private:
+    int parseSum();
+    int parseProduct();
+    int parseUnary();
+    int parsePrimary();
+
+    int node(NodeType type, double value, uint variable, int left, int right);
+
+    void skipSpaces();
+    bool accept(char c);
+
+    double evaluate(int node, const double *values) const;
+    uint depth(int node) const;
+
+    void compileScalar(Compiler &c, int node, std::vector<ulong> &constants) const;
+    void compilePacked(Compiler &c, int node, XMMRegister reg, std::vector<ulong> &constants) const;
+    void compileWide(Compiler &c, int node, YMMRegister reg, std::vector<ulong> &constants) const;
+    std::string constant(Compiler &c, double value, std::vector<ulong> &constants) const;
+};
+}
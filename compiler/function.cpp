@@ -1,16 +1,76 @@
 #include "function.h"
 
+#include "compiler.h"
+#include "profiler.h"
+#include "threadcounters.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+extern "C" void __register_frame(void *begin);
+extern "C" void __deregister_frame(void *begin);
+
 namespace x86 {
 
+std::mutex Function::batchMutex;
+
 Function::Function() {
 }
 
 Function::Function(Function &&f)
-    : code(std::move(f.code)) {
+    : code(std::move(f.code))
+    , data(std::move(f.data))
+    , rdata(std::move(f.rdata))
+    , bss(std::move(f.bss))
+    , frames(std::move(f.frames))
+    , symbols(std::move(f.symbols))
+    , patchSites(std::move(f.patchSites))
+    , counters(std::move(f.counters))
+    , threadCounters(std::move(f.threadCounters))
+    , firstSlot(f.firstSlot)
+    , slotCount(f.slotCount)
+    , relocations(std::move(f.relocations))
+    , frameSites(std::move(f.frameSites))
+    , batchDrivers(std::move(f.batchDrivers)) {
+    f.slotCount = 0;
+    adoptPatches(f);
+    Profiler::replaceFunction(f, *this);
+}
+
+Function::~Function() {
+    Profiler::unregisterFunction(*this);
+    deregisterFrames();
+    releaseSlots();
+    unlinkPatches();
 }
 
 Function &Function::operator=(Function &&f) {
+    if (&f == this)
+        return *this;
+
+    Profiler::unregisterFunction(*this);
+    deregisterFrames();
+    releaseSlots();
+    unlinkPatches();
+
     code = std::move(f.code);
+    data = std::move(f.data);
+    rdata = std::move(f.rdata);
+    bss = std::move(f.bss);
+    frames = std::move(f.frames);
+    symbols = std::move(f.symbols);
+    patchSites = std::move(f.patchSites);
+    counters = std::move(f.counters);
+    threadCounters = std::move(f.threadCounters);
+    firstSlot = f.firstSlot;
+    slotCount = f.slotCount;
+    f.slotCount = 0;
+    relocations = std::move(f.relocations);
+    frameSites = std::move(f.frameSites);
+    batchDrivers = std::move(f.batchDrivers);
+    adoptPatches(f);
+
+    Profiler::replaceFunction(f, *this);
     return *this;
 }
 
@@ -50,10 +110,150 @@ int Function::invoke(const std::vector<int> &args) {
     return r;
 }
 
+void Function::invokeBatch(uint arity, const int *args, int *results, uint count) {
+    batchDriver(arity).invoke(3, reinterpret_cast<int>(args), reinterpret_cast<int>(results), static_cast<int>(count));
+}
+
+Function &Function::batchDriver(uint arity) {
+    std::lock_guard<std::mutex> lock(batchMutex);
+    std::unique_ptr<Function> &driver = batchDrivers[arity];
+
+    if (driver)
+        return *driver;
+
+    Compiler c;
+
+    c.push(EBP);
+    c.mov(ESP, EBP);
+    c.push(EBX);
+    c.push(ESI);
+    c.push(EDI);
+
+    c.mov(c.ref(8, EBP), ESI);
+    c.mov(c.ref(12, EBP), EDI);
+    c.mov(c.ref(16, EBP), EBX);
+
+    c.cmp(0, EBX);
+    c.j(E, c.rel("done"));
+
+    c.label("loop");
+
+    for (int i = arity - 1; i >= 0; i--)
+        c.push(c.ref(i * sizeof(int), ESI));
+
+    c.call(c.rel("target"));
+
+    if (arity > 0)
+        c.add(arity * sizeof(int), ESP);
+
+    c.mov(EAX, c.ref(EDI));
+
+    c.add(arity * sizeof(int), ESI);
+    c.add(sizeof(int), EDI);
+    c.sub(1, EBX);
+    c.j(NE, c.rel("loop"));
+
+    c.label("done");
+
+    c.pop(EDI);
+    c.pop(ESI);
+    c.pop(EBX);
+    c.leave();
+    c.ret();
+
+    c.relocate("target", reinterpret_cast<int>(code.data()));
+
+    driver.reset(new Function(c.compileFunction()));
+    return *driver;
+}
+
+void Function::patch(const std::string &site, const Function &target) {
+    patch(site, target.code.data());
+
+    uint offset = patchSites.at(site);
+
+    patchTargets[offset] = const_cast<Function *>(&target);
+    target.patchers.push_back({ this, offset });
+}
+
+void Function::patch(const std::string &site, const void *target) {
+    auto i = patchSites.find(site);
+
+    if (i == patchSites.end())
+        throw std::runtime_error("patch site '" + site + "' is not defined");
+
+    int *disp = reinterpret_cast<int *>(code.data() + i->second);
+    auto previous = patchTargets.find(i->second);
+
+    if (previous != patchTargets.end()) {
+        auto &patchers = previous->second->patchers;
+        patchers.erase(std::find(patchers.begin(), patchers.end(), std::make_pair(this, i->second)));
+        patchTargets.erase(previous);
+    }
+
+    // The release store orders any preceding writes of the new target's code
+    // before the displacement becomes visible to other processors.
+    __atomic_store_n(disp, reinterpret_cast<int>(target) - reinterpret_cast<int>(disp + 1), __ATOMIC_RELEASE);
+
+    // The site now refers outside the function, wherever it pointed before.
+    Relocation reloc = { Code, i->second, External, true };
+
+    for (Relocation &existing : relocations)
+        if (existing.site == Code && existing.offset == i->second) {
+            existing = reloc;
+            return;
+        }
+
+    relocations.push_back(reloc);
+}
+
+uint Function::counter(const std::string &name) const {
+    auto i = counters.find(name);
+
+    if (i != counters.end())
+        return __atomic_load_n(reinterpret_cast<uint *>(bss.data() + i->second), __ATOMIC_RELAXED);
+
+    i = threadCounters.find(name);
+
+    if (i != threadCounters.end())
+        return ThreadCounters::read(i->second);
+
+    throw std::runtime_error("counter '" + name + "' is not defined");
+}
+
+std::map<std::string, uint> Function::getCounters() const {
+    std::map<std::string, uint> result;
+
+    for (auto &i : counters)
+        result[i.first] = counter(i.first);
+
+    for (auto &i : threadCounters)
+        result[i.first] = counter(i.first);
+
+    return result;
+}
+
+void Function::resetCounters() {
+    for (auto &counter : counters)
+        __atomic_store_n(reinterpret_cast<uint *>(bss.data() + counter.second), 0, __ATOMIC_RELAXED);
+
+    for (auto &counter : threadCounters)
+        ThreadCounters::reset(counter.second);
+}
+
 byte *Function::getCode() {
     return code.data();
 }
 
+byte *Function::getCode(const std::string &name) {
+    auto i = symbols.find(name);
+
+    if (i == symbols.end())
+        throw std::runtime_error("function '" + name + "' is not defined");
+
+    return code.data() + i->second;
+}
+
 std::string Function::dump() {
     std::string result;
 
@@ -63,6 +263,38 @@ std::string Function::dump() {
     return result;
 }
 
+uint Function::reallocate() {
+    int deltas[External + 1] = {};
+    uint moved = 0;
+
+    if (frames.size() > 0)
+        __deregister_frame(frames.data());
+
+    for (Section s : { Code, Data, RData, BSS })
+        if (section(s).data()) {
+            deltas[s] = section(s).reallocate();
+            moved += section(s).size();
+        }
+
+    relocate(deltas);
+
+    return moved;
+}
+
+uint Function::reallocate(byte *dst) {
+    int deltas[External + 1] = {};
+
+    if (frames.size() > 0)
+        __deregister_frame(frames.data());
+
+    deltas[Code] = dst - code.data();
+    code.moveTo(dst);
+
+    relocate(deltas);
+
+    return code.size();
+}
+
 Function::Function(const ByteArray &code)
     : code(code) {
 }
@@ -70,4 +302,102 @@ Function::Function(const ByteArray &code)
 Function::Function(ByteArray &&code)
     : code(std::move(code)) {
 }
+
+void Function::registerFrames(ByteArray &&frames) {
+    deregisterFrames();
+
+    this->frames = std::move(frames);
+
+    if (this->frames.size() > 0)
+        __register_frame(this->frames.data());
+}
+
+void Function::deregisterFrames() {
+    if (frames.size() > 0)
+        __deregister_frame(frames.data());
+
+    frames.release();
+}
+
+void Function::releaseSlots() {
+    if (slotCount > 0)
+        ThreadCounters::release(firstSlot, slotCount);
+
+    slotCount = 0;
+}
+
+void Function::unlinkPatches() {
+    for (auto &target : patchTargets) {
+        auto &patchers = target.second->patchers;
+        patchers.erase(std::find(patchers.begin(), patchers.end(), std::make_pair(this, target.first)));
+    }
+
+    for (auto &patcher : patchers)
+        if (patcher.first != this)
+            patcher.first->patchTargets.erase(patcher.second);
+
+    patchTargets.clear();
+    patchers.clear();
+}
+
+void Function::adoptPatches(Function &f) {
+    patchTargets = std::move(f.patchTargets);
+    patchers = std::move(f.patchers);
+    f.patchTargets.clear();
+    f.patchers.clear();
+
+    // Sites patched to the function itself name it on both sides.
+    for (auto &target : patchTargets)
+        if (target.second == &f)
+            target.second = this;
+
+    for (auto &patcher : patchers)
+        if (patcher.first == &f)
+            patcher.first = this;
+
+    for (auto &target : patchTargets)
+        for (auto &patcher : target.second->patchers)
+            if (patcher == std::make_pair(&f, target.first))
+                patcher.first = this;
+
+    for (auto &patcher : patchers)
+        patcher.first->patchTargets[patcher.second] = this;
+}
+
+void Function::relocate(const int *deltas) {
+    // The batch drivers call the old address.
+    if (deltas[Code]) {
+        std::lock_guard<std::mutex> lock(batchMutex);
+        batchDrivers.clear();
+    }
+
+    // A reference moves with its site; what it holds changes by how far the
+    // target moved, less how far the site moved if it is relative.
+    for (const Relocation &reloc : relocations)
+        *reinterpret_cast<int *>(section(reloc.site).data() + reloc.offset) += deltas[reloc.target] - (reloc.relative ? deltas[reloc.site] : 0);
+
+    for (uint site : frameSites)
+        *reinterpret_cast<int *>(frames.data() + site) += deltas[Code];
+
+    for (auto &patcher : patchers)
+        *reinterpret_cast<int *>(patcher.first->code.data() + patcher.second) += deltas[Code];
+
+    if (frames.size() > 0)
+        __register_frame(frames.data());
+
+    Profiler::moveFunction(*this, deltas[Code]);
+}
+
+ByteArray &Function::section(Section section) {
+    switch (section) {
+    case Data:
+        return data;
+    case RData:
+        return rdata;
+    case BSS:
+        return bss;
+    default:
+        return code;
+    }
+}
 }
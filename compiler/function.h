@@ -1,5 +1,8 @@
 #pragma once
 
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -8,26 +11,122 @@
 namespace x86 {
 
 class Function {
+    friend class CodeHeap;
     friend class Compiler;
+    friend class Profiler;
+    friend class Stencil;
 
-    ByteArray code;
+    enum Section {
+        Code,
+        Data,
+        RData,
+        BSS,
+        External
+    };
+
+    // A 4-byte reference at offset in site, to target or to a fixed address
+    // outside the function (External).
+    struct Relocation {
+        Section site;
+        uint offset;
+        Section target;
+        bool relative;
+    };
+
+    ByteArray code, data, rdata, bss, frames;
+    std::map<std::string, uint> symbols;
+    std::map<std::string, uint> patchSites;
+    std::map<std::string, uint> counters;
+    std::map<std::string, uint> threadCounters; // ThreadCounters slots
+    uint firstSlot = 0, slotCount = 0;
+    std::vector<Relocation> relocations;
+    std::vector<uint> frameSites; // code addresses in frames
+    std::map<uint, std::unique_ptr<Function>> batchDrivers; // by arity
+    static std::mutex batchMutex;                           // guards batchDrivers
+
+    // Sites patched to a Function, kept on both sides so that either can
+    // move: the targets of this function's sites, and the sites of other
+    // functions (or this one) patched to it.
+    std::map<uint, Function *> patchTargets;
+    mutable std::vector<std::pair<Function *, uint>> patchers;
 
 public:
     Function();
 
     Function(Function &&f);
 
+    ~Function();
+
     Function &operator=(Function &&f);
 
     int invoke(int n = 0, ...);
     int invoke(const std::vector<int> &args);
 
+    // Calls the function once for each of count tuples of arity ints packed
+    // in args and stores the results; the loop runs in generated code, so
+    // the whole batch costs a single transition into native code. The loop
+    // is compiled on the first call with a given arity and kept; threads may
+    // call this concurrently.
+    void invokeBatch(uint arity, const int *args, int *results, uint count);
+
+    // Redirects a site emitted with Compiler::patchableCall/patchableJmp.
+    // The displacement is swapped with a single aligned store, so threads
+    // running the code observe either the old or the new target. The old
+    // target must stay alive until no thread can be executing it. The site
+    // keeps reaching the target when either function's code moves; a raw
+    // address is not followed when the code at it moves.
+    void patch(const std::string &site, const Function &target);
+    void patch(const std::string &site, const void *target);
+
+    // Counters of a module compiled with instrumentation, keyed by the
+    // function or label they count.
+    uint counter(const std::string &name) const;
+    std::map<std::string, uint> getCounters() const;
+    void resetCounters();
+
     byte *getCode();
 
+    // Entry point of a function defined in the module, for modules holding
+    // several (linked or loaded from an object).
+    byte *getCode(const std::string &name);
+
     std::string dump();
 
+    // Moves every section to newly allocated memory and reapplies the
+    // relocations, so the code keeps working at its new address; unwind
+    // information, profiler ranges and sites patched to the function follow
+    // it. Other references into the function from outside (addresses given
+    // to Compiler::relocate, saved pointers) are not updated, and no thread
+    // may be running the code.
+    // Returns the number of bytes moved.
+    uint reallocate();
+
+    // Moves the code alone to dst, which the function does not own (see
+    // CodeHeap) and which may overlap the current code.
+    uint reallocate(byte *dst);
+
 private:
     Function(const ByteArray &code);
     Function(ByteArray &&code);
+
+    // Hands the .eh_frame data of the code to the unwinder; it stays
+    // registered until the function is destroyed or overwritten.
+    void registerFrames(ByteArray &&frames);
+    void deregisterFrames();
+
+    void releaseSlots();
+
+    // Drops the links of patched sites from and to this function; adopt
+    // takes over those of a function moved into this one.
+    void unlinkPatches();
+    void adoptPatches(Function &f);
+
+    Function &batchDriver(uint arity);
+
+    ByteArray &section(Section section);
+
+    // Follows moves of the sections by deltas in the relocations, the
+    // unwind information (deregistered by the caller) and the profiler.
+    void relocate(const int *deltas);
 };
 }
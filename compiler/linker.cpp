@@ -0,0 +1,218 @@
+#include "linker.h"
+
+#include <set>
+#include <algorithm>
+
+namespace x86 {
+
+void Linker::add(const Compiler &module) {
+    modules << &module;
+}
+
+Compiler Linker::merge() const {
+    std::set<std::string> globals;
+    std::set<std::string> externs;
+
+    for (const Compiler *module : modules) {
+        for (const std::string &func : module->funcs)
+            if (!globals.insert(func).second)
+                throw std::runtime_error("function '" + func + "' is defined in more than one module");
+
+        for (auto &symbol : module->symbols)
+            if (symbol.second.baseSymbol.empty() || symbol.second.baseSymbol == "_" + symbol.first)
+                externs.insert(symbol.first);
+    }
+
+    for (const Compiler *module : modules)
+        for (auto &symbol : module->symbols)
+            if (externs.count(symbol.first) && symbol.second.baseSymbol[0] == '.' && symbol.second.baseSymbol != ".text")
+                if (!globals.insert(symbol.first).second)
+                    throw std::runtime_error("variable '" + symbol.first + "' is defined in more than one module");
+
+    Compiler result;
+
+    // Values given to relocate() in the modules, and the original site of
+    // every reference that already carries its value.
+    std::map<std::string, int> values;
+    std::set<uint> applied;
+    std::vector<const byte *> sites;
+
+    for (uint k = 0; k < modules.size(); k++) {
+        const Compiler &module = *modules[k];
+
+        for (auto &value : module.resolved) {
+            auto known = values.find(value.first);
+
+            if (known != values.end() && known->second != value.second)
+                throw std::runtime_error("symbol '" + value.first + "' is relocated to different values");
+
+            values[value.first] = value.second;
+        }
+
+        // Only the module's functions and the variables other modules
+        // refer to keep their names; everything else is module-local.
+        std::set<std::string> exports(module.funcs.begin(), module.funcs.end());
+
+        for (auto &symbol : module.symbols)
+            if (externs.count(symbol.first) && symbol.second.baseSymbol[0] == '.' && symbol.second.baseSymbol != ".text")
+                exports.insert(symbol.first);
+
+        std::map<std::string, uint> bases;
+
+        for (auto &section : module.sections) {
+            ByteArray &target = result.section(section.first);
+
+            if (section.first == Compiler::TEXT)
+                result.pad((16 - target.size() % 16) % 16);
+            else {
+                uint padding = (4 - target.size() % 4) % 4;
+                memset(target.allocate(padding), 0, padding);
+            }
+
+            bases[Compiler::sectionName(section.first)] = target.size();
+            target.push(section.second);
+        }
+
+        // Module-local symbols keep their names unless they clash with a
+        // symbol of any other module, in which case they get a unique suffix.
+        std::map<std::string, std::string> names;
+
+        auto unique = [&](const std::string &name) {
+            std::string candidate = name;
+
+            for (uint i = k; result.isSymbolDefined(candidate) || globals.count(candidate) || externs.count(candidate); i++)
+                candidate = name + "@" + toString(i, 10, 0);
+
+            return candidate;
+        };
+
+        auto local = [&](const std::string &name) {
+            return names.find(name) != names.end() ? names.at(name) : name;
+        };
+
+        std::set<std::string> counterSymbols;
+
+        for (const std::string &counter : module.counters)
+            counterSymbols.insert("__count_" + counter);
+
+        for (auto &symbol : module.symbols) {
+            const std::string &base = symbol.second.baseSymbol;
+
+            if (counterSymbols.count(symbol.first))
+                continue;
+
+            if (base.empty() || base == "_" + symbol.first) {
+                if (!globals.count(symbol.first) && !result.isSymbolDefined(symbol.first))
+                    result.pushSymbol(symbol.first, base, 0);
+            } else {
+                if (!exports.count(symbol.first))
+                    names[symbol.first] = unique(symbol.first);
+
+                result.pushSymbol(local(symbol.first), base, bases.at(base) + symbol.second.offset);
+            }
+        }
+
+        for (const std::string &counter : module.counters) {
+            const Compiler::Symbol &symbol = module.symbols.at("__count_" + counter);
+
+            result.pushSymbol("__count_" + local(counter), ".bss", bases.at(".bss") + symbol.offset);
+            result.counters << local(counter);
+        }
+
+        // Per-thread counters are named after their label, which may have
+        // been renamed.
+        for (const std::string &counter : module.threadCounters) {
+            names["__tcount_" + counter] = "__tcount_" + local(counter);
+            result.threadCounters << local(counter);
+
+            if (!result.isSymbolDefined("__tcount_" + local(counter)))
+                result.pushSymbol("__tcount_" + local(counter), "", 0);
+        }
+
+        for (auto &reloc : module.relocs) {
+            if (module.resolved.find(reloc.name) != module.resolved.end()) {
+                applied.insert(result.relocs.size());
+                sites << module.section(reloc.section).data() + reloc.offset;
+            } else
+                sites << nullptr;
+
+            result.pushReloc({ local(reloc.name), reloc.type, bases[Compiler::sectionName(reloc.section)] + reloc.offset, reloc.section });
+        }
+
+        for (auto &table : module.unwindTables)
+            result.unwindTables.push_back({ local(table.begin), local(table.end), table.initial, table.rows });
+
+        for (auto &site : module.patchSites) {
+            if (result.patchSites.find(site.first) != result.patchSites.end())
+                throw std::runtime_error("patch site '" + site.first + "' is defined in more than one module");
+
+            result.patchSites[site.first] = bases[".text"] + site.second;
+        }
+
+        for (auto &alignment : module.alignments)
+            result.alignments[bases[".text"] + alignment.first] = alignment.second;
+
+        for (const std::string &func : module.funcs)
+            result.funcs << func;
+
+        result.folded.insert(module.folded.begin(), module.folded.end());
+    }
+
+    // References resolved before the merge keep their value; relative ones
+    // are rebased to their new site. The same names in the other modules
+    // get the value now, so that link() need not resolve them again.
+    for (uint i = 0; i < result.relocs.size(); i++) {
+        const Compiler::Reloc &reloc = result.relocs[i];
+        byte *site = result.section(reloc.section).data() + reloc.offset;
+        auto value = values.find(reloc.name);
+
+        if (applied.count(i)) {
+            if (reloc.type == Compiler::RefRel)
+                *reinterpret_cast<int *>(site) += sites[i] - site;
+        } else if (value == values.end() || result.symbols.at(reloc.name).baseSymbol[0] == '.')
+            continue;
+        else if (reloc.type == Compiler::RefAbs)
+            *reinterpret_cast<int *>(site) += value->second;
+        else
+            *reinterpret_cast<int *>(site) += value->second - reinterpret_cast<int>(site + 4);
+    }
+
+    result.resolved = values;
+
+    for (const Compiler *module : modules) {
+        for (const std::string &func : module->externFuncs)
+            if (!globals.count(func) && find(result.externFuncs.begin(), result.externFuncs.end(), func) == result.externFuncs.end())
+                result.externFuncs << func;
+
+        for (const std::string &var : module->externVars)
+            if (!globals.count(var) && find(result.externVars.begin(), result.externVars.end(), var) == result.externVars.end())
+                result.externVars << var;
+    }
+
+    return result;
+}
+
+ByteArray Linker::writeOBJ() const {
+    return merge().writeOBJ();
+}
+
+Function Linker::link(const Resolver &resolver) const {
+    Compiler module = merge();
+
+    for (auto &symbol : module.symbols) {
+        const std::string &base = symbol.second.baseSymbol;
+
+        if ((!base.empty() && base[0] == '.') || module.resolved.find(symbol.first) != module.resolved.end())
+            continue;
+
+        int value = resolver ? resolver(symbol.first) : 0;
+
+        if (!value)
+            throw std::runtime_error("unresolved symbol '" + symbol.first + "'");
+
+        module.relocate(symbol.first, value);
+    }
+
+    return module.compileFunction();
+}
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <functional>
+
+#include "compiler.h"
+
+namespace x86 {
+
+// Combines several Compiler modules in memory: sections are concatenated,
+// functions and variables referenced through externalFunction/externalVariable
+// (or plain SymRefs) are resolved between modules, and the result is either
+// a single module for writeOBJ or a ready to run Function.
+class Linker {
+    std::vector<const Compiler *> modules;
+
+public:
+    typedef std::function<int(const std::string &)> Resolver;
+
+    void add(const Compiler &module);
+
+    Compiler merge() const;
+
+    ByteArray writeOBJ() const;
+
+    // Symbols left undefined by all modules are looked up with the resolver.
+    Function link(const Resolver &resolver = Resolver()) const;
+};
+}
@@ -0,0 +1,46 @@
+#include "multiversion.h"
+
+#include <algorithm>
+
+namespace x86 {
+
+Multiversion::Multiversion(const Generator &generator, TargetLevel maxLevel) {
+    TargetLevel best = std::min(maxLevel, Compiler::hostLevel());
+
+    variants.reserve(best + 1);
+
+    for (int i = Baseline; i <= best; i++) {
+        Compiler c;
+        c.setTarget(static_cast<TargetLevel>(i));
+        generator(c);
+        variants.push_back(c.compileFunction());
+    }
+
+    Compiler c;
+    c.function("entry");
+    c.patchableJmp("variant", c.rel("entry"));
+    entry = c.compileFunction();
+
+    select(best);
+}
+
+void Multiversion::select(TargetLevel level) {
+    entry.patch("variant", variant(level));
+    this->level = level;
+}
+
+TargetLevel Multiversion::getLevel() const {
+    return level;
+}
+
+Function &Multiversion::variant(TargetLevel level) {
+    if (static_cast<uint>(level) >= variants.size())
+        throw std::runtime_error("target level is not supported by the host");
+
+    return variants[level];
+}
+
+Function &Multiversion::getEntry() {
+    return entry;
+}
+}
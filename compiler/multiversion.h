@@ -0,0 +1,31 @@
+#pragma once
+
+#include <functional>
+
+#include "compiler.h"
+
+namespace x86 {
+
+// One generator compiled for every TargetLevel up to the best the host
+// supports. Calls go through a fixed entry point that jumps to the selected
+// variant, so its address can be handed out once and stays valid when
+// select() switches variants.
+class Multiversion {
+    std::vector<Function> variants;
+    Function entry;
+    TargetLevel level;
+
+public:
+    typedef std::function<void(Compiler &)> Generator;
+
+    // generator receives a Compiler already set to the level being built
+    // and must emit the entry function first.
+    explicit Multiversion(const Generator &generator, TargetLevel maxLevel = AVX512);
+
+    void select(TargetLevel level);
+    TargetLevel getLevel() const;
+
+    Function &variant(TargetLevel level);
+    Function &getEntry();
+};
+}
@@ -0,0 +1,223 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__linux__) && defined(__i386__)
+#include <csignal>
+#include <ctime>
+#include <ucontext.h>
+
+#define PROFILER_SUPPORTED
+#endif
+
+namespace x86 {
+
+Profiler::Range Profiler::ranges[Profiler::maxRanges];
+uint Profiler::rangeCount = 0;
+uint Profiler::unknownSamples = 0;
+std::mutex Profiler::mutex;
+
+#ifdef PROFILER_SUPPORTED
+static struct sigaction previous;
+static timer_t timer;
+static bool running = false;
+
+static void handler(int, siginfo_t *, void *context) {
+    Profiler::sample(static_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_EIP]);
+}
+#endif
+
+bool Profiler::start(uint frequency) {
+    if (frequency == 0)
+        return false;
+
+#ifdef PROFILER_SUPPORTED
+    if (running)
+        stop();
+
+    struct sigaction action = {};
+
+    action.sa_sigaction = handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGPROF, &action, &previous) != 0)
+        return false;
+
+    // The CPU-time timers (ITIMER_PROF, CLOCK_PROCESS_CPUTIME_ID) only fire
+    // on kernel ticks, typically 250 Hz, whatever frequency is asked for; a
+    // monotonic timer keeps the rate, at the price of sampling wall time.
+    sigevent event = {};
+
+    event.sigev_notify = SIGEV_SIGNAL;
+    event.sigev_signo = SIGPROF;
+
+    if (timer_create(CLOCK_MONOTONIC, &event, &timer) != 0) {
+        sigaction(SIGPROF, &previous, 0);
+        return false;
+    }
+
+    running = true;
+
+    itimerspec interval = {};
+
+    interval.it_interval.tv_sec = 1 / frequency;
+    interval.it_interval.tv_nsec = 1000000000 / frequency % 1000000000;
+    interval.it_value = interval.it_interval;
+
+    if (timer_settime(timer, 0, &interval, 0) != 0) {
+        stop();
+        return false;
+    }
+
+    return true;
+#else
+    (void)frequency;
+    return false;
+#endif
+}
+
+void Profiler::stop() {
+#ifdef PROFILER_SUPPORTED
+    if (!running)
+        return;
+
+    timer_delete(timer);
+    running = false;
+
+    sigaction(SIGPROF, &previous, 0);
+#endif
+}
+
+void Profiler::registerFunction(const Function &f) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::vector<std::pair<uint, std::string>> bounds;
+
+    for (auto &symbol : f.symbols)
+        bounds.push_back({ symbol.second, symbol.first });
+
+    std::sort(bounds.begin(), bounds.end());
+
+    if (bounds.empty() || bounds.front().first > 0)
+        bounds.insert(bounds.begin(), { 0, "" });
+
+    // Slots of unregistered functions are reused before the table grows.
+    std::vector<uint> slots;
+
+    for (uint i = 0; i < rangeCount && slots.size() < bounds.size(); i++)
+        if (!ranges[i].function)
+            slots.push_back(i);
+
+    if (rangeCount + bounds.size() - slots.size() > maxRanges)
+        throw std::runtime_error("profiler range table is full");
+
+    uint count = rangeCount;
+
+    while (slots.size() < bounds.size())
+        slots.push_back(count++);
+
+    uint base = reinterpret_cast<uint>(f.code.data());
+
+    // A slot's end is stored last: until then the handler sees the slot as
+    // empty, whichever of the old and new begin it reads.
+    for (uint i = 0; i < bounds.size(); i++) {
+        Range &range = ranges[slots[i]];
+
+        __atomic_store_n(&range.end, 0, __ATOMIC_RELAXED);
+        range.function = &f;
+        range.symbol = bounds[i].second;
+        __atomic_store_n(&range.begin, base + bounds[i].first, __ATOMIC_RELAXED);
+        __atomic_store_n(&range.samples, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&range.end, base + (i + 1 < bounds.size() ? bounds[i + 1].first : f.code.size()), __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&rangeCount, count, __ATOMIC_RELEASE);
+}
+
+void Profiler::unregisterFunction(const Function &f) {
+    // Every Function unregisters when it dies; most never were registered.
+    if (__atomic_load_n(&rangeCount, __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (uint i = 0; i < rangeCount; i++)
+        if (ranges[i].function == &f) {
+            __atomic_store_n(&ranges[i].end, 0, __ATOMIC_RELAXED);
+            ranges[i].function = 0;
+        }
+
+    while (rangeCount > 0 && !ranges[rangeCount - 1].function)
+        __atomic_store_n(&rangeCount, rangeCount - 1, __ATOMIC_RELEASE);
+}
+
+void Profiler::replaceFunction(const Function &from, const Function &to) {
+    if (__atomic_load_n(&rangeCount, __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (uint i = 0; i < rangeCount; i++)
+        if (ranges[i].function == &from)
+            ranges[i].function = &to;
+}
+
+void Profiler::moveFunction(const Function &f, int delta) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (uint i = 0; i < rangeCount; i++)
+        if (ranges[i].function == &f) {
+            uint end = ranges[i].end;
+
+            __atomic_store_n(&ranges[i].end, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&ranges[i].begin, ranges[i].begin + delta, __ATOMIC_RELAXED);
+            __atomic_store_n(&ranges[i].end, end + delta, __ATOMIC_RELEASE);
+        }
+}
+
+std::vector<Profiler::Entry> Profiler::report(uint n) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::vector<Entry> entries;
+
+    for (uint i = 0; i < rangeCount; i++)
+        if (ranges[i].function)
+            entries.push_back({ ranges[i].function, ranges[i].symbol, __atomic_load_n(&ranges[i].samples, __ATOMIC_RELAXED) });
+
+    std::stable_sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.samples > b.samples;
+    });
+
+    if (entries.size() > n)
+        entries.resize(n);
+
+    return entries;
+}
+
+ulong Profiler::unattributed() {
+    return __atomic_load_n(&unknownSamples, __ATOMIC_RELAXED);
+}
+
+void Profiler::reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (uint i = 0; i < rangeCount; i++)
+        __atomic_store_n(&ranges[i].samples, 0, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&unknownSamples, 0, __ATOMIC_RELAXED);
+}
+
+void Profiler::sample(uint pc) {
+    uint count = __atomic_load_n(&rangeCount, __ATOMIC_ACQUIRE);
+
+    for (uint i = 0; i < count; i++)
+        if (pc >= ranges[i].begin && pc < __atomic_load_n(&ranges[i].end, __ATOMIC_RELAXED)) {
+            __atomic_fetch_add(&ranges[i].samples, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+    __atomic_fetch_add(&unknownSamples, 1, __ATOMIC_RELAXED);
+}
+}
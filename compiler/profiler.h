@@ -0,0 +1,62 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "function.h"
+
+namespace x86 {
+
+// SIGPROF-based sampler attributing samples to the symbols of registered
+// functions. Samples follow wall-clock time, so time spent blocked counts
+// as unattributed. The signal handler only scans the range table and bumps
+// a counter with an atomic add, so sampling never takes a lock. Functions
+// unregister themselves when destroyed, and their slots are reused.
+class Profiler {
+public:
+    struct Entry {
+        const Function *function;
+        std::string symbol;
+        ulong samples;
+    };
+
+private:
+    struct Range {
+        const Function *function;
+        std::string symbol;
+        uint begin, end;
+        uint samples;
+    };
+
+    static const uint maxRanges = 4096;
+
+    static Range ranges[maxRanges];
+    static uint rangeCount;
+    static uint unknownSamples;
+    static std::mutex mutex;
+
+public:
+    // Returns false if sampling is unsupported or frequency is 0. stop()
+    // puts back the SIGPROF handler that start() replaced.
+    static bool start(uint frequency = 1000);
+    static void stop();
+
+    static void registerFunction(const Function &f);
+    static void unregisterFunction(const Function &f);
+
+    // Points the ranges of a function at the Function it was moved into.
+    static void replaceFunction(const Function &from, const Function &to);
+
+    // Shifts the ranges of a function whose code moved by delta bytes.
+    // Samples taken meanwhile count as unattributed.
+    static void moveFunction(const Function &f, int delta);
+
+    static std::vector<Entry> report(uint n);
+    static ulong unattributed();
+    static void reset();
+
+    // Called from the signal handler with the interrupted program counter.
+    static void sample(uint pc);
+};
+}
@@ -0,0 +1,779 @@
+#include "regex.h"
+
+#include <algorithm>
+
+namespace x86 {
+
+Regex::Regex(const std::string &pattern)
+    : pattern(pattern), pos(0) {
+    Node root = parseAlternation();
+
+    if (pos < pattern.size())
+        error("unmatched ')'");
+
+    bool complete;
+    prefix = literalPrefix(root, &complete);
+
+    uint accept = addState(Accept, 0);
+    start = build(root, accept);
+
+    std::vector<uint> initial(1, start);
+    closure(initial, true, true);
+    matchesEmpty = std::find(initial.begin(), initial.end(), accept) != initial.end();
+
+    computeClasses();
+    buildDFA();
+
+    Compiler c;
+    generate(c, Compiler::hostFeatures().sse2);
+    code = c.compileFunction();
+    matcher = reinterpret_cast<int (*)(const char *, uint)>(code.getCode());
+}
+
+bool Regex::match(const char *text, size_t size) const {
+    return matcher(text, size) != 0;
+}
+
+bool Regex::match(const std::string &text) const {
+    return match(text.data(), text.size());
+}
+
+const std::string &Regex::getPattern() const {
+    return pattern;
+}
+
+uint Regex::stateCount() const {
+    return dfa.size();
+}
+
+Regex::Node Regex::parseAlternation() {
+    Node first = parseConcat();
+
+    if (pos >= pattern.size() || pattern[pos] != '|')
+        return first;
+
+    Node alternation = node(Alternation);
+    alternation.children.push_back(first);
+
+    while (pos < pattern.size() && pattern[pos] == '|') {
+        pos++;
+        alternation.children.push_back(parseConcat());
+    }
+
+    return alternation;
+}
+
+Regex::Node Regex::parseConcat() {
+    Node concat = node(Concat);
+
+    while (pos < pattern.size() && pattern[pos] != '|' && pattern[pos] != ')')
+        concat.children.push_back(parseRepeat());
+
+    if (concat.children.empty())
+        return node(Empty);
+
+    if (concat.children.size() == 1)
+        return concat.children[0];
+
+    return concat;
+}
+
+Regex::Node Regex::parseRepeat() {
+    Node atom = parseAtom();
+
+    while (pos < pattern.size()) {
+        uint min, max;
+        char ch = pattern[pos];
+
+        if (ch == '*') {
+            min = 0;
+            max = REPEAT_INFINITE;
+            pos++;
+        } else if (ch == '+') {
+            min = 1;
+            max = REPEAT_INFINITE;
+            pos++;
+        } else if (ch == '?') {
+            min = 0;
+            max = 1;
+            pos++;
+        } else if (ch == '{' && pos + 1 < pattern.size() && isdigit(pattern[pos + 1])) {
+            pos++;
+            min = max = parseNumber();
+
+            if (pos < pattern.size() && pattern[pos] == ',') {
+                pos++;
+                max = pos < pattern.size() && pattern[pos] == '}' ? REPEAT_INFINITE : parseNumber();
+            }
+
+            if (pos >= pattern.size() || pattern[pos] != '}')
+                error("expected '}'");
+
+            pos++;
+
+            if (max < min)
+                error("repeat range out of order");
+        } else
+            break;
+
+        if (pos < pattern.size() && pattern[pos] == '?')
+            pos++;
+
+        Node repeat = node(Repeat);
+        repeat.children.push_back(atom);
+        repeat.min = min;
+        repeat.max = max;
+        atom = repeat;
+    }
+
+    return atom;
+}
+
+Regex::Node Regex::parseAtom() {
+    char ch = pattern[pos++];
+
+    switch (ch) {
+    case '(': {
+        if (pos < pattern.size() && pattern[pos] == '?') {
+            if (pos + 1 >= pattern.size() || pattern[pos + 1] != ':')
+                error("unsupported group");
+
+            pos += 2;
+        }
+
+        Node group = parseAlternation();
+
+        if (pos >= pattern.size())
+            error("expected ')'");
+
+        pos++;
+        return group;
+    }
+
+    case '[':
+        return charNode(parseClass());
+
+    case '.':
+        // ECMAScript's '.' excludes every line terminator, not just '\n'.
+        return charNode(~CharSet().set('\n').set('\r'));
+
+    case '^':
+        return node(Begin);
+
+    case '$':
+        return node(End);
+
+    case '\\':
+        return charNode(parseEscape(false));
+
+    case '*':
+    case '+':
+    case '?':
+        pos--;
+        error("nothing to repeat");
+
+    default:
+        return charNode(CharSet().set(static_cast<byte>(ch)));
+    }
+}
+
+Regex::CharSet Regex::parseClass() {
+    bool negate = pos < pattern.size() && pattern[pos] == '^';
+
+    if (negate)
+        pos++;
+
+    CharSet set;
+
+    while (true) {
+        if (pos >= pattern.size())
+            error("expected ']'");
+
+        char ch = pattern[pos++];
+
+        if (ch == ']')
+            break;
+
+        CharSet first = ch == '\\' ? parseEscape(true) : CharSet().set(static_cast<byte>(ch));
+
+        if (first.count() != 1 || pos + 1 >= pattern.size() || pattern[pos] != '-' || pattern[pos + 1] == ']') {
+            set |= first;
+            continue;
+        }
+
+        pos++;
+        ch = pattern[pos++];
+
+        CharSet last = ch == '\\' ? parseEscape(true) : CharSet().set(static_cast<byte>(ch));
+
+        if (last.count() != 1)
+            error("invalid range");
+
+        uint lo = 0, hi = 0;
+
+        while (!first[lo])
+            lo++;
+
+        while (!last[hi])
+            hi++;
+
+        if (hi < lo)
+            error("range out of order");
+
+        for (uint i = lo; i <= hi; i++)
+            set.set(i);
+    }
+
+    return negate ? ~set : set;
+}
+
+Regex::CharSet Regex::parseEscape(bool inClass) {
+    if (pos >= pattern.size())
+        error("trailing '\\'");
+
+    char ch = pattern[pos++];
+    CharSet set;
+
+    switch (ch) {
+    case 'd':
+    case 'D':
+        for (uint i = '0'; i <= '9'; i++)
+            set.set(i);
+
+        return ch == 'd' ? set : ~set;
+
+    case 'w':
+    case 'W':
+        for (uint i = 0; i < 256; i++)
+            if (isalnum(i) || i == '_')
+                set.set(i);
+
+        return ch == 'w' ? set : ~set;
+
+    case 's':
+    case 'S':
+        for (char space : std::string(" \t\n\r\f\v"))
+            set.set(static_cast<byte>(space));
+
+        return ch == 's' ? set : ~set;
+
+    case 't':
+        return set.set('\t');
+
+    case 'n':
+        return set.set('\n');
+
+    case 'r':
+        return set.set('\r');
+
+    case 'f':
+        return set.set('\f');
+
+    case 'v':
+        return set.set('\v');
+
+    case '0':
+        return set.set(0);
+
+    case 'b':
+        if (!inClass)
+            error("unsupported escape '\\b'");
+
+        return set.set('\b');
+
+    case 'x': {
+        if (pos + 2 > pattern.size() || !isxdigit(pattern[pos]) || !isxdigit(pattern[pos + 1]))
+            error("invalid '\\x' escape");
+
+        uint value = std::stoi(pattern.substr(pos, 2), nullptr, 16);
+        pos += 2;
+        return set.set(value);
+    }
+
+    default:
+        if (isalnum(ch)) {
+            pos--;
+            error(std::string("unsupported escape '\\") + ch + "'");
+        }
+
+        return set.set(static_cast<byte>(ch));
+    }
+}
+
+uint Regex::parseNumber() {
+    uint value = 0;
+
+    if (pos >= pattern.size() || !isdigit(pattern[pos]))
+        error("expected a number");
+
+    while (pos < pattern.size() && isdigit(pattern[pos])) {
+        value = value * 10 + pattern[pos++] - '0';
+
+        if (value > 1000)
+            error("repeat count too large");
+    }
+
+    return value;
+}
+
+void Regex::error(const std::string &message) const {
+    throw std::runtime_error("invalid regex '" + pattern + "' at " + toString(pos, 10, 0) + ": " + message);
+}
+
+Regex::Node Regex::node(NodeKind kind) {
+    Node n;
+    n.kind = kind;
+    n.min = n.max = 0;
+    return n;
+}
+
+Regex::Node Regex::charNode(const CharSet &set) {
+    Node n = node(Set);
+    n.set = set;
+    return n;
+}
+
+// The literal every match starts with; complete is set when it is all the
+// node matches.
+std::string Regex::literalPrefix(const Node &node, bool *complete) {
+    *complete = true;
+
+    switch (node.kind) {
+    case Set:
+        if (node.set.count() != 1) {
+            *complete = false;
+            return "";
+        }
+
+        for (uint i = 0;; i++)
+            if (node.set[i])
+                return std::string(1, static_cast<char>(i));
+
+    case Concat: {
+        std::string result;
+
+        for (const Node &child : node.children) {
+            result += literalPrefix(child, complete);
+
+            if (!*complete)
+                break;
+        }
+
+        return result;
+    }
+
+    case Alternation: {
+        bool all;
+        std::string result = literalPrefix(node.children[0], &all);
+
+        for (uint i = 1; i < node.children.size(); i++) {
+            bool c;
+            std::string p = literalPrefix(node.children[i], &c);
+
+            if (p != result || !c)
+                all = false;
+
+            uint n = 0;
+
+            while (n < result.size() && n < p.size() && result[n] == p[n])
+                n++;
+
+            result.resize(n);
+        }
+
+        *complete = all;
+        return result;
+    }
+
+    case Repeat: {
+        if (node.min == 0) {
+            *complete = node.max == 0;
+            return "";
+        }
+
+        std::string result = literalPrefix(node.children[0], complete);
+        *complete = *complete && node.min == 1 && node.max == 1;
+        return result;
+    }
+
+    default:
+        return "";
+    }
+}
+
+uint Regex::addState(StateKind kind, uint out, uint out1) {
+    if (nfa.size() >= MAX_NFA_STATES)
+        throw std::runtime_error("regex '" + pattern + "' is too large");
+
+    NFAState state;
+    state.kind = kind;
+    state.set = 0;
+    state.out = out;
+    state.out1 = out1;
+
+    nfa.push_back(state);
+    return nfa.size() - 1;
+}
+
+// Thompson construction, back to front: returns the entry of a fragment
+// for node that continues at next.
+uint Regex::build(const Node &node, uint next) {
+    switch (node.kind) {
+    case Empty:
+        return next;
+
+    case Set: {
+        uint state = addState(Consume, next);
+        nfa[state].set = sets.size();
+        sets.push_back(node.set);
+        return state;
+    }
+
+    case Concat:
+        for (uint i = node.children.size(); i-- > 0;)
+            next = build(node.children[i], next);
+
+        return next;
+
+    case Alternation: {
+        uint entry = build(node.children.back(), next);
+
+        for (uint i = node.children.size() - 1; i-- > 0;)
+            entry = addState(Split, build(node.children[i], next), entry);
+
+        return entry;
+    }
+
+    case Repeat: {
+        uint entry = next;
+
+        if (node.max == REPEAT_INFINITE) {
+            entry = addState(Split, 0, next);
+
+            uint body = build(node.children[0], entry);
+            nfa[entry].out = body;
+        } else
+            for (uint i = node.min; i < node.max; i++)
+                entry = addState(Split, build(node.children[0], entry), next);
+
+        for (uint i = 0; i < node.min; i++)
+            entry = build(node.children[0], entry);
+
+        return entry;
+    }
+
+    case Begin:
+        return addState(AssertBegin, next);
+
+    case End:
+        return addState(AssertEnd, next);
+    }
+
+    return next;
+}
+
+// Replaces states by the sorted states reachable from them without
+// consuming input, dropping splits and the assertions that hold.
+void Regex::closure(std::vector<uint> &states, bool begin, bool end) const {
+    std::vector<bool> visited(nfa.size());
+    std::vector<uint> stack = states, result;
+
+    while (!stack.empty()) {
+        uint s = stack.back();
+        stack.pop_back();
+
+        if (visited[s])
+            continue;
+
+        visited[s] = true;
+        const NFAState &state = nfa[s];
+
+        switch (state.kind) {
+        case Split:
+            stack.push_back(state.out1);
+            stack.push_back(state.out);
+            break;
+
+        case AssertBegin:
+            if (begin)
+                stack.push_back(state.out);
+
+            break;
+
+        case AssertEnd:
+            if (end)
+                stack.push_back(state.out);
+            else
+                result.push_back(s);
+
+            break;
+
+        default:
+            result.push_back(s);
+        }
+    }
+
+    std::sort(result.begin(), result.end());
+    states.swap(result);
+}
+
+// Splits the bytes into classes no transition tells apart.
+void Regex::computeClasses() {
+    std::map<std::string, uint> distinct;
+
+    for (const CharSet &set : sets)
+        distinct.insert(std::make_pair(set.to_string(), distinct.size()));
+
+    std::map<std::string, uint> signatures;
+
+    for (uint b = 0; b < 256; b++) {
+        std::string signature;
+
+        for (const auto &set : distinct)
+            signature += set.first[255 - b];
+
+        auto i = signatures.insert(std::make_pair(signature, signatures.size())).first;
+        classes[b] = i->second;
+    }
+
+    classCount = signatures.size();
+}
+
+uint Regex::dfaState(std::vector<uint> states) {
+    auto i = dfaIndex.find(states);
+
+    if (i != dfaIndex.end())
+        return i->second;
+
+    if (dfa.size() >= MAX_DFA_STATES)
+        throw std::runtime_error("regex '" + pattern + "' needs more than " + toString(MAX_DFA_STATES, 10, 0) + " states");
+
+    DFAState state;
+    state.accepting = false;
+
+    for (uint s : states)
+        if (nfa[s].kind == Accept)
+            state.accepting = true;
+
+    std::vector<uint> atEnd = states;
+    closure(atEnd, false, true);
+
+    state.acceptsAtEnd = false;
+
+    for (uint s : atEnd)
+        if (nfa[s].kind == Accept)
+            state.acceptsAtEnd = true;
+
+    state.states = states;
+    dfa.push_back(state);
+
+    return dfaIndex[states] = dfa.size() - 1;
+}
+
+// Subset construction. start is added after every byte, so a match may
+// begin anywhere; accepting states need no transitions, as the search
+// stops at the first match.
+void Regex::buildDFA() {
+    std::vector<uint> initial(1, start);
+    closure(initial, true, false);
+    dfaState(initial);
+
+    uint representatives[256];
+
+    for (uint b = 256; b-- > 0;)
+        representatives[classes[b]] = b;
+
+    for (uint i = 0; i < dfa.size(); i++) {
+        if (dfa[i].accepting || dfa[i].states.empty())
+            continue;
+
+        std::vector<uint> next(classCount);
+
+        for (uint k = 0; k < classCount; k++) {
+            std::vector<uint> moved(1, start);
+
+            for (uint s : dfa[i].states)
+                if (nfa[s].kind == Consume && sets[nfa[s].set][representatives[k]])
+                    moved.push_back(nfa[s].out);
+
+            closure(moved, false, false);
+            next[k] = dfaState(moved);
+        }
+
+        dfa[i].next = next;
+    }
+}
+
+// int match(const char *text, uint size): %esi walks the text up to %edi.
+// When the search is idle and the pattern has a literal prefix, %ebx is
+// the last position a 16-byte load covering the prefix may start at.
+void Regex::generate(Compiler &c, bool simd) const {
+    std::vector<uint> idle(1, start);
+    closure(idle, false, false);
+
+    auto idleState = dfaIndex.find(idle);
+    uint scanState = !simd || prefix.empty() || idleState == dfaIndex.end() ? ~0u : idleState->second;
+
+    c.function("match");
+    c.push(ESI);
+    c.push(EDI);
+    c.push(EBX);
+    c.mov(c.ref(16, ESP), ESI);
+    c.mov(c.ref(20, ESP), EDI);
+    c.add(ESI, EDI);
+    c.cmp(ESI, EDI);
+    c.j(E, c.rel(matchesEmpty ? "__regexAccept" : "__regexReject"));
+
+    if (scanState != ~0u) {
+        byte first[16], last[16];
+        memset(first, prefix.front(), sizeof(first));
+        memset(last, prefix.back(), sizeof(last));
+
+        c.rdata("__regexFirst", first, sizeof(first));
+        c.movdqu(c.ref(c.abs("__regexFirst")), XMM6);
+
+        if (prefix.size() > 1) {
+            c.rdata("__regexLast", last, sizeof(last));
+            c.movdqu(c.ref(c.abs("__regexLast")), XMM7);
+        }
+
+        c.lea(c.ref(-15 - static_cast<int>(prefix.size()), EDI), EBX);
+    }
+
+    if (dfa[0].accepting || dfa[0].states.empty())
+        c.jmp(c.rel(stateLabel(0)));
+
+    for (uint i = 0; i < dfa.size(); i++) {
+        const DFAState &state = dfa[i];
+
+        if (state.accepting || state.states.empty())
+            continue;
+
+        c.label(stateLabel(i));
+
+        if (i == scanState) {
+            std::string loop = "__regexScan", found = "__regexFound", body = "__regexBody";
+
+            c.cmp(EBX, ESI);
+            c.j(A, c.rel(body));
+            c.label(loop);
+            c.movdqu(c.ref(ESI), XMM0);
+            c.pcmpeqb(XMM6, XMM0);
+
+            if (prefix.size() > 1) {
+                c.movdqu(c.ref(static_cast<int>(prefix.size()) - 1, ESI), XMM1);
+                c.pcmpeqb(XMM7, XMM1);
+                c.pand(XMM1, XMM0);
+            }
+
+            c.pmovmskb(XMM0, EAX);
+            c.test(EAX, EAX);
+            c.j(NE, c.rel(found));
+            c.add(16, ESI);
+            c.cmp(EBX, ESI);
+            c.j(BE, c.rel(loop));
+            c.jmp(c.rel(body));
+            c.label(found);
+            c.bsf(EAX, EAX);
+            c.add(EAX, ESI);
+            c.label(body);
+        }
+
+        c.cmp(EDI, ESI);
+        c.j(AE, c.rel(state.acceptsAtEnd ? "__regexAccept" : "__regexReject"));
+        c.movzbl(c.ref(ESI), EAX);
+        c.inc(ESI);
+
+        uint next = i + 1;
+
+        while (next < dfa.size() && (dfa[next].accepting || dfa[next].states.empty()))
+            next++;
+
+        generateDispatch(c, state, next < dfa.size() ? stateLabel(next) : "");
+    }
+
+    c.label("__regexAccept");
+    c.mov(1, EAX);
+    c.pop(EBX);
+    c.pop(EDI);
+    c.pop(ESI);
+    c.ret();
+
+    c.label("__regexReject");
+    c._xor(EAX, EAX);
+    c.pop(EBX);
+    c.pop(EDI);
+    c.pop(ESI);
+    c.ret();
+}
+
+// Jumps on the byte in %eax. The most common target is the fallthrough;
+// a few byte ranges are compared directly, more go through _switch, which
+// dispatches dense cases through a jump table.
+void Regex::generateDispatch(Compiler &c, const DFAState &state, const std::string &next) const {
+    std::string targets[256];
+    std::map<std::string, uint> counts;
+
+    for (uint b = 0; b < 256; b++)
+        counts[targets[b] = stateLabel(state.next[classes[b]])]++;
+
+    std::string fallthrough;
+    uint most = 0;
+
+    for (const auto &count : counts)
+        if (count.second > most || (count.second == most && count.first == next)) {
+            fallthrough = count.first;
+            most = count.second;
+        }
+
+    struct Range {
+        uint lo, hi;
+        std::string target;
+    };
+
+    std::vector<Range> ranges;
+
+    for (uint b = 0; b < 256; b++)
+        if (targets[b] != fallthrough) {
+            if (!ranges.empty() && ranges.back().hi == b - 1 && ranges.back().target == targets[b])
+                ranges.back().hi = b;
+            else
+                ranges.push_back({ b, b, targets[b] });
+        }
+
+    if (ranges.size() <= 4) {
+        for (const Range &range : ranges)
+            if (range.lo == range.hi) {
+                c.cmp(range.lo, EAX);
+                c.j(E, c.rel(range.target));
+            } else {
+                c.lea(c.ref(-static_cast<int>(range.lo), EAX), EDX);
+                c.cmp(range.hi - range.lo, EDX);
+                c.j(BE, c.rel(range.target));
+            }
+
+        if (fallthrough != next)
+            c.jmp(c.rel(fallthrough));
+
+        return;
+    }
+
+    std::vector<std::pair<int, std::string>> cases;
+
+    for (const Range &range : ranges)
+        for (uint b = range.lo; b <= range.hi; b++)
+            cases.push_back(std::make_pair(b, range.target));
+
+    c._switch(EAX, cases, fallthrough);
+}
+
+std::string Regex::stateLabel(uint index) const {
+    if (dfa[index].accepting)
+        return "__regexAccept";
+
+    if (dfa[index].states.empty())
+        return "__regexReject";
+
+    return "__regexState" + toString(index, 10, 0);
+}
+}
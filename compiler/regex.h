@@ -0,0 +1,123 @@
+#pragma once
+
+#include <bitset>
+
+#include "compiler.h"
+
+namespace x86 {
+
+// A regular expression compiled to native code. The pattern is turned into
+// a Thompson NFA, then a DFA whose states become blocks of code: each
+// compares the next byte against its transitions, or dispatches through a
+// jump table when they are too many. While no match is under way, an SSE2
+// loop skips to the next occurrence of the pattern's literal prefix.
+//
+// match() searches: it is true when some substring matches, like
+// std::regex_search. The syntax is ECMAScript's without captures,
+// backreferences or lookaround: literals, '.' (any byte but \n and \r),
+// classes with ranges and negation, \d \w \s and their negations, \t \n
+// \r \f \v \xHH, groups ("(?:" is accepted), |, * + ? and {n}, {n,},
+// {n,m} (a trailing '?' is ignored, as laziness does not change whether
+// there is a match), and the anchors ^ and $ for the start and end of the
+// text. Bytes are matched as is, so multi-byte characters match as
+// sequences.
+class Regex {
+    typedef std::bitset<256> CharSet;
+
+    enum NodeKind {
+        Empty,
+        Set,
+        Concat,
+        Alternation,
+        Repeat,
+        Begin,
+        End
+    };
+
+    // Parsed pattern; Repeat has max == REPEAT_INFINITE for unbounded
+    // repetition.
+    struct Node {
+        NodeKind kind;
+        CharSet set;
+        std::vector<Node> children;
+        uint min, max;
+    };
+
+    enum StateKind {
+        Consume,
+        Split,
+        AssertBegin,
+        AssertEnd,
+        Accept
+    };
+
+    struct NFAState {
+        StateKind kind;
+        uint set; // index into sets for Consume
+        uint out, out1;
+    };
+
+    struct DFAState {
+        std::vector<uint> states; // Consume, AssertEnd and Accept states of the NFA
+        std::vector<uint> next;   // indexed by byte class
+        bool accepting, acceptsAtEnd;
+    };
+
+    static const uint REPEAT_INFINITE = ~0u;
+    static const uint MAX_NFA_STATES = 10000;
+    static const uint MAX_DFA_STATES = 4096;
+
+    std::string pattern;
+    uint pos;
+
+    std::vector<NFAState> nfa;
+    std::vector<CharSet> sets;
+    uint start;
+
+    byte classes[256];
+    uint classCount;
+    std::vector<DFAState> dfa;
+    std::map<std::vector<uint>, uint> dfaIndex;
+
+    std::string prefix;
+    bool matchesEmpty;
+
+    Function code;
+    int (*matcher)(const char *, uint);
+
+public:
+    explicit Regex(const std::string &pattern);
+
+    bool match(const char *text, size_t size) const;
+    bool match(const std::string &text) const;
+
+    const std::string &getPattern() const;
+    uint stateCount() const;
+
+private:
+    Node parseAlternation();
+    Node parseConcat();
+    Node parseRepeat();
+    Node parseAtom();
+    CharSet parseClass();
+    CharSet parseEscape(bool inClass);
+    uint parseNumber();
+    [[noreturn]] void error(const std::string &message) const;
+
+    static Node node(NodeKind kind);
+    static Node charNode(const CharSet &set);
+    static std::string literalPrefix(const Node &node, bool *complete);
+
+    uint addState(StateKind kind, uint out, uint out1 = 0);
+    uint build(const Node &node, uint next);
+
+    void closure(std::vector<uint> &states, bool begin, bool end) const;
+    void computeClasses();
+    uint dfaState(std::vector<uint> states);
+    void buildDFA();
+
+    void generate(Compiler &c, bool simd) const;
+    void generateDispatch(Compiler &c, const DFAState &state, const std::string &next) const;
+    std::string stateLabel(uint index) const;
+};
+}
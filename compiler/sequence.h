@@ -0,0 +1,362 @@
+#pragma once
+
+#include <type_traits>
+
+#include "stencil.h"
+
+namespace x86 {
+namespace fixed {
+
+// Fixed instruction sequences assembled by the C++ compiler. Thunks,
+// trampolines and other code that never changes are spelled with the
+// mnemonics Compiler uses, in AT&T operand order, and end up as static
+// constexpr bytes with the same encoding Compiler would emit:
+//
+//     typedef Sequence<
+//         push<hole<0>>,
+//         call<rel<1>>,
+//         add<imm<4>, esp>,
+//         ret> Thunk;
+//
+//     Stencil s = Thunk::stencil({"arg", "target"});
+//
+// Operands are registers (reg<EAX> or eax), immediates (imm<n>), memory at
+// a base register plus displacement (ref<EBP, 8>) and holes: hole<n> is the
+// n-th value as an immediate, refHole<n> memory at it and rel<n> a branch
+// to it, each with an optional constant addend.
+// Holes keep their addend in place and are patched by Stencil::copy.
+// Sequences have no labels of their own, so every branch target is a hole.
+// Forms Compiler has no encoding for fail to compile.
+
+template <byte... B>
+struct Bytes {};
+
+template <uint Offset, bool Relative, uint Arg>
+struct HoleAt {};
+
+template <class... H>
+struct Holes {};
+
+template <class B, class H = Holes<>>
+struct Code {
+    typedef B bytes;
+    typedef H holes;
+};
+
+template <class A, class B, uint Shift>
+struct Concat;
+
+template <byte... A, class... H, byte... B, uint... O, bool... R, uint... N, uint Shift>
+struct Concat<Code<Bytes<A...>, Holes<H...>>, Code<Bytes<B...>, Holes<HoleAt<O, R, N>...>>, Shift> {
+    typedef Code<Bytes<A..., B...>, Holes<H..., HoleAt<O + Shift, R, N>...>> type;
+};
+
+template <class C>
+struct Size;
+
+template <byte... B, class H>
+struct Size<Code<Bytes<B...>, H>> {
+    static const uint value = sizeof...(B);
+};
+
+template <class... Instructions>
+struct Join : Code<Bytes<>> {};
+
+template <class First, class... Rest>
+struct Join<First, Rest...> : Concat<Code<typename First::bytes, typename First::holes>,
+                                     Code<typename Join<Rest...>::bytes, typename Join<Rest...>::holes>,
+                                     Size<Code<typename First::bytes, typename First::holes>>::value>::type {};
+
+template <bool C, class A, class B>
+using If = typename std::conditional<C, A, B>::type;
+
+constexpr bool isByte(int value) {
+    return value >= -128 && value <= 127;
+}
+
+constexpr uint argCount() {
+    return 0;
+}
+
+template <class... Rest>
+constexpr uint argCount(uint arg, Rest... rest) {
+    return arg + 1 > argCount(rest...) ? arg + 1 : argCount(rest...);
+}
+
+template <byte... B>
+struct Op : Code<Bytes<B...>> {};
+
+template <int V>
+struct Imm8 : Code<Bytes<byte(V)>> {};
+
+template <int V>
+struct Imm32 : Code<Bytes<byte(V), byte(static_cast<uint>(V) >> 8), byte(static_cast<uint>(V) >> 16), byte(static_cast<uint>(V) >> 24)>> {};
+
+template <bool Relative, uint Arg, int Addend>
+struct Hole32 : Code<typename Imm32<Addend>::bytes, Holes<HoleAt<0, Relative, Arg>>> {};
+
+// Operands.
+
+template <Register R>
+struct reg {};
+
+template <int V>
+struct imm {};
+
+template <uint Arg, int Addend = 0>
+struct hole {};
+
+template <uint Arg, int Addend = 0>
+struct rel {};
+
+template <Register Base, int Disp = 0>
+struct ref {};
+
+template <uint Arg, int Addend = 0>
+struct refHole {};
+
+typedef reg<EAX> eax;
+typedef reg<ECX> ecx;
+typedef reg<EDX> edx;
+typedef reg<EBX> ebx;
+typedef reg<ESP> esp;
+typedef reg<EBP> ebp;
+typedef reg<ESI> esi;
+typedef reg<EDI> edi;
+
+// ModRM (plus SIB and displacement) for reg field R and r/m operand M,
+// chosen the way Compiler::ref picks them.
+template <byte R, class M>
+struct ModRM;
+
+template <byte R, Register Rm>
+struct ModRM<R, reg<Rm>> : Op<0xc0 | R << 3 | Rm> {};
+
+template <byte R, Register Base, int Disp>
+struct ModRM<R, ref<Base, Disp>>
+    : Join<Op<(Disp == 0 && Base != EBP ? 0x00 : isByte(Disp) ? 0x40 : 0x80) | R << 3 | Base>,
+           If<Base == ESP, Op<0x24>, Op<>>,
+           If<Disp == 0 && Base != EBP, Op<>, If<isByte(Disp), Imm8<Disp>, Imm32<Disp>>>> {};
+
+template <byte R, uint Arg, int Addend>
+struct ModRM<R, refHole<Arg, Addend>> : Join<Op<R << 3 | 5>, Hole32<false, Arg, Addend>> {};
+
+// Arithmetic shared by adc, add, and, cmp, or, sbb, sub and xor; Ext is the
+// opcode extension of the immediate forms.
+template <byte Ext, class Src, class Dst>
+struct Alu;
+
+template <byte Ext, int V, Register D>
+struct Alu<Ext, imm<V>, reg<D>>
+    : If<isByte(V), Join<Op<0x83>, ModRM<Ext, reg<D>>, Imm8<V>>,
+         If<D == EAX, Join<Op<Ext << 3 | 5>, Imm32<V>>, Join<Op<0x81>, ModRM<Ext, reg<D>>, Imm32<V>>>> {};
+
+template <byte Ext, uint Arg, int Addend, Register D>
+struct Alu<Ext, hole<Arg, Addend>, reg<D>>
+    : If<D == EAX, Join<Op<Ext << 3 | 5>, Hole32<false, Arg, Addend>>,
+         Join<Op<0x81>, ModRM<Ext, reg<D>>, Hole32<false, Arg, Addend>>> {};
+
+template <byte Ext, int V, class M>
+struct Alu<Ext, imm<V>, M>
+    : If<isByte(V), Join<Op<0x83>, ModRM<Ext, M>, Imm8<V>>, Join<Op<0x81>, ModRM<Ext, M>, Imm32<V>>> {};
+
+template <byte Ext, uint Arg, int Addend, class M>
+struct Alu<Ext, hole<Arg, Addend>, M> : Join<Op<0x81>, ModRM<Ext, M>, Hole32<false, Arg, Addend>> {};
+
+template <byte Ext, Register S, Register D>
+struct Alu<Ext, reg<S>, reg<D>> : Join<Op<Ext << 3 | 1>, ModRM<S, reg<D>>> {};
+
+template <byte Ext, Register S, class M>
+struct Alu<Ext, reg<S>, M> : Join<Op<Ext << 3 | 1>, ModRM<S, M>> {};
+
+template <byte Ext, class M, Register D>
+struct Alu<Ext, M, reg<D>> : Join<Op<Ext << 3 | 3>, ModRM<D, M>> {};
+
+// Instructions.
+
+template <class Src, class Dst>
+struct adc : Alu<2, Src, Dst> {};
+
+template <class Src, class Dst>
+struct add : Alu<0, Src, Dst> {};
+
+template <class Src, class Dst>
+struct _and : Alu<4, Src, Dst> {};
+
+template <class Target>
+struct call : Join<Op<0xff>, ModRM<2, Target>> {};
+
+template <uint Arg, int Addend>
+struct call<rel<Arg, Addend>> : Join<Op<0xe8>, Hole32<true, Arg, Addend>> {};
+
+struct cltd : Op<0x99> {};
+
+template <class Src, class Dst>
+struct cmp : Alu<7, Src, Dst> {};
+
+template <class Dst>
+struct dec : Join<Op<0xff>, ModRM<1, Dst>> {};
+
+template <Register R>
+struct dec<reg<R>> : Op<0x48 + R> {};
+
+template <class Dst>
+struct inc : Join<Op<0xff>, ModRM<0, Dst>> {};
+
+template <Register R>
+struct inc<reg<R>> : Op<0x40 + R> {};
+
+template <Condition C, class Target>
+struct j;
+
+template <Condition C, uint Arg, int Addend>
+struct j<C, rel<Arg, Addend>> : Join<Op<0x0f, 0x80 + C>, Hole32<true, Arg, Addend>> {};
+
+template <class Target>
+struct jmp : Join<Op<0xff>, ModRM<4, Target>> {};
+
+template <uint Arg, int Addend>
+struct jmp<rel<Arg, Addend>> : Join<Op<0xe9>, Hole32<true, Arg, Addend>> {};
+
+template <class Src, class Dst>
+struct lea;
+
+template <class M, Register D>
+struct lea<M, reg<D>> : Join<Op<0x8d>, ModRM<D, M>> {};
+
+struct leave : Op<0xc9> {};
+
+struct lfence : Op<0x0f, 0xae, 0xe8> {};
+
+struct lock : Op<0xf0> {};
+
+struct mfence : Op<0x0f, 0xae, 0xf0> {};
+
+template <class Src, class Dst>
+struct mov;
+
+template <Register S, Register D>
+struct mov<reg<S>, reg<D>> : Join<Op<0x89>, ModRM<S, reg<D>>> {};
+
+template <int V, Register D>
+struct mov<imm<V>, reg<D>> : Join<Op<0xb8 + D>, Imm32<V>> {};
+
+template <uint Arg, int Addend, Register D>
+struct mov<hole<Arg, Addend>, reg<D>> : Join<Op<0xb8 + D>, Hole32<false, Arg, Addend>> {};
+
+template <class M, Register D>
+struct mov<M, reg<D>> : Join<Op<0x8b>, ModRM<D, M>> {};
+
+template <Register S, class M>
+struct mov<reg<S>, M> : Join<Op<0x89>, ModRM<S, M>> {};
+
+template <int V, class M>
+struct mov<imm<V>, M> : Join<Op<0xc7>, ModRM<0, M>, Imm32<V>> {};
+
+template <uint Arg, int Addend, class M>
+struct mov<hole<Arg, Addend>, M> : Join<Op<0xc7>, ModRM<0, M>, Hole32<false, Arg, Addend>> {};
+
+template <class Dst>
+struct neg : Join<Op<0xf7>, ModRM<3, Dst>> {};
+
+struct nop : Op<0x90> {};
+
+template <class Dst>
+struct _not : Join<Op<0xf7>, ModRM<2, Dst>> {};
+
+template <class Src, class Dst>
+struct _or : Alu<1, Src, Dst> {};
+
+struct pause : Op<0xf3, 0x90> {};
+
+template <class Dst>
+struct pop : Join<Op<0x8f>, ModRM<0, Dst>> {};
+
+template <Register R>
+struct pop<reg<R>> : Op<0x58 + R> {};
+
+template <class Src>
+struct push : Join<Op<0xff>, ModRM<6, Src>> {};
+
+template <Register R>
+struct push<reg<R>> : Op<0x50 + R> {};
+
+template <int V>
+struct push<imm<V>> : If<isByte(V), Join<Op<0x6a>, Imm8<V>>, Join<Op<0x68>, Imm32<V>>> {};
+
+template <uint Arg, int Addend>
+struct push<hole<Arg, Addend>> : Join<Op<0x68>, Hole32<false, Arg, Addend>> {};
+
+struct ret : Op<0xc3> {};
+
+template <class Src, class Dst>
+struct sbb : Alu<3, Src, Dst> {};
+
+struct sfence : Op<0x0f, 0xae, 0xf8> {};
+
+template <class Src, class Dst>
+struct sub : Alu<5, Src, Dst> {};
+
+template <class Src, class Dst>
+struct test;
+
+template <int V, Register D>
+struct test<imm<V>, reg<D>> : If<D == EAX, Join<Op<0xa9>, Imm32<V>>, Join<Op<0xf7>, ModRM<0, reg<D>>, Imm32<V>>> {};
+
+template <int V, class M>
+struct test<imm<V>, M> : Join<Op<0xf7>, ModRM<0, M>, Imm32<V>> {};
+
+template <Register S, class M>
+struct test<reg<S>, M> : Join<Op<0x85>, ModRM<S, M>> {};
+
+template <class Src, class Dst>
+struct xchg;
+
+template <Register S, Register D>
+struct xchg<reg<S>, reg<D>>
+    : If<S == EAX, Op<0x90 + D>, If<D == EAX, Op<0x90 + S>, Join<Op<0x87>, ModRM<S, reg<D>>>>> {};
+
+template <class Src, class Dst>
+struct _xor : Alu<6, Src, Dst> {};
+
+// The bytes and holes of a joined sequence, as constexpr arrays. holes has
+// a trailing zero entry so that it is never empty; holeCount excludes it.
+template <class B, class H>
+struct Emit;
+
+template <byte... B, uint... O, bool... R, uint... A>
+struct Emit<Bytes<B...>, Holes<HoleAt<O, R, A>...>> {
+    static_assert(sizeof...(B) != 0, "empty sequence");
+
+    static constexpr uint size = sizeof...(B);
+    static constexpr uint holeCount = sizeof...(O);
+    static constexpr uint argCount = fixed::argCount(A...);
+
+    static constexpr byte code[sizeof...(B)] = {B...};
+    static constexpr Stencil::Hole holes[sizeof...(O) + 1] = {{O, R, A}..., {0, false, 0}};
+
+    // A stencil over the sequence, naming its holes in order.
+    static Stencil stencil(const std::vector<std::string> &args) {
+        return Stencil(code, size, holes, holeCount, args);
+    }
+};
+
+template <byte... B, uint... O, bool... R, uint... A>
+constexpr uint Emit<Bytes<B...>, Holes<HoleAt<O, R, A>...>>::size;
+
+template <byte... B, uint... O, bool... R, uint... A>
+constexpr uint Emit<Bytes<B...>, Holes<HoleAt<O, R, A>...>>::holeCount;
+
+template <byte... B, uint... O, bool... R, uint... A>
+constexpr uint Emit<Bytes<B...>, Holes<HoleAt<O, R, A>...>>::argCount;
+
+template <byte... B, uint... O, bool... R, uint... A>
+constexpr byte Emit<Bytes<B...>, Holes<HoleAt<O, R, A>...>>::code[];
+
+template <byte... B, uint... O, bool... R, uint... A>
+constexpr Stencil::Hole Emit<Bytes<B...>, Holes<HoleAt<O, R, A>...>>::holes[];
+
+template <class... Instructions>
+struct Sequence : Emit<typename Join<Instructions...>::bytes, typename Join<Instructions...>::holes> {};
+}
+}
@@ -0,0 +1,93 @@
+#include "stencil.h"
+
+#include <algorithm>
+
+namespace x86 {
+
+Stencil::Stencil() {
+}
+
+Stencil::Stencil(const byte *code, uint size, const Hole *holes, uint holeCount, const std::vector<std::string> &args)
+    : args(args), holes(holes, holes + holeCount) {
+    for (const Hole &hole : this->holes)
+        if (hole.arg >= args.size())
+            throw std::runtime_error("stencil hole " + toString(hole.arg, 10, 0) + " has no name");
+
+    memcpy(this->code.allocate(size), code, size);
+}
+
+uint Stencil::size() const {
+    return code.size();
+}
+
+const std::vector<std::string> &Stencil::getArgs() const {
+    return args;
+}
+
+uint Stencil::arg(const std::string &name) const {
+    auto i = find(args.begin(), args.end(), name);
+
+    if (i == args.end())
+        throw std::runtime_error("stencil has no hole '" + name + "'");
+
+    return i - args.begin();
+}
+
+void Stencil::copy(byte *dst, const int *values) const {
+    memcpy(dst, code.data(), code.size());
+
+    for (const Hole &hole : holes) {
+        byte *site = dst + hole.offset;
+
+        if (hole.relative)
+            *reinterpret_cast<int *>(site) += values[hole.arg] - reinterpret_cast<int>(site + 4);
+        else
+            *reinterpret_cast<int *>(site) += values[hole.arg];
+    }
+}
+
+Function Stencil::instantiate(const std::vector<int> &values) const {
+    if (values.size() != args.size())
+        throw std::runtime_error("stencil expects " + toString(args.size(), 10, 0) + " values");
+
+    Function f;
+    copy(f.code.allocate(code.size()), values.data());
+
+    // Relative holes reach outside the code and must follow it when it moves.
+    for (const Hole &hole : holes)
+        if (hole.relative)
+            f.relocations.push_back({ Function::Code, hole.offset, Function::External, true });
+
+    return f;
+}
+
+Function &Stencil::instantiate(CodeHeap &heap, const std::vector<int> &values) const {
+    if (values.size() != args.size())
+        throw std::runtime_error("stencil expects " + toString(args.size(), 10, 0) + " values");
+
+    Function &f = heap.allocate(code.size());
+    copy(f.code.data(), values.data());
+
+    for (const Hole &hole : holes)
+        if (hole.relative)
+            f.relocations.push_back({ Function::Code, hole.offset, Function::External, true });
+
+    return f;
+}
+
+const Stencil &StencilCache::get(const std::string &shape, const Generator &generator) {
+    auto i = stencils.find(shape);
+
+    if (i != stencils.end())
+        return i->second;
+
+    Compiler c;
+    generator(c);
+
+    return stencils[shape] = c.compileStencil();
+}
+
+void StencilCache::clear() {
+    stencils.clear();
+}
+}
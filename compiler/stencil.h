@@ -0,0 +1,63 @@
+#pragma once
+
+#include <functional>
+
+#include "codeheap.h"
+#include "compiler.h"
+
+namespace x86 {
+
+// Precompiled code fragment produced by Compiler::compileStencil. Every
+// reference to a symbol the fragment does not define becomes a hole, which
+// is filled in when the stencil is copied: absolute references receive the
+// value plus the emitted addend, relative ones the displacement to it.
+class Stencil {
+    friend class Compiler;
+
+public:
+    struct Hole {
+        uint offset;
+        bool relative;
+        uint arg;
+    };
+
+private:
+    ByteArray code;
+    std::vector<std::string> args;
+    std::vector<Hole> holes;
+
+public:
+    Stencil();
+
+    // A stencil over code assembled elsewhere, e.g. a fixed::Sequence.
+    Stencil(const byte *code, uint size, const Hole *holes, uint holeCount, const std::vector<std::string> &args);
+
+    uint size() const;
+
+    const std::vector<std::string> &getArgs() const;
+    uint arg(const std::string &name) const;
+
+    // Copies the fragment to dst and patches its holes; values are indexed
+    // like getArgs().
+    void copy(byte *dst, const int *values) const;
+
+    Function instantiate(const std::vector<int> &values) const;
+
+    // Copies straight into a slot of the heap's arena, with no code buffer
+    // of its own to allocate and then move there.
+    Function &instantiate(CodeHeap &heap, const std::vector<int> &values) const;
+};
+
+// Stencils keyed by the shape of the code they were generated for; the
+// generator only runs the first time a shape is requested.
+class StencilCache {
+    std::map<std::string, Stencil> stencils;
+
+public:
+    typedef std::function<void(Compiler &)> Generator;
+
+    const Stencil &get(const std::string &shape, const Generator &generator);
+
+    void clear();
+};
+}
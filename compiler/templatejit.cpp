@@ -0,0 +1,265 @@
+#include "templatejit.h"
+
+#include <algorithm>
+#include <set>
+
+namespace x86 {
+
+TemplateJIT::Emitter::Emitter(Compiler &c, const TemplateJIT &jit)
+    : c(c), jit(jit), operands(0), out(EAX) {
+    in[0] = in[1] = EAX;
+}
+
+void TemplateJIT::Emitter::call(const std::string &helper, uint args) const {
+    for (uint i = args; i-- > 0;)
+        c.push(in[i]);
+
+    c.push(EBX);
+    c.call(c.rel(helper));
+    c.add(4 * (args + 1), ESP);
+
+    if (out != EAX)
+        c.mov(EAX, out);
+}
+
+void TemplateJIT::Emitter::call(uint helper, uint args) const {
+    call(jit.helperName(helper), args);
+}
+
+void TemplateJIT::define(byte opcode, const std::string &name, uint operands, uint pops, uint pushes, const Template &emit, uint flags) {
+    if (pops > 2 || pushes > 1)
+        throw std::runtime_error("opcode " + name + " must pop at most 2 values and push at most 1");
+
+    if ((flags & Branch) && operands == 0)
+        throw std::runtime_error("branch opcode " + name + " has no target operand");
+
+    opcodes[opcode] = { name, operands, pops, pushes, flags, emit };
+}
+
+uint TemplateJIT::helper(const std::string &name, const void *address) {
+    if (addresses.count(name))
+        throw std::runtime_error("helper " + name + " already defined");
+
+    addresses[name] = address;
+    helpers.push_back(name);
+
+    return helpers.size() - 1;
+}
+
+const std::string &TemplateJIT::helperName(uint index) const {
+    if (index >= helpers.size())
+        throw std::runtime_error("undefined helper " + toString(index, 10, 0));
+
+    return helpers[index];
+}
+
+Function TemplateJIT::compile(const byte *code, uint size, const std::string &name) const {
+    std::set<uint> boundaries, targets;
+
+    for (uint offset = 0; offset < size;) {
+        const Opcode &op = opcode(code, size, offset);
+        boundaries.insert(offset);
+
+        if (op.flags & Branch)
+            targets.insert(*reinterpret_cast<const int *>(code + offset + 1));
+
+        offset += 1 + 4 * op.operands;
+    }
+
+    for (uint target : targets)
+        if (!boundaries.count(target))
+            throw std::runtime_error("branch to " + toString(target, 10, 0) + " in bytecode " + name + " is not an instruction");
+
+    auto label = [](uint offset) {
+        return "__bytecode" + toString(offset, 10, 0);
+    };
+
+    Compiler c;
+    c.function(name);
+
+    c.push(EBP);
+    c.mov(ESP, EBP);
+    c.push(EBX);
+    c.push(ESI);
+    c.push(EDI);
+    c.mov(c.ref(8, EBP), EBX);
+    c.mov(c.ref(EBX), ESI);
+
+    // Cached stack values, deepest first.
+    std::vector<Register> cache;
+
+    // Pushes all but the top keep cached values to the machine stack.
+    auto spill = [&](uint keep) {
+        uint count = cache.size() - keep;
+
+        for (uint i = 0; i < count; i++)
+            c.push(cache[i]);
+
+        cache.erase(cache.begin(), cache.begin() + count);
+    };
+
+    auto freeRegister = [&]() {
+        return std::find(cache.begin(), cache.end(), EAX) == cache.end() ? EAX : ECX;
+    };
+
+    bool reachable = true;
+
+    for (uint offset = 0; offset < size;) {
+        const Opcode &op = opcode(code, size, offset);
+
+        if (targets.count(offset)) {
+            if (reachable)
+                spill(0);
+
+            cache.clear();
+            c.label(label(offset));
+        }
+
+        while (cache.size() < op.pops) {
+            Register reg = freeRegister();
+            c.pop(reg);
+            cache.insert(cache.begin(), reg);
+        }
+
+        if (op.flags & (Branch | Calls))
+            spill(op.pops);
+
+        Emitter e(c, *this);
+        e.operands = reinterpret_cast<const int *>(code + offset + 1);
+        e.exit = "__bytecodeExit";
+
+        if (op.flags & Branch)
+            e.target = label(e.operands[0]);
+
+        for (uint i = 0; i < op.pops; i++)
+            e.in[i] = cache[cache.size() - op.pops + i];
+
+        cache.resize(cache.size() - op.pops);
+
+        if (op.pushes) {
+            if (op.pops)
+                e.out = e.in[0];
+            else {
+                if (cache.size() == 2)
+                    spill(1);
+
+                e.out = freeRegister();
+            }
+        }
+
+        op.emit(e);
+
+        if (op.pushes)
+            cache.push_back(e.out);
+
+        reachable = !(op.flags & Terminal);
+
+        if (!reachable)
+            cache.clear();
+
+        offset += 1 + 4 * op.operands;
+    }
+
+    if (reachable)
+        throw std::runtime_error("bytecode " + name + " runs past its end");
+
+    c.label("__bytecodeExit");
+    c.lea(c.ref(-12, EBP), ESP);
+    c.pop(EDI);
+    c.pop(ESI);
+    c.pop(EBX);
+    c.pop(EBP);
+    c.ret();
+
+    for (const auto &address : addresses)
+        c.relocate(address.first, reinterpret_cast<int>(address.second));
+
+    return c.compileFunction();
+}
+
+Function TemplateJIT::compile(const std::vector<byte> &code, const std::string &name) const {
+    return compile(code.data(), code.size(), name);
+}
+
+TemplateJIT TemplateJIT::standard() {
+    TemplateJIT jit;
+
+    jit.define(Push, "push", 1, 0, 1, [](Emitter &e) {
+        e.c.mov(e.operands[0], e.out);
+    });
+
+    jit.define(Load, "load", 1, 0, 1, [](Emitter &e) {
+        e.c.mov(e.c.ref(4 * e.operands[0], ESI), e.out);
+    });
+
+    jit.define(Store, "store", 1, 1, 0, [](Emitter &e) {
+        e.c.mov(e.in[0], e.c.ref(4 * e.operands[0], ESI));
+    });
+
+    jit.define(Drop, "drop", 0, 1, 0, [](Emitter &) {
+    });
+
+    jit.define(Add, "add", 0, 2, 1, [](Emitter &e) {
+        e.c.add(e.in[1], e.in[0]);
+    });
+
+    jit.define(Sub, "sub", 0, 2, 1, [](Emitter &e) {
+        e.c.sub(e.in[1], e.in[0]);
+    });
+
+    jit.define(Mul, "mul", 0, 2, 1, [](Emitter &e) {
+        e.c.imul(e.in[1], e.in[0]);
+    });
+
+    // Cached values live in %eax and %ecx, whose low bytes are %al and %cl.
+    jit.define(Less, "less", 0, 2, 1, [](Emitter &e) {
+        e.c.cmp(e.in[1], e.in[0]);
+        e.c.set(L, static_cast<ByteRegister>(e.out));
+        e.c.movzbl(static_cast<ByteRegister>(e.out), e.out);
+    });
+
+    jit.define(Equal, "equal", 0, 2, 1, [](Emitter &e) {
+        e.c.cmp(e.in[1], e.in[0]);
+        e.c.set(E, static_cast<ByteRegister>(e.out));
+        e.c.movzbl(static_cast<ByteRegister>(e.out), e.out);
+    });
+
+    jit.define(Jump, "jump", 1, 0, 0, [](Emitter &e) {
+        e.c.jmp(e.c.rel(e.target));
+    }, Branch | Terminal);
+
+    jit.define(JumpIfZero, "jz", 1, 1, 0, [](Emitter &e) {
+        e.c.test(e.in[0], e.in[0]);
+        e.c.j(E, e.c.rel(e.target));
+    }, Branch);
+
+    jit.define(Call1, "call1", 1, 1, 1, [](Emitter &e) {
+        e.call(e.operands[0], 1);
+    }, Calls);
+
+    jit.define(Call2, "call2", 1, 2, 1, [](Emitter &e) {
+        e.call(e.operands[0], 2);
+    }, Calls);
+
+    jit.define(Return, "return", 0, 1, 0, [](Emitter &e) {
+        if (e.in[0] != EAX)
+            e.c.mov(e.in[0], EAX);
+
+        e.c.jmp(e.c.rel(e.exit));
+    }, Terminal);
+
+    return jit;
+}
+
+const TemplateJIT::Opcode &TemplateJIT::opcode(const byte *code, uint size, uint offset) const {
+    auto i = opcodes.find(code[offset]);
+
+    if (i == opcodes.end())
+        throw std::runtime_error("undefined opcode " + toString(code[offset], 10, 0) + " at " + toString(offset, 10, 0));
+
+    if (offset + 1 + 4 * i->second.operands > size)
+        throw std::runtime_error("truncated " + i->second.name + " at " + toString(offset, 10, 0));
+
+    return i->second;
+}
+}
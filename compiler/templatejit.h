@@ -0,0 +1,102 @@
+#pragma once
+
+#include <functional>
+
+#include "compiler.h"
+
+namespace x86 {
+
+// State of the VM running JIT-compiled bytecode, passed as the only
+// argument: int f(VMState *state). The state stays in %ebx and locals in
+// %esi for the whole function; helpers are called as
+// int helper(VMState *state, int a, int b) with as many ints as they pop.
+struct VMState {
+    int *locals;
+    void *context;
+};
+
+// Template JIT for a stack bytecode. Each opcode is defined with its stack
+// effect and an emitter template; compile() strings the templates together
+// in bytecode order. Up to two values from the top of the stack are cached
+// in %eax and %ecx, the rest live on the machine stack. Templates see their
+// inputs in registers and leave their result in a register the JIT picks;
+// the cache is flushed to the machine stack at branches, branch targets
+// and helper calls, so every block starts with an empty cache.
+//
+// An instruction is an opcode byte followed by its operands, 4-byte
+// little-endian ints. Branch operands are absolute bytecode offsets.
+class TemplateJIT {
+public:
+    enum Flags {
+        Branch = 1,   // operand 0 is a branch target
+        Calls = 2,    // calls a helper, which clobbers %eax, %ecx and %edx
+        Terminal = 4  // never falls through
+    };
+
+    // What a template works with. For an opcode popping values, out is the
+    // deepest input; %edx is free to clobber.
+    struct Emitter {
+        Compiler &c;
+        const TemplateJIT &jit;
+        const int *operands;
+        Register in[2]; // inputs, deepest first
+        Register out;
+        std::string target; // label of the branch target
+        std::string exit;   // label returning %eax
+
+        Emitter(Compiler &c, const TemplateJIT &jit);
+
+        // Calls a helper with the state and the inputs, leaving its result
+        // in out.
+        void call(const std::string &helper, uint args) const;
+        void call(uint helper, uint args) const;
+    };
+
+    typedef std::function<void(Emitter &)> Template;
+
+    // Opcodes of standard(); operands in parentheses.
+    enum StandardOpcode {
+        Push,       // (value)        -> value
+        Load,       // (local)        -> locals[local]
+        Store,      // (local) value  ->
+        Drop,       // value          ->
+        Add,        // a b            -> a + b
+        Sub,        // a b            -> a - b
+        Mul,        // a b            -> a * b
+        Less,       // a b            -> a < b
+        Equal,      // a b            -> a == b
+        Jump,       // (target)
+        JumpIfZero, // (target) value ->
+        Call1,      // (helper) a     -> helper(state, a)
+        Call2,      // (helper) a b   -> helper(state, a, b)
+        Return      // value
+    };
+
+private:
+    struct Opcode {
+        std::string name;
+        uint operands, pops, pushes, flags;
+        Template emit;
+    };
+
+    std::map<byte, Opcode> opcodes;
+    std::vector<std::string> helpers;
+    std::map<std::string, const void *> addresses;
+
+public:
+    void define(byte opcode, const std::string &name, uint operands, uint pops, uint pushes, const Template &emit, uint flags = 0);
+
+    // Registers a runtime helper; returns its index for call(uint, uint).
+    uint helper(const std::string &name, const void *address);
+    const std::string &helperName(uint index) const;
+
+    Function compile(const byte *code, uint size, const std::string &name = "bytecode") const;
+    Function compile(const std::vector<byte> &code, const std::string &name = "bytecode") const;
+
+    // A JIT with the opcodes of StandardOpcode.
+    static TemplateJIT standard();
+
+private:
+    const Opcode &opcode(const byte *code, uint size, uint offset) const;
+};
+}
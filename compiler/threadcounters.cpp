@@ -0,0 +1,117 @@
+#include "threadcounters.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__linux__) && defined(__i386__)
+#define THREAD_COUNTERS_SUPPORTED
+#endif
+
+namespace x86 {
+
+bool ThreadCounters::used[ThreadCounters::maxSlots] = { true };
+uint ThreadCounters::retired[ThreadCounters::maxSlots];
+std::vector<uint *> ThreadCounters::threads;
+std::mutex ThreadCounters::mutex;
+
+// Initial-exec TLS keeps the offset from the thread pointer fixed, which
+// lets generated code address the slots without asking the runtime.
+static __thread uint slots[ThreadCounters::maxSlots] __attribute__((tls_model("initial-exec")));
+
+// Lives as long as its thread; folds the thread's counts into retired on
+// exit.
+struct ThreadCounters::Registration {
+    Registration();
+    ~Registration();
+};
+
+bool ThreadCounters::supported() {
+#ifdef THREAD_COUNTERS_SUPPORTED
+    return true;
+#else
+    return false;
+#endif
+}
+
+int ThreadCounters::offset() {
+#ifdef THREAD_COUNTERS_SUPPORTED
+    uint threadPointer;
+
+    asm("movl %%gs:0, %0"
+        : "=r"(threadPointer));
+
+    return reinterpret_cast<uint>(slots) - threadPointer;
+#else
+    throw std::runtime_error("per-thread counters are not supported on this platform");
+#endif
+}
+
+uint ThreadCounters::allocate(uint count) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (uint first = 1, length = 0; first + length < maxSlots;)
+        if (used[first + length])
+            first += length + 1, length = 0;
+        else if (++length == count) {
+            for (uint i = first; i < first + count; i++) {
+                used[i] = true;
+                clear(i);
+            }
+
+            return first;
+        }
+
+    throw std::runtime_error("per-thread counter slots are exhausted");
+}
+
+void ThreadCounters::release(uint first, uint count) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (uint i = first; i < first + count; i++)
+        used[i] = false;
+}
+
+uint ThreadCounters::read(uint slot) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    uint sum = retired[slot];
+
+    for (uint *thread : threads)
+        sum += __atomic_load_n(&thread[slot], __ATOMIC_RELAXED);
+
+    return sum;
+}
+
+void ThreadCounters::reset(uint slot) {
+    std::lock_guard<std::mutex> lock(mutex);
+    clear(slot);
+}
+
+__attribute__((force_align_arg_pointer)) void ThreadCounters::enterThread() {
+    static thread_local Registration registration;
+    (void)registration;
+}
+
+void ThreadCounters::clear(uint slot) {
+    retired[slot] = 0;
+
+    for (uint *thread : threads)
+        __atomic_store_n(&thread[slot], 0, __ATOMIC_RELAXED);
+}
+
+ThreadCounters::Registration::Registration() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    threads.push_back(slots);
+    slots[0] = 1;
+}
+
+ThreadCounters::Registration::~Registration() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (uint i = 1; i < maxSlots; i++)
+        retired[i] += slots[i];
+
+    threads.erase(std::find(threads.begin(), threads.end(), slots));
+}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+
+namespace x86 {
+
+// Counter slots with a copy in every thread, for code instrumented with
+// ThreadCounters. The copies live in static TLS, so generated code bumps
+// its own thread's copy with a plain %gs-relative add. A thread registers
+// the first time it enters an instrumented function; reading a slot sums
+// the copies of the live threads and what exited threads left behind.
+// Only available on i386 Linux, where %gs holds the thread pointer.
+class ThreadCounters {
+public:
+    static const uint maxSlots = 4096;
+
+private:
+    struct Registration;
+
+    // Slot 0 is the flag telling generated code the thread has registered.
+    static bool used[maxSlots];
+    static uint retired[maxSlots];
+    static std::vector<uint *> threads;
+    static std::mutex mutex;
+
+public:
+    static bool supported();
+
+    // Offset of slot 0 from the thread pointer, the same in every thread.
+    static int offset();
+
+    // Reserves count consecutive slots, zeroed in every thread; returns the
+    // first.
+    static uint allocate(uint count);
+    static void release(uint first, uint count);
+
+    static uint read(uint slot);
+    static void reset(uint slot);
+
+    // Called by generated code on a thread's first entry.
+    static void enterThread();
+
+private:
+    static void clear(uint slot);
+};
+}
@@ -5,6 +5,7 @@ CONFIG -= qt
 
 LIBS += -L../compiler/release -lcompiler
 LIBS += -L../../unit/release -lunit
+LIBS += -lrt
 
 PRE_TARGETDEPS += ../compiler/release/libcompiler.a
 